@@ -938,6 +938,9 @@ PRODUCT_COPY_FILES += \
 PRODUCT_PACKAGES += \
     android.hardware.power.stats@1.0-service.pixel
 
+PRODUCT_COPY_FILES += \
+    $(LOCAL_PATH)/powerstats/power_entities.conf:$(TARGET_COPY_OUT_VENDOR)/etc/powerstats/power_entities.conf
+
 PRODUCT_PACKAGES_DEBUG += \
     pwrstats_util
 
@@ -0,0 +1,190 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Android Open Source Project nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <endian.h>
+#include <string.h>
+#if defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#include "gpt-crc32.h"
+
+/******************************************************************************
+ * DEFINE SECTION
+ ******************************************************************************/
+//Reflected CRC32 polynomial
+#define CRC32_POLY 0xedb88320
+
+/******************************************************************************
+ * TYPES
+ ******************************************************************************/
+typedef uint32_t (*crc32_fn)(uint32_t crc, const uint8_t *buf, size_t len);
+
+//tables[0] is the classic byte-at-a-time table. tables[k][i] is the CRC of
+//byte i followed by k zero bytes, which lets 8 input bytes be folded in
+//with independent lookups.
+struct crc32_tables {
+        uint32_t t[8][256];
+        crc32_tables() {
+                for (uint32_t i = 0; i < 256; i++) {
+                        uint32_t c = i;
+                        for (int k = 0; k < 8; k++)
+                                c = (c & 1) ? (c >> 1) ^ CRC32_POLY : c >> 1;
+                        t[0][i] = c;
+                }
+                for (uint32_t i = 0; i < 256; i++)
+                        for (int k = 1; k < 8; k++)
+                                t[k][i] = (t[k - 1][i] >> 8) ^
+                                        t[0][t[k - 1][i] & 0xff];
+        }
+};
+
+/******************************************************************************
+ * FUNCTIONS
+ ******************************************************************************/
+static const crc32_tables &crc32_get_tables()
+{
+        static const crc32_tables tables;
+        return tables;
+}
+
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+        const uint32_t (*t)[256] = crc32_get_tables().t;
+
+        crc = ~crc;
+        while (len && ((uintptr_t) buf & 7)) {
+                crc = t[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+                len--;
+        }
+        while (len >= 8) {
+                uint32_t lo, hi;
+                memcpy(&lo, buf, sizeof(lo));
+                memcpy(&hi, buf + 4, sizeof(hi));
+                lo = le32toh(lo) ^ crc;
+                hi = le32toh(hi);
+                crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^
+                        t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+                        t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^
+                        t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+                buf += 8;
+                len -= 8;
+        }
+        while (len--)
+                crc = t[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+        return ~crc;
+}
+
+#if defined(__aarch64__) && defined(__clang__)
+__attribute__((target("crc")))
+static uint32_t crc32_armv8(uint32_t crc, const uint8_t *buf, size_t len)
+{
+        crc = ~crc;
+        while (len && ((uintptr_t) buf & 7)) {
+                crc = __builtin_arm_crc32b(crc, *buf++);
+                len--;
+        }
+        while (len >= 8) {
+                uint64_t v;
+                memcpy(&v, buf, sizeof(v));
+                crc = __builtin_arm_crc32d(crc, v);
+                buf += 8;
+                len -= 8;
+        }
+        while (len--)
+                crc = __builtin_arm_crc32b(crc, *buf++);
+        return ~crc;
+}
+#endif
+
+static crc32_fn crc32_select()
+{
+#if defined(__aarch64__) && defined(__clang__)
+        if (getauxval(AT_HWCAP) & HWCAP_CRC32)
+                return crc32_armv8;
+#endif
+        return crc32_slice8;
+}
+
+uint32_t gpt_crc32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+        static const crc32_fn impl = crc32_select();
+        return impl(crc, buf, len);
+}
+
+//Multiply a and b modulo the CRC polynomial, both in reflected form
+static uint32_t crc32_multmodp(uint32_t a, uint32_t b)
+{
+        uint32_t m = (uint32_t) 1 << 31;
+        uint32_t p = 0;
+
+        while (m) {
+                if (a & m)
+                        p ^= b;
+                m >>= 1;
+                b = (b & 1) ? (b >> 1) ^ CRC32_POLY : b >> 1;
+        }
+        return p;
+}
+
+//x^(8 * len) modulo the CRC polynomial, i.e. the effect of appending len
+//zero bytes to a message
+static uint32_t crc32_x8nmodp(size_t len)
+{
+        //x2n[k] is x^(2^k)
+        static const struct x2n_table {
+                uint32_t x2n[64];
+                x2n_table() {
+                        x2n[0] = (uint32_t) 1 << 30;
+                        for (int k = 1; k < 64; k++)
+                                x2n[k] = crc32_multmodp(x2n[k - 1], x2n[k - 1]);
+                }
+        } table;
+        uint32_t p = (uint32_t) 1 << 31;
+        int k = 3;
+
+        while (len) {
+                if (len & 1)
+                        p = crc32_multmodp(table.x2n[k], p);
+                len >>= 1;
+                k++;
+        }
+        return p;
+}
+
+//The CRCs of two equally long buffers differ by the CRC of their XOR with
+//a zero initial value and no final inversion. Zero bytes ahead of the
+//change leave that at zero and the ones after it shift it by x^(8*tail_len).
+uint32_t gpt_crc32_apply_delta(uint32_t crc, const uint8_t *delta,
+                size_t len, size_t tail_len)
+{
+        uint32_t raw = ~gpt_crc32(0xffffffff, delta, len);
+        return crc ^ crc32_multmodp(crc32_x8nmodp(tail_len), raw);
+}
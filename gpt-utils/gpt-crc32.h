@@ -0,0 +1,49 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Android Open Source Project nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __GPT_CRC32_H__
+#define __GPT_CRC32_H__
+#include <stddef.h>
+#include <stdint.h>
+
+//CRC32 (IEEE 802.3, as used by GPT) with the same conventions as zlib's
+//crc32(): pass 0 to start and the previous result to continue over more
+//data. Uses the ARMv8 CRC32 instructions when the CPU has them and a
+//slice-by-8 table implementation otherwise.
+uint32_t gpt_crc32(uint32_t crc, const uint8_t *buf, size_t len);
+
+//Update the CRC of a buffer for an in-place change of len of its bytes,
+//without reading the rest of it. delta holds the XOR of the old and the
+//new contents of the changed bytes and tail_len is the number of bytes
+//following them up to the end of the buffer. Returns the CRC of the
+//changed buffer given crc, the CRC of the buffer before the change.
+uint32_t gpt_crc32_apply_delta(uint32_t crc, const uint8_t *delta,
+                size_t len, size_t tail_len);
+#endif /* __GPT_CRC32_H__ */
@@ -47,15 +47,19 @@
 #include <inttypes.h>
 #include <linux/kernel.h>
 #include <asm/byteorder.h>
+#include <pthread.h>
+#include <algorithm>
 #include <map>
+#include <new>
+#include <unordered_map>
 #include <vector>
 #include <string>
 #define LOG_TAG "gpt-utils"
 #include <cutils/log.h>
 #include <cutils/properties.h>
 #include "gpt-utils.h"
+#include "gpt-crc32.h"
 #include <endian.h>
-#include <zlib.h>
 
 
 /******************************************************************************
@@ -65,10 +69,11 @@
 /* list the names of the backed-up partitions to be swapped */
 /* extension used for the backup partitions - tzbak, abootbak, etc. */
 #define BAK_PTN_NAME_EXT    "bak"
-#define XBL_PRIMARY         "/dev/block/platform/soc/1d84000.ufshc/by-name/xbl"
-#define XBL_BACKUP          "/dev/block/platform/soc/1d84000.ufshc/by-name/xblbak"
-#define XBL_AB_PRIMARY      "/dev/block/platform/soc/1d84000.ufshc/by-name/xbl_a"
-#define XBL_AB_SECONDARY    "/dev/block/platform/soc/1d84000.ufshc/by-name/xbl_b"
+/* XBL partition names under BOOT_DEV_DIR */
+#define XBL_PRIMARY         PTN_XBL
+#define XBL_BACKUP          PTN_XBL BAK_PTN_NAME_EXT
+#define XBL_AB_PRIMARY      PTN_XBL AB_SLOT_A_SUFFIX
+#define XBL_AB_SECONDARY    PTN_XBL AB_SLOT_B_SUFFIX
 /* GPT defines */
 #define MAX_LUNS                    26
 //Size of the buffer that needs to be passed to the UFS ioctl
@@ -84,24 +89,29 @@
 #define LUN_NAME_START_LOC (sizeof("/dev/block/") - 1)
 #define BOOT_LUN_A_ID 1
 #define BOOT_LUN_B_ID 2
+//Size of the standard 128 entry partition array. Loading a GPT header also
+//reads this much of the adjacent entry array, so a GPT laid out the usual
+//way is loaded with a single read per copy.
+#define GPT_PENTRY_ARR_PREFETCH_SIZE    (128 * PTN_ENTRY_SIZE)
+//Sanity limit on the size of a partition entry array
+#define GPT_PENTRY_ARR_MAX_SIZE         (1024 * 1024)
+//Size of the fields of a GPT header covered by its CRC at the least
+#define GPT_HEADER_MIN_SIZE             92
+//Position of an entry missing from a partition entry array
+#define GPT_PENTRY_POS_NONE             UINT32_MAX
+//Parts of a gpt_disk waiting to be written back by gpt_disk_flush
+#define GPT_DIRTY_HDR                   (1 << 0)
+#define GPT_DIRTY_HDR_BAK               (1 << 1)
+#define GPT_DIRTY_PENTRY_ARR            (1 << 2)
+#define GPT_DIRTY_PENTRY_ARR_BAK        (1 << 3)
 /******************************************************************************
  * MACROS
  ******************************************************************************/
 
 
-#define GET_4_BYTES(ptr)    ((uint32_t) *((uint8_t *)(ptr)) | \
-        ((uint32_t) *((uint8_t *)(ptr) + 1) << 8) | \
-        ((uint32_t) *((uint8_t *)(ptr) + 2) << 16) | \
-        ((uint32_t) *((uint8_t *)(ptr) + 3) << 24))
+#define GET_4_BYTES(ptr)    gpt_get_le32((const uint8_t *)(ptr))
 
-#define GET_8_BYTES(ptr)    ((uint64_t) *((uint8_t *)(ptr)) | \
-        ((uint64_t) *((uint8_t *)(ptr) + 1) << 8) | \
-        ((uint64_t) *((uint8_t *)(ptr) + 2) << 16) | \
-        ((uint64_t) *((uint8_t *)(ptr) + 3) << 24) | \
-        ((uint64_t) *((uint8_t *)(ptr) + 4) << 32) | \
-        ((uint64_t) *((uint8_t *)(ptr) + 5) << 40) | \
-        ((uint64_t) *((uint8_t *)(ptr) + 6) << 48) | \
-        ((uint64_t) *((uint8_t *)(ptr) + 7) << 56))
+#define GET_8_BYTES(ptr)    gpt_get_le64((const uint8_t *)(ptr))
 
 #define PUT_4_BYTES(ptr, y)   *((uint8_t *)(ptr)) = (y) & 0xff; \
         *((uint8_t *)(ptr) + 1) = ((y) >> 8) & 0xff; \
@@ -123,6 +133,34 @@ struct update_data {
      char lun_list[MAX_LUNS][PATH_MAX];
      uint32_t num_valid_entries;
 };
+//State of one prepare_partitions run on a LUN of an update_data list
+struct update_worker {
+     pthread_t thread;
+     int started;
+     enum boot_update_stage stage;
+     const char *lun_path;
+     int rcode;
+};
+//Positions of the entries in a partition entry array, keyed by partition
+//name. A partition and its backup twin (name-bak) share the key of the
+//partition, so the positions under a key are the entries gpt_pentry_seek
+//matches for that name, in array order. The two slots of an A/B partition
+//(name_a and name_b) are also paired under the name without the suffix,
+//GPT_PENTRY_POS_NONE standing for a slot the array lacks.
+struct gpt_pentry_index {
+     unordered_map<string, vector<uint32_t>> ptns;
+     unordered_map<string, pair<uint32_t, uint32_t>> slots;
+};
+//Layout of the boot device, scanned until found once per process since it
+//does not change while the system is up
+struct gpt_topology {
+     int is_ufs;
+     //Partition name to the path of the LUN holding it(eg: /dev/block/sda).
+     //Only filled in on UFS devices.
+     map<string, string> ptn_lun;
+     //LUN path to the path of its scsi generic node(eg: /dev/sg0)
+     map<string, string> lun_sg;
+};
 
 /******************************************************************************
  * FUNCTIONS
@@ -130,7 +168,8 @@ struct update_data {
 /**
  *  ==========================================================================
  *
- *  \brief  Read/Write len bytes from/to block dev
+ *  \brief  Read/Write len bytes from/to block dev, without moving the
+ *  file offset. Writes are not synced, see gpt_disk_flush.
  *
  *  \param [in] fd      block dev file descriptor (returned from open)
  *  \param [in] rw      RW flag: 0 - read, != 0 - write
@@ -144,36 +183,53 @@ struct update_data {
  */
 static int blk_rw(int fd, int rw, int64_t offset, uint8_t *buf, unsigned len)
 {
-    int r;
-
-    if (lseek64(fd, offset, SEEK_SET) < 0) {
-        fprintf(stderr, "block dev lseek64 %" PRIi64 " failed: %s\n", offset,
-                strerror(errno));
-        return -1;
-    }
+    ssize_t r;
 
     if (rw)
-        r = write(fd, buf, len);
+        r = pwrite64(fd, buf, len, offset);
     else
-        r = read(fd, buf, len);
+        r = pread64(fd, buf, len, offset);
 
     if (r < 0) {
         fprintf(stderr, "block dev %s failed: %s\n", rw ? "write" : "read",
                 strerror(errno));
-    } else {
-        if (rw) {
-            r = fsync(fd);
-            if (r < 0)
-                fprintf(stderr, "fsync failed: %s\n", strerror(errno));
-        } else {
-            r = 0;
-        }
+        return -1;
     }
+    if ((unsigned) r != len) {
+        fprintf(stderr, "block dev short %s at %" PRIi64 ": %zd of %u bytes\n",
+                rw ? "write" : "read", offset, r, len);
+        return -1;
+    }
+    return 0;
+}
 
-    return r;
+
+
+/* Partition names in GPT are UTF-16 - ignoring UTF-16 2nd byte */
+void gpt_pentry_get_name(const uint8_t *pentry,
+                                char name8[MAX_GPT_NAME_SIZE / 2 + 1])
+{
+    const uint8_t *pentry_name = pentry + PARTITION_NAME_OFFSET;
+    unsigned i;
+
+    for (i = 0; i < MAX_GPT_NAME_SIZE / 2; i++)
+        name8[i] = pentry_name[i * 2];
+    name8[i] = 0;
 }
 
+/* Checks if pentry is partition ptn_name or it's backup twin (name-bak) */
+static int gpt_pentry_match(const char *ptn_name, unsigned len,
+                            const uint8_t *pentry)
+{
+    char name8[MAX_GPT_NAME_SIZE / 2 + 1];
 
+    if (len > MAX_GPT_NAME_SIZE / 2)
+        return 0;
+    gpt_pentry_get_name(pentry, name8);
+    if (strncmp(ptn_name, name8, len))
+        return 0;
+    return name8[len] == 0 || !strcmp(&name8[len], BAK_PTN_NAME_EXT);
+}
 
 /**
  *  ==========================================================================
@@ -195,25 +251,125 @@ static uint8_t *gpt_pentry_seek(const char *ptn_name,
                                 const uint8_t *pentries_end,
                                 uint32_t pentry_size)
 {
-    char *pentry_name;
+    const uint8_t *pentry;
     unsigned len = strlen(ptn_name);
 
-    for (pentry_name = (char *) (pentries_start + PARTITION_NAME_OFFSET);
-         pentry_name < (char *) pentries_end; pentry_name += pentry_size) {
-        char name8[MAX_GPT_NAME_SIZE / 2];
-        unsigned i;
-
-        /* Partition names in GPT are UTF-16 - ignoring UTF-16 2nd byte */
-        for (i = 0; i < sizeof(name8); i++)
-            name8[i] = pentry_name[i * 2];
-        if (!strncmp(ptn_name, name8, len))
-            if (name8[len] == 0 || !strcmp(&name8[len], BAK_PTN_NAME_EXT))
-                return (uint8_t *) (pentry_name - PARTITION_NAME_OFFSET);
+    for (pentry = pentries_start; pentry + PTN_ENTRY_SIZE <= pentries_end;
+         pentry += pentry_size) {
+        if (gpt_pentry_match(ptn_name, len, pentry))
+            return (uint8_t *) pentry;
     }
 
     return NULL;
 }
 
+/**
+ *  ==========================================================================
+ *
+ *  \brief  Builds the name index of a partition entries array
+ *
+ *  \param [in] pentries_start  Partition entries array start pointer
+ *  \param [in] pentries_end    Partition entries array end pointer
+ *  \param [in] pentry_size     Single partition entry size [bytes]
+ *
+ *  \return  Index to be released with delete, NULL on failure
+ *
+ *  ==========================================================================
+ */
+static struct gpt_pentry_index *gpt_pentry_index_build(
+                                const uint8_t *pentries_start,
+                                const uint8_t *pentries_end,
+                                uint32_t pentry_size)
+{
+    struct gpt_pentry_index *index = new (nothrow) gpt_pentry_index;
+    const uint8_t *pentry;
+    uint32_t pos = 0;
+
+    if (!index)
+        return NULL;
+    for (pentry = pentries_start; pentry + PTN_ENTRY_SIZE <= pentries_end;
+         pentry += pentry_size, pos++) {
+        char name8[MAX_GPT_NAME_SIZE / 2 + 1];
+        size_t len;
+
+        gpt_pentry_get_name(pentry, name8);
+        len = strlen(name8);
+        if (len == 0)
+            continue;
+        if (len > strlen(AB_SLOT_A_SUFFIX)) {
+            const char *suffix = &name8[len - strlen(AB_SLOT_A_SUFFIX)];
+            int is_a = !strcmp(suffix, AB_SLOT_A_SUFFIX);
+
+            if (is_a || !strcmp(suffix, AB_SLOT_B_SUFFIX)) {
+                auto &slots = index->slots.emplace(
+                                string(name8, suffix - name8),
+                                make_pair(GPT_PENTRY_POS_NONE,
+                                          GPT_PENTRY_POS_NONE)).first->second;
+                uint32_t &slot = is_a ? slots.first : slots.second;
+
+                if (slot == GPT_PENTRY_POS_NONE)
+                    slot = pos;
+            }
+        }
+        if (len > strlen(BAK_PTN_NAME_EXT) &&
+            !strcmp(&name8[len - strlen(BAK_PTN_NAME_EXT)], BAK_PTN_NAME_EXT))
+            name8[len - strlen(BAK_PTN_NAME_EXT)] = 0;
+        index->ptns[name8].push_back(pos);
+    }
+    return index;
+}
+
+/**
+ *  ==========================================================================
+ *
+ *  \brief  gpt_pentry_seek using the name index of the array, or of an
+ *  array it was copied from with entries swapped only between twins.
+ *
+ *  \param [in] index           Name index of the array, may be NULL
+ *  \param [in] ptn_name        Partition name to seek
+ *  \param [in] pentries_start  Partition entries array start pointer
+ *  \param [in] pentries_from   Entry to start seeking from
+ *  \param [in] pentries_end    Partition entries array end pointer
+ *  \param [in] pentry_size     Single partition entry size [bytes]
+ *
+ *  \return  First partition entry pointer from pentries_from that matches
+ *  the name or NULL
+ *
+ *  ==========================================================================
+ */
+static uint8_t *gpt_pentry_find(const struct gpt_pentry_index *index,
+                                const char *ptn_name,
+                                const uint8_t *pentries_start,
+                                const uint8_t *pentries_from,
+                                const uint8_t *pentries_end,
+                                uint32_t pentry_size)
+{
+    unsigned len = strlen(ptn_name);
+
+    //Names that are empty or themselves end in -bak span two keys
+    if (!index || len == 0 ||
+        (len >= strlen(BAK_PTN_NAME_EXT) &&
+         !strcmp(&ptn_name[len - strlen(BAK_PTN_NAME_EXT)], BAK_PTN_NAME_EXT)))
+        return gpt_pentry_seek(ptn_name, pentries_from, pentries_end,
+                               pentry_size);
+
+    auto it = index->ptns.find(ptn_name);
+    if (it == index->ptns.end())
+        return NULL;
+    for (uint32_t pos : it->second) {
+        const uint8_t *pentry = pentries_start + (uint64_t) pos * pentry_size;
+        if (pentry < pentries_from)
+            continue;
+        if (pentry + PTN_ENTRY_SIZE > pentries_end)
+            break;
+        if (gpt_pentry_match(ptn_name, len, pentry))
+            return (uint8_t *) pentry;
+        //Stale index, the names in the array have been changed
+        break;
+    }
+    return gpt_pentry_seek(ptn_name, pentries_from, pentries_end, pentry_size);
+}
+
 
 
 /**
@@ -221,47 +377,64 @@ static uint8_t *gpt_pentry_seek(const char *ptn_name,
  *
  *  \brief  Swaps boot chain in GPT partition entries array
  *
+ *  \param [in] index           Name index of the array, may be NULL
  *  \param [in] pentries_start  Partition entries array start
  *  \param [in] pentries_end    Partition entries array end
  *  \param [in] pentry_size     Single partition entry size
+ *  \param [in,out] crc         CRC of the array, updated for the swapped
+ *                              entries
  *
  *  \return  0 on success, 1 if no backup partitions found
  *
  *  ==========================================================================
  */
-static int gpt_boot_chain_swap(const uint8_t *pentries_start,
+static int gpt_boot_chain_swap(const struct gpt_pentry_index *index,
+                                const uint8_t *pentries_start,
                                 const uint8_t *pentries_end,
-                                uint32_t pentry_size)
+                                uint32_t pentry_size,
+                                uint32_t *crc)
 {
     const char ptn_swap_list[][MAX_GPT_NAME_SIZE] = { PTN_SWAP_LIST };
 
     int backup_not_found = 1;
+    int is_ufs = gpt_utils_is_ufs_device();
     unsigned i;
 
     for (i = 0; i < ARRAY_SIZE(ptn_swap_list); i++) {
         uint8_t *ptn_entry;
         uint8_t *ptn_bak_entry;
         uint8_t ptn_swap[PTN_ENTRY_SIZE];
+        uint8_t ptn_delta[PTN_ENTRY_SIZE];
+        unsigned j;
         //Skip the xbl partition on UFS devices. That is handled
         //seperately.
-        if (gpt_utils_is_ufs_device() && !strncmp(ptn_swap_list[i],
+        if (is_ufs && !strncmp(ptn_swap_list[i],
                                 PTN_XBL,
                                 strlen(PTN_XBL)))
             continue;
 
-        ptn_entry = gpt_pentry_seek(ptn_swap_list[i], pentries_start,
-                        pentries_end, pentry_size);
+        ptn_entry = gpt_pentry_find(index, ptn_swap_list[i], pentries_start,
+                        pentries_start, pentries_end, pentry_size);
         if (ptn_entry == NULL)
             continue;
 
-        ptn_bak_entry = gpt_pentry_seek(ptn_swap_list[i],
-                        ptn_entry + pentry_size, pentries_end, pentry_size);
+        ptn_bak_entry = gpt_pentry_find(index, ptn_swap_list[i],
+                        pentries_start, ptn_entry + pentry_size,
+                        pentries_end, pentry_size);
         if (ptn_bak_entry == NULL) {
             fprintf(stderr, "'%s' partition not backup - skip safe update\n",
                     ptn_swap_list[i]);
             continue;
         }
 
+        /* both entries change by the XOR of the two */
+        for (j = 0; j < PTN_ENTRY_SIZE; j++)
+            ptn_delta[j] = ptn_entry[j] ^ ptn_bak_entry[j];
+        *crc = gpt_crc32_apply_delta(*crc, ptn_delta, PTN_ENTRY_SIZE,
+                        pentries_end - ptn_entry - PTN_ENTRY_SIZE);
+        *crc = gpt_crc32_apply_delta(*crc, ptn_delta, PTN_ENTRY_SIZE,
+                        pentries_end - ptn_bak_entry - PTN_ENTRY_SIZE);
+
         /* swap primary <-> backup partition entries */
         memcpy(ptn_swap, ptn_entry, PTN_ENTRY_SIZE);
         memcpy(ptn_entry, ptn_bak_entry, PTN_ENTRY_SIZE);
@@ -274,118 +447,87 @@ static int gpt_boot_chain_swap(const uint8_t *pentries_start,
 
 
 
+static int gpt_disk_load_bak(struct gpt_disk *disk);
+static const struct gpt_pentry_index *gpt_disk_get_index(struct gpt_disk *disk,
+                enum gpt_instance instance);
+
+//Offset of the primary or backup GPT header of a loaded disk
+static int64_t gpt_hdr_offset(struct gpt_disk *disk, enum gpt_instance gpt)
+{
+    return (gpt == PRIMARY_GPT) ? disk->block_size : disk->hdr_bak_offset;
+}
+
 /**
  *  ==========================================================================
  *
- *  \brief  Sets secondary GPT boot chain
+ *  \brief  Sets secondary GPT boot chain. The secondary header and entries
+ *  array are written back by gpt_disk_flush.
  *
- *  \param [in] fd    block dev file descriptor
+ *  \param [in] disk  loaded GPT disk
  *  \param [in] boot  Boot chain to switch to
  *
  *  \return  0 on success
  *
  *  ==========================================================================
  */
-static int gpt2_set_boot_chain(int fd, enum boot_chain boot)
+int gpt2_set_boot_chain(struct gpt_disk *disk, enum boot_chain boot)
 {
-    int64_t  gpt2_header_offset;
-    uint64_t pentries_start_offset;
     uint32_t gpt_header_size;
-    uint32_t pentry_size;
-    uint32_t pentries_array_size;
-
-    uint8_t *gpt_header = NULL;
     uint8_t  *pentries = NULL;
     uint32_t crc;
-    uint32_t blk_size = 0;
     int r;
 
-    if (ioctl(fd, BLKSSZGET, &blk_size) != 0) {
-            fprintf(stderr, "Failed to get GPT device block size: %s\n",
-                            strerror(errno));
-            r = -1;
-            goto EXIT;
-    }
-    gpt_header = (uint8_t*)malloc(blk_size);
-    if (!gpt_header) {
-            fprintf(stderr, "Failed to allocate memory to hold GPT block\n");
-            r = -1;
-            goto EXIT;
-    }
-    gpt2_header_offset = lseek64(fd, 0, SEEK_END) - blk_size;
-    if (gpt2_header_offset < 0) {
-        fprintf(stderr, "Getting secondary GPT header offset failed: %s\n",
-                strerror(errno));
+    if (gpt_disk_load_bak(disk)) {
         r = -1;
         goto EXIT;
     }
-
-    /* Read primary GPT header from block dev */
-    r = blk_rw(fd, 0, blk_size, gpt_header, blk_size);
-
-    if (r) {
-            fprintf(stderr, "Failed to read primary GPT header from blk dev\n");
-            goto EXIT;
+    crc = gpt_crc32(0, disk->pentry_arr, disk->pentry_arr_size);
+    if (GET_4_BYTES(disk->hdr + PARTITION_CRC_OFFSET) != crc) {
+        fprintf(stderr, "Primary GPT partition entries array CRC invalid\n");
+        r = -1;
+        goto EXIT;
     }
-    pentries_start_offset =
-        GET_8_BYTES(gpt_header + PENTRIES_OFFSET) * blk_size;
-    pentry_size = GET_4_BYTES(gpt_header + PENTRY_SIZE_OFFSET);
-    pentries_array_size =
-        GET_4_BYTES(gpt_header + PARTITION_COUNT_OFFSET) * pentry_size;
 
-    pentries = (uint8_t *) calloc(1, pentries_array_size);
+    /* The secondary entries array is rebuilt from the primary one */
+    pentries = (uint8_t *) malloc(disk->pentry_arr_size);
     if (pentries == NULL) {
         fprintf(stderr,
                     "Failed to alloc memory for GPT partition entries array\n");
         r = -1;
         goto EXIT;
     }
-    /* Read primary GPT partititon entries array from block dev */
-    r = blk_rw(fd, 0, pentries_start_offset, pentries, pentries_array_size);
-    if (r)
-        goto EXIT;
-
-    crc = crc32(0, pentries, pentries_array_size);
-    if (GET_4_BYTES(gpt_header + PARTITION_CRC_OFFSET) != crc) {
-        fprintf(stderr, "Primary GPT partition entries array CRC invalid\n");
-        r = -1;
-        goto EXIT;
-    }
-
-    /* Read secondary GPT header from block dev */
-    r = blk_rw(fd, 0, gpt2_header_offset, gpt_header, blk_size);
-    if (r)
-        goto EXIT;
-
-    gpt_header_size = GET_4_BYTES(gpt_header + HEADER_SIZE_OFFSET);
-    pentries_start_offset =
-        GET_8_BYTES(gpt_header + PENTRIES_OFFSET) * blk_size;
+    memcpy(pentries, disk->pentry_arr, disk->pentry_arr_size);
 
     if (boot == BACKUP_BOOT) {
-        r = gpt_boot_chain_swap(pentries, pentries + pentries_array_size,
-                                pentry_size);
+        //The copy shares the positions of the primary array
+        r = gpt_boot_chain_swap(gpt_disk_get_index(disk, PRIMARY_GPT),
+                                pentries, pentries + disk->pentry_arr_size,
+                                disk->pentry_size, &crc);
         if (r)
             goto EXIT;
     }
 
-    crc = crc32(0, pentries, pentries_array_size);
-    PUT_4_BYTES(gpt_header + PARTITION_CRC_OFFSET, crc);
+    gpt_header_size = GET_4_BYTES(disk->hdr_bak + HEADER_SIZE_OFFSET);
 
-    /* header CRC is calculated with this field cleared */
-    PUT_4_BYTES(gpt_header + HEADER_CRC_OFFSET, 0);
-    crc = crc32(0, gpt_header, gpt_header_size);
-    PUT_4_BYTES(gpt_header + HEADER_CRC_OFFSET, crc);
+    /* crc already covers the swapped entries */
+    PUT_4_BYTES(disk->hdr_bak + PARTITION_CRC_OFFSET, crc);
 
-    /* Write the modified GPT header back to block dev */
-    r = blk_rw(fd, 1, gpt2_header_offset, gpt_header, blk_size);
-    if (!r)
-        /* Write the modified GPT partititon entries array back to block dev */
-        r = blk_rw(fd, 1, pentries_start_offset, pentries,
-                    pentries_array_size);
+    /* header CRC is calculated with this field cleared */
+    PUT_4_BYTES(disk->hdr_bak + HEADER_CRC_OFFSET, 0);
+    crc = gpt_crc32(0, disk->hdr_bak, gpt_header_size);
+    PUT_4_BYTES(disk->hdr_bak + HEADER_CRC_OFFSET, crc);
+
+    /* The header and entries array are written back by gpt_disk_flush */
+    memcpy(disk->pentry_arr_bak, pentries, disk->pentry_arr_size);
+    //The array now has the layout of the primary one, swapping twins
+    //leaves the positions under each key as they were
+    delete disk->pentry_index_bak;
+    disk->pentry_index_bak = disk->pentry_index ?
+        new (nothrow) gpt_pentry_index(*disk->pentry_index) : NULL;
+    disk->dirty |= GPT_DIRTY_HDR_BAK | GPT_DIRTY_PENTRY_ARR_BAK;
+    r = 0;
 
 EXIT:
-    if(gpt_header)
-            free(gpt_header);
     if (pentries)
             free(pentries);
     return r;
@@ -396,7 +538,7 @@ EXIT:
  *
  *  \brief  Checks GPT state (header signature and CRC)
  *
- *  \param [in] fd      block dev file descriptor
+ *  \param [in] disk    loaded GPT disk
  *  \param [in] gpt     GPT header to be checked
  *  \param [out] state  GPT header state
  *
@@ -404,40 +546,15 @@ EXIT:
  *
  *  ==========================================================================
  */
-static int gpt_get_state(int fd, enum gpt_instance gpt, enum gpt_state *state)
+static int gpt_get_state(struct gpt_disk *disk, enum gpt_instance gpt,
+                         enum gpt_state *state)
 {
-    int64_t gpt_header_offset;
+    uint8_t  *gpt_header = (gpt == PRIMARY_GPT) ? disk->hdr : disk->hdr_bak;
     uint32_t gpt_header_size;
-    uint8_t  *gpt_header = NULL;
     uint32_t crc;
-    uint32_t blk_size = 0;
 
     *state = GPT_OK;
 
-    if (ioctl(fd, BLKSSZGET, &blk_size) != 0) {
-            fprintf(stderr, "Failed to get GPT device block size: %s\n",
-                            strerror(errno));
-            goto error;
-    }
-    gpt_header = (uint8_t*)malloc(blk_size);
-    if (!gpt_header) {
-            fprintf(stderr, "gpt_get_state:Failed to alloc memory for header\n");
-            goto error;
-    }
-    if (gpt == PRIMARY_GPT)
-        gpt_header_offset = blk_size;
-    else {
-        gpt_header_offset = lseek64(fd, 0, SEEK_END) - blk_size;
-        if (gpt_header_offset < 0) {
-            fprintf(stderr, "gpt_get_state:Seek to end of GPT part fail\n");
-            goto error;
-        }
-    }
-
-    if (blk_rw(fd, 0, gpt_header_offset, gpt_header, blk_size)) {
-        fprintf(stderr, "gpt_get_state: blk_rw failed\n");
-        goto error;
-    }
     if (memcmp(gpt_header, GPT_SIGNATURE, sizeof(GPT_SIGNATURE)))
         *state = GPT_BAD_SIGNATURE;
     gpt_header_size = GET_4_BYTES(gpt_header + HEADER_SIZE_OFFSET);
@@ -445,14 +562,10 @@ static int gpt_get_state(int fd, enum gpt_instance gpt, enum gpt_state *state)
     crc = GET_4_BYTES(gpt_header + HEADER_CRC_OFFSET);
     /* header CRC is calculated with this field cleared */
     PUT_4_BYTES(gpt_header + HEADER_CRC_OFFSET, 0);
-    if (crc32(0, gpt_header, gpt_header_size) != crc)
+    if (gpt_crc32(0, gpt_header, gpt_header_size) != crc)
         *state = GPT_BAD_CRC;
-    free(gpt_header);
+    PUT_4_BYTES(gpt_header + HEADER_CRC_OFFSET, crc);
     return 0;
-error:
-    if (gpt_header)
-            free(gpt_header);
-    return -1;
 }
 
 
@@ -460,9 +573,10 @@ error:
 /**
  *  ==========================================================================
  *
- *  \brief  Sets GPT header state (used to corrupt and fix GPT signature)
+ *  \brief  Sets GPT header state (used to corrupt and fix GPT signature).
+ *  The header is written back by gpt_disk_flush.
  *
- *  \param [in] fd     block dev file descriptor
+ *  \param [in] disk   loaded GPT disk
  *  \param [in] gpt    GPT header to be checked
  *  \param [in] state  GPT header state to set (GPT_OK or GPT_BAD_SIGNATURE)
  *
@@ -470,103 +584,47 @@ error:
  *
  *  ==========================================================================
  */
-static int gpt_set_state(int fd, enum gpt_instance gpt, enum gpt_state state)
+static int gpt_set_state(struct gpt_disk *disk, enum gpt_instance gpt,
+                         enum gpt_state state)
 {
-    int64_t gpt_header_offset;
+    uint8_t  *gpt_header = (gpt == PRIMARY_GPT) ? disk->hdr : disk->hdr_bak;
     uint32_t gpt_header_size;
-    uint8_t  *gpt_header = NULL;
     uint32_t crc;
-    uint32_t blk_size = 0;
 
-    if (ioctl(fd, BLKSSZGET, &blk_size) != 0) {
-            fprintf(stderr, "Failed to get GPT device block size: %s\n",
-                            strerror(errno));
-            goto error;
-    }
-    gpt_header = (uint8_t*)malloc(blk_size);
-    if (!gpt_header) {
-            fprintf(stderr, "Failed to alloc memory for gpt header\n");
-            goto error;
-    }
-    if (gpt == PRIMARY_GPT)
-        gpt_header_offset = blk_size;
-    else {
-        gpt_header_offset = lseek64(fd, 0, SEEK_END) - blk_size;
-        if (gpt_header_offset < 0) {
-            fprintf(stderr, "Failed to seek to end of GPT device\n");
-            goto error;
-        }
-    }
-    if (blk_rw(fd, 0, gpt_header_offset, gpt_header, blk_size)) {
-        fprintf(stderr, "Failed to r/w gpt header\n");
-        goto error;
-    }
     if (state == GPT_OK)
         memcpy(gpt_header, GPT_SIGNATURE, sizeof(GPT_SIGNATURE));
     else if (state == GPT_BAD_SIGNATURE)
         *gpt_header = 0;
     else {
         fprintf(stderr, "gpt_set_state: Invalid state\n");
-        goto error;
+        return -1;
     }
 
     gpt_header_size = GET_4_BYTES(gpt_header + HEADER_SIZE_OFFSET);
 
     /* header CRC is calculated with this field cleared */
     PUT_4_BYTES(gpt_header + HEADER_CRC_OFFSET, 0);
-    crc = crc32(0, gpt_header, gpt_header_size);
+    crc = gpt_crc32(0, gpt_header, gpt_header_size);
     PUT_4_BYTES(gpt_header + HEADER_CRC_OFFSET, crc);
 
-    if (blk_rw(fd, 1, gpt_header_offset, gpt_header, blk_size)) {
-        fprintf(stderr, "gpt_set_state: blk write failed\n");
-        goto error;
-    }
+    disk->dirty |= (gpt == PRIMARY_GPT) ? GPT_DIRTY_HDR : GPT_DIRTY_HDR_BAK;
     return 0;
-error:
-    if(gpt_header)
-           free(gpt_header);
-    return -1;
 }
 
-int get_scsi_node_from_bootdevice(const char *bootdev_path,
+//Find the scsi generic node of the LUN named lun_name(eg: sdb). This is
+//given by /sys/block/sdb/device/scsi_generic which contains a file sgY
+//whose name gives us the path to /dev/sgY which we return
+static int gpt_find_scsi_node(const char *lun_name,
                 char *sg_node_path,
                 size_t buf_size)
 {
         char sg_dir_path[PATH_MAX] = {0};
-        char real_path[PATH_MAX] = {0};
         DIR *scsi_dir = NULL;
         struct dirent *de;
         int node_found = 0;
-        if (!bootdev_path || !sg_node_path) {
-                fprintf(stderr, "%s : invalid argument\n",
-                                 __func__);
-                goto error;
-        }
-        if (readlink(bootdev_path, real_path, sizeof(real_path) - 1) < 0) {
-                        fprintf(stderr, "failed to resolve link for %s(%s)\n",
-                                        bootdev_path,
-                                        strerror(errno));
-                        goto error;
-        }
-        if(strlen(real_path) < PATH_TRUNCATE_LOC + 1){
-            fprintf(stderr, "Unrecognized path :%s:\n",
-                           real_path);
-            goto error;
-        }
-        //For the safe side in case there are additional partitions on
-        //the XBL lun we truncate the name.
-        real_path[PATH_TRUNCATE_LOC] = '\0';
-        if(strlen(real_path) < LUN_NAME_START_LOC + 1){
-            fprintf(stderr, "Unrecognized truncated path :%s:\n",
-                           real_path);
-            goto error;
-        }
-        //This will give us /dev/block/sdb/device/scsi_generic
-        //which contains a file sgY whose name gives us the path
-        //to /dev/sgY which we return
         snprintf(sg_dir_path, sizeof(sg_dir_path) - 1,
                         "/sys/block/%s/device/scsi_generic",
-                        &real_path[LUN_NAME_START_LOC]);
+                        lun_name);
         scsi_dir = opendir(sg_dir_path);
         if (!scsi_dir) {
                 fprintf(stderr, "%s : Failed to open %s(%s)\n",
@@ -583,9 +641,6 @@ int get_scsi_node_from_bootdevice(const char *bootdev_path,
                                         buf_size -1,
                                         "/dev/%s",
                                         de->d_name);
-                          fprintf(stderr, "%s:scsi generic node is :%s:\n",
-                                          __func__,
-                                          sg_node_path);
                           node_found = 1;
                           break;
                 }
@@ -603,7 +658,141 @@ error:
         return -1;
 }
 
-int set_boot_lun(char *sg_dev, uint8_t boot_lun_id)
+//Resolve the LUN that the BOOT_DEV_DIR entry for every partition points
+//to, and the scsi generic node of each of those LUNs
+static struct gpt_topology gpt_topology_scan()
+{
+        struct gpt_topology topology;
+        char bootdevice[PROPERTY_VALUE_MAX] = {0};
+        char path[PATH_MAX] = {0};
+        char real_path[PATH_MAX] = {0};
+        char sg_node_path[PATH_MAX] = {0};
+        DIR *dir = NULL;
+        struct dirent *de;
+        ssize_t len;
+
+        property_get("ro.boot.bootdevice", bootdevice, "N/A");
+        topology.is_ufs = strlen(bootdevice) >= strlen(".ufshc") + 1 &&
+                !strncmp(&bootdevice[strlen(bootdevice) - strlen(".ufshc")],
+                                ".ufshc",
+                                sizeof(".ufshc"));
+        if (!topology.is_ufs)
+                return topology;
+
+        dir = opendir(BOOT_DEV_DIR);
+        if (!dir) {
+                fprintf(stderr, "%s : Failed to open %s(%s)\n",
+                                __func__,
+                                BOOT_DEV_DIR,
+                                strerror(errno));
+                return topology;
+        }
+        while ((de = readdir(dir))) {
+                if (de->d_name[0] == '.')
+                        continue;
+                snprintf(path, sizeof(path), "%s/%s", BOOT_DEV_DIR,
+                                de->d_name);
+                len = readlink(path, real_path, sizeof(real_path) - 1);
+                if (len < 0)
+                        continue;
+                real_path[len] = '\0';
+                if (strlen(real_path) < PATH_TRUNCATE_LOC + 1) {
+                        fprintf(stderr, "Unknown path.Skipping :%s:\n",
+                                        real_path);
+                        continue;
+                }
+                real_path[PATH_TRUNCATE_LOC] = '\0';
+                topology.ptn_lun[de->d_name] = real_path;
+                topology.lun_sg[real_path];
+        }
+        closedir(dir);
+
+        for (auto &lun : topology.lun_sg) {
+                if (!gpt_find_scsi_node(&lun.first[LUN_NAME_START_LOC],
+                                        sg_node_path,
+                                        sizeof(sg_node_path)))
+                        lun.second = sg_node_path;
+        }
+        return topology;
+}
+
+//The topology is kept once a scan finds it. A UFS device whose BOOT_DEV_DIR
+//cannot be read or is not populated yet is scanned again on the next call,
+//and looks like a UFS device without any partitions until then.
+static const struct gpt_topology &gpt_get_topology()
+{
+        static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+        static const struct gpt_topology *topology = NULL;
+        static const struct gpt_topology unscanned = { 1, {}, {} };
+        const struct gpt_topology *found;
+
+        pthread_mutex_lock(&lock);
+        if (!topology) {
+                struct gpt_topology scan = gpt_topology_scan();
+                if (!scan.is_ufs || !scan.ptn_lun.empty())
+                        topology = new (nothrow) gpt_topology(move(scan));
+        }
+        found = topology;
+        pthread_mutex_unlock(&lock);
+        return found ? *found : unscanned;
+}
+
+//Path of the LUN holding partition partname, or NULL if there is none
+static const char *gpt_topology_get_lun(const char *partname)
+{
+        const struct gpt_topology &topology = gpt_get_topology();
+        auto it = topology.ptn_lun.find(partname);
+        if (it == topology.ptn_lun.end())
+                return NULL;
+        return it->second.c_str();
+}
+
+int get_scsi_node_from_bootdevice(const char *bootdev_path,
+                char *sg_node_path,
+                size_t buf_size)
+{
+        char real_path[PATH_MAX] = {0};
+        if (!bootdev_path || !sg_node_path) {
+                fprintf(stderr, "%s : invalid argument\n",
+                                 __func__);
+                goto error;
+        }
+        if (readlink(bootdev_path, real_path, sizeof(real_path) - 1) < 0) {
+                        fprintf(stderr, "failed to resolve link for %s(%s)\n",
+                                        bootdev_path,
+                                        strerror(errno));
+                        goto error;
+        }
+        if(strlen(real_path) < PATH_TRUNCATE_LOC + 1){
+            fprintf(stderr, "Unrecognized path :%s:\n",
+                           real_path);
+            goto error;
+        }
+        //For the safe side in case there are additional partitions on
+        //the XBL lun we truncate the name.
+        real_path[PATH_TRUNCATE_LOC] = '\0';
+        if(strlen(real_path) < LUN_NAME_START_LOC + 1){
+            fprintf(stderr, "Unrecognized truncated path :%s:\n",
+                           real_path);
+            goto error;
+        }
+        {
+                const struct gpt_topology &topology = gpt_get_topology();
+                auto it = topology.lun_sg.find(real_path);
+                if (it != topology.lun_sg.end() && !it->second.empty()) {
+                        snprintf(sg_node_path, buf_size - 1, "%s",
+                                        it->second.c_str());
+                        return 0;
+                }
+        }
+        return gpt_find_scsi_node(&real_path[LUN_NAME_START_LOC],
+                        sg_node_path,
+                        buf_size);
+error:
+        return -1;
+}
+
+int set_boot_lun(const char *sg_dev, uint8_t boot_lun_id)
 {
         int fd = -1;
         int rc;
@@ -666,18 +855,17 @@ error:
 //the boot lun to either LUNA or LUNB
 int gpt_utils_set_xbl_boot_partition(enum boot_chain chain)
 {
-        struct stat st;
-        ///sys/block/sdX/device/scsi_generic/
-        char sg_dev_node[PATH_MAX] = {0};
+        const struct gpt_topology &topology = gpt_get_topology();
         uint8_t boot_lun_id = 0;
-        const char *boot_dev = NULL;
+        const char *boot_ptn = NULL;
+        const char *boot_lun = NULL;
 
         if (chain == BACKUP_BOOT) {
                 boot_lun_id = BOOT_LUN_B_ID;
-                if (!stat(XBL_BACKUP, &st))
-                        boot_dev = XBL_BACKUP;
-                else if (!stat(XBL_AB_SECONDARY, &st))
-                        boot_dev = XBL_AB_SECONDARY;
+                if (gpt_topology_get_lun(XBL_BACKUP))
+                        boot_ptn = XBL_BACKUP;
+                else if (gpt_topology_get_lun(XBL_AB_SECONDARY))
+                        boot_ptn = XBL_AB_SECONDARY;
                 else {
                         fprintf(stderr, "%s: Failed to locate secondary xbl\n",
                                         __func__);
@@ -685,10 +873,10 @@ int gpt_utils_set_xbl_boot_partition(enum boot_chain chain)
                 }
         } else if (chain == NORMAL_BOOT) {
                 boot_lun_id = BOOT_LUN_A_ID;
-                if (!stat(XBL_PRIMARY, &st))
-                        boot_dev = XBL_PRIMARY;
-                else if (!stat(XBL_AB_PRIMARY, &st))
-                        boot_dev = XBL_AB_PRIMARY;
+                if (gpt_topology_get_lun(XBL_PRIMARY))
+                        boot_ptn = XBL_PRIMARY;
+                else if (gpt_topology_get_lun(XBL_AB_PRIMARY))
+                        boot_ptn = XBL_AB_PRIMARY;
                 else {
                         fprintf(stderr, "%s: Failed to locate primary xbl\n",
                                         __func__);
@@ -700,29 +888,31 @@ int gpt_utils_set_xbl_boot_partition(enum boot_chain chain)
         }
         //We need either both xbl and xblbak or both xbl_a and xbl_b to exist at
         //the same time. If not the current configuration is invalid.
-        if((stat(XBL_PRIMARY, &st) ||
-                                stat(XBL_BACKUP, &st)) &&
-                        (stat(XBL_AB_PRIMARY, &st) ||
-                         stat(XBL_AB_SECONDARY, &st))) {
-                fprintf(stderr, "%s:primary/secondary XBL prt not found(%s)\n",
-                                __func__,
-                                strerror(errno));
-                goto error;
-        }
-        fprintf(stderr, "%s: setting %s lun as boot lun\n",
-                        __func__,
-                        boot_dev);
-        if (get_scsi_node_from_bootdevice(boot_dev,
-                                sg_dev_node,
-                                sizeof(sg_dev_node))) {
-                fprintf(stderr, "%s: Failed to get scsi node path for xblbak\n",
+        if((!gpt_topology_get_lun(XBL_PRIMARY) ||
+                                !gpt_topology_get_lun(XBL_BACKUP)) &&
+                        (!gpt_topology_get_lun(XBL_AB_PRIMARY) ||
+                         !gpt_topology_get_lun(XBL_AB_SECONDARY))) {
+                fprintf(stderr, "%s:primary/secondary XBL prt not found\n",
                                 __func__);
                 goto error;
         }
-        if (set_boot_lun(sg_dev_node, boot_lun_id)) {
-                fprintf(stderr, "%s: Failed to set xblbak as boot partition\n",
-                                __func__);
-                goto error;
+        boot_lun = gpt_topology_get_lun(boot_ptn);
+        fprintf(stderr, "%s: setting %s lun(%s) as boot lun\n",
+                        __func__,
+                        boot_ptn,
+                        boot_lun);
+        {
+                auto it = topology.lun_sg.find(boot_lun);
+                if (it == topology.lun_sg.end() || it->second.empty()) {
+                        fprintf(stderr, "%s: Failed to get scsi node path for xblbak\n",
+                                        __func__);
+                        goto error;
+                }
+                if (set_boot_lun(it->second.c_str(), boot_lun_id)) {
+                        fprintf(stderr, "%s: Failed to set xblbak as boot partition\n",
+                                        __func__);
+                        goto error;
+                }
         }
         return 0;
 error:
@@ -731,14 +921,13 @@ error:
 
 int gpt_utils_is_ufs_device()
 {
-    char bootdevice[PROPERTY_VALUE_MAX] = {0};
-    property_get("ro.boot.bootdevice", bootdevice, "N/A");
-    if (strlen(bootdevice) < strlen(".ufshc") + 1)
-        return 0;
-    return (!strncmp(&bootdevice[strlen(bootdevice) - strlen(".ufshc")],
-                            ".ufshc",
-                            sizeof(".ufshc")));
+    return gpt_get_topology().is_ufs;
 }
+
+//The boot LUN is a property of the whole device. prepare_partitions may run
+//on several LUNs at once, so only one of them switches it at a time.
+static pthread_mutex_t xbl_boot_lun_lock = PTHREAD_MUTEX_INITIALIZER;
+
 //dev_path is the path to the block device that contains the GPT image that
 //needs to be updated. This would be the device which holds one or more critical
 //boot partitions and their backups. In the case of EMMC this function would
@@ -749,11 +938,10 @@ int gpt_utils_is_ufs_device()
 int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
 {
     int r = 0;
-    int fd = -1;
+    struct gpt_disk *disk = NULL;
     int is_ufs = gpt_utils_is_ufs_device();
     enum gpt_state gpt_prim, gpt_second;
     enum boot_update_stage internal_stage;
-    struct stat xbl_partition_stat;
 
     if (!dev_path) {
         fprintf(stderr, "%s: Invalid dev_path\n",
@@ -761,17 +949,31 @@ int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
         r = -1;
         goto EXIT;
     }
-    fd = open(dev_path, O_RDWR);
-    if (fd < 0) {
-        fprintf(stderr, "%s: Opening '%s' failed: %s\n",
+    //Both GPTs are loaded once here and the cached copies are kept in sync
+    //with what each stage writes back
+    disk = gpt_disk_alloc();
+    if (!disk) {
+        r = -1;
+        goto EXIT;
+    }
+    if (gpt_disk_open(dev_path, disk) || gpt_disk_load_bak(disk)) {
+        fprintf(stderr, "%s: Loading GPT from '%s' failed\n",
+                        __func__,
+                       dev_path);
+        r = -1;
+        goto EXIT;
+    }
+    //A boot update rewrites both GPTs and relies on the backup one to
+    //recover from a crash, it cannot go ahead without a real one
+    if (disk->hdr_bak_is_copy) {
+        fprintf(stderr, "%s: No valid backup GPT on '%s', aborting\n",
                         __func__,
-                       BLK_DEV_FILE,
-                       strerror(errno));
+                        dev_path);
         r = -1;
         goto EXIT;
     }
-    r = gpt_get_state(fd, PRIMARY_GPT, &gpt_prim) ||
-        gpt_get_state(fd, SECONDARY_GPT, &gpt_second);
+    r = gpt_get_state(disk, PRIMARY_GPT, &gpt_prim) ||
+        gpt_get_state(disk, SECONDARY_GPT, &gpt_second);
     if (r) {
         fprintf(stderr, "%s: Getting GPT headers state failed\n",
                         __func__);
@@ -818,17 +1020,18 @@ int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
     switch (stage) {
     case UPDATE_MAIN:
             if (is_ufs) {
-                if(stat(XBL_PRIMARY, &xbl_partition_stat)||
-                                stat(XBL_BACKUP, &xbl_partition_stat)){
+                if(!gpt_topology_get_lun(XBL_PRIMARY) ||
+                                !gpt_topology_get_lun(XBL_BACKUP)){
                         //Non fatal error. Just means this target does not
                         //use XBL but relies on sbl whose update is handled
                         //by the normal methods.
-                        fprintf(stderr, "%s: xbl part not found(%s).Assuming sbl in use\n",
-                                        __func__,
-                                        strerror(errno));
+                        fprintf(stderr, "%s: xbl part not found.Assuming sbl in use\n",
+                                        __func__);
                 } else {
                         //Switch the boot lun so that backup boot LUN is used
+                        pthread_mutex_lock(&xbl_boot_lun_lock);
                         r = gpt_utils_set_xbl_boot_partition(BACKUP_BOOT);
+                        pthread_mutex_unlock(&xbl_boot_lun_lock);
                         if(r){
                                 fprintf(stderr, "%s: Failed to set xbl backup partition as boot\n",
                                                 __func__);
@@ -840,7 +1043,7 @@ int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
         //the backup copy of the boot critical images
         fprintf(stderr, "%s: Preparing for primary partition update\n",
                         __func__);
-        r = gpt2_set_boot_chain(fd, BACKUP_BOOT);
+        r = gpt2_set_boot_chain(disk, BACKUP_BOOT);
         if (r) {
             if (r < 0)
                 fprintf(stderr,
@@ -851,9 +1054,16 @@ int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
                 r = 0;
             goto EXIT;
         }
+        //The backup GPT must be on disk before the primary one is given up
+        r = gpt_disk_flush(disk);
+        if (r) {
+            fprintf(stderr, "%s: Writing secondary GPT failed\n",
+                            __func__);
+            goto EXIT;
+        }
         //corrupt the primary GPT so that the backup(which now points to
         //the backup boot partitions is used)
-        r = gpt_set_state(fd, PRIMARY_GPT, GPT_BAD_SIGNATURE);
+        r = gpt_set_state(disk, PRIMARY_GPT, GPT_BAD_SIGNATURE);
         if (r) {
             fprintf(stderr, "%s: Corrupting primary GPT header failed\n",
                             __func__);
@@ -862,17 +1072,18 @@ int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
         break;
     case UPDATE_BACKUP:
         if (is_ufs) {
-                if(stat(XBL_PRIMARY, &xbl_partition_stat)||
-                                stat(XBL_BACKUP, &xbl_partition_stat)){
+                if(!gpt_topology_get_lun(XBL_PRIMARY) ||
+                                !gpt_topology_get_lun(XBL_BACKUP)){
                         //Non fatal error. Just means this target does not
                         //use XBL but relies on sbl whose update is handled
                         //by the normal methods.
-                        fprintf(stderr, "%s: xbl part not found(%s).Assuming sbl in use\n",
-                                        __func__,
-                                        strerror(errno));
+                        fprintf(stderr, "%s: xbl part not found.Assuming sbl in use\n",
+                                        __func__);
                 } else {
                         //Switch the boot lun so that backup boot LUN is used
+                        pthread_mutex_lock(&xbl_boot_lun_lock);
                         r = gpt_utils_set_xbl_boot_partition(NORMAL_BOOT);
+                        pthread_mutex_unlock(&xbl_boot_lun_lock);
                         if(r) {
                                 fprintf(stderr, "%s: Failed to set xbl backup partition as boot\n",
                                                 __func__);
@@ -883,14 +1094,18 @@ int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
         //Fix the primary GPT header so that is used
         fprintf(stderr, "%s: Preparing for backup partition update\n",
                         __func__);
-        r = gpt_set_state(fd, PRIMARY_GPT, GPT_OK);
+        r = gpt_set_state(disk, PRIMARY_GPT, GPT_OK);
+        if (!r)
+            //The primary GPT must be on disk before the secondary one is
+            //given up
+            r = gpt_disk_flush(disk);
         if (r) {
             fprintf(stderr, "%s: Fixing primary GPT header failed\n",
                              __func__);
             goto EXIT;
         }
         //Corrupt the scondary GPT header
-        r = gpt_set_state(fd, SECONDARY_GPT, GPT_BAD_SIGNATURE);
+        r = gpt_set_state(disk, SECONDARY_GPT, GPT_BAD_SIGNATURE);
         if (r) {
             fprintf(stderr, "%s: Corrupting secondary GPT header failed\n",
                             __func__);
@@ -903,14 +1118,14 @@ int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
         //partitions
         fprintf(stderr, "%s: Finalizing partitions\n",
                         __func__);
-        r = gpt2_set_boot_chain(fd, NORMAL_BOOT);
+        r = gpt2_set_boot_chain(disk, NORMAL_BOOT);
         if (r < 0) {
             fprintf(stderr, "%s: Setting secondary GPT to normal boot failed\n",
                             __func__);
             goto EXIT;
         }
 
-        r = gpt_set_state(fd, SECONDARY_GPT, GPT_OK);
+        r = gpt_set_state(disk, SECONDARY_GPT, GPT_OK);
         if (r) {
             fprintf(stderr, "%s: Fixing secondary GPT header failed\n",
                             __func__);
@@ -921,14 +1136,20 @@ int prepare_partitions(enum boot_update_stage stage, const char *dev_path)
     }
 
 EXIT:
-    if (fd >= 0) {
-       fsync(fd);
-       close(fd);
+    if (disk) {
+       //Changes of a failed stage are dropped
+       if (!r) {
+              r = gpt_disk_flush(disk);
+              if (r)
+                     fprintf(stderr, "%s: Writing back GPT failed\n",
+                                     __func__);
+       }
+       gpt_disk_free(disk);
     }
     return r;
 }
 
-int add_lun_to_update_list(char *lun_path, struct update_data *dat)
+int add_lun_to_update_list(const char *lun_path, struct update_data *dat)
 {
         uint32_t i = 0;
         struct stat st;
@@ -974,19 +1195,25 @@ int add_lun_to_update_list(char *lun_path, struct update_data *dat)
         return 0;
 }
 
+static void *prepare_partitions_worker(void *arg)
+{
+        struct update_worker *worker = (struct update_worker *)arg;
+        worker->rcode = prepare_partitions(worker->stage, worker->lun_path);
+        return NULL;
+}
+
 int prepare_boot_update(enum boot_update_stage stage)
 {
         int is_ufs = gpt_utils_is_ufs_device();
-        struct stat ufs_dir_stat;
         struct update_data data;
-        int rcode = 0;
+        struct update_worker workers[MAX_LUNS];
         uint32_t i = 0;
         int is_error = 0;
         const char ptn_swap_list[][MAX_GPT_NAME_SIZE] = { PTN_SWAP_LIST };
-        //Holds /dev/block/bootdevice/by-name/*bak entry
-        char buf[PATH_MAX] = {0};
-        //Holds the resolved path of the symlink stored in buf
-        char real_path[PATH_MAX] = {0};
+        //Holds the name of the *bak entry under /dev/block/bootdevice/by-name
+        char buf[MAX_GPT_NAME_SIZE + sizeof(BAK_PTN_NAME_EXT)] = {0};
+        //LUN the *bak entry in buf resides on
+        const char *lun_path;
 
         if (!is_ufs) {
                 //emmc device. Just pass in path to mmcblk0
@@ -1012,36 +1239,37 @@ int prepare_boot_update(enum boot_update_stage stage)
                                                 strlen(PTN_XBL)))
                                 continue;
                         snprintf(buf, sizeof(buf),
-                                        "%s/%sbak",
-                                        BOOT_DEV_DIR,
-                                        ptn_swap_list[i]);
-                        if (stat(buf, &ufs_dir_stat)) {
-                                continue;
-                        }
-                        if (readlink(buf, real_path, sizeof(real_path) - 1) < 0)
-                        {
-                                fprintf(stderr, "%s: readlink error. Skipping %s",
-                                                __func__,
-                                                strerror(errno));
-                        } else {
-                              if(strlen(real_path) < PATH_TRUNCATE_LOC + 1){
-                                    fprintf(stderr, "Unknown path.Skipping :%s:\n",
-                                                real_path);
-                                } else {
-                                    real_path[PATH_TRUNCATE_LOC] = '\0';
-                                    add_lun_to_update_list(real_path, &data);
-                                }
-                        }
-                        memset(buf, '\0', sizeof(buf));
-                        memset(real_path, '\0', sizeof(real_path));
+                                        "%s%s",
+                                        ptn_swap_list[i],
+                                        BAK_PTN_NAME_EXT);
+                        lun_path = gpt_topology_get_lun(buf);
+                        if (lun_path)
+                                add_lun_to_update_list(lun_path, &data);
                 }
+                //The LUNs are independent devices, so each one is prepared
+                //on its own thread. A LUN whose thread cannot be created is
+                //prepared inline instead.
+                memset(workers, '\0', sizeof(workers));
                 for (i=0; i < data.num_valid_entries; i++) {
                         fprintf(stderr, "%s: Preparing %s for update stage %d\n",
                                         __func__,
                                         data.lun_list[i],
                                         stage);
-                        rcode = prepare_partitions(stage, data.lun_list[i]);
-                        if (rcode != 0)
+                        workers[i].stage = stage;
+                        workers[i].lun_path = data.lun_list[i];
+                        workers[i].started = !pthread_create(&workers[i].thread,
+                                        NULL,
+                                        prepare_partitions_worker,
+                                        &workers[i]);
+                        if (!workers[i].started)
+                                prepare_partitions_worker(&workers[i]);
+                }
+                //Every LUN has to be done with this stage before the
+                //caller moves on to the next one
+                for (i=0; i < data.num_valid_entries; i++) {
+                        if (workers[i].started)
+                                pthread_join(workers[i].thread, NULL);
+                        if (workers[i].rcode != 0)
                         {
                                 fprintf(stderr, "%s: Failed to prepare %s.Continuing..\n",
                                                 __func__,
@@ -1064,27 +1292,17 @@ static int get_dev_path_from_partition_name(const char *partname,
                 char *buf,
                 size_t buflen)
 {
-        struct stat st;
-        char path[PATH_MAX] = {0};
+        const char *lun_path;
         if (!partname || !buf || buflen < ((PATH_TRUNCATE_LOC) + 1)) {
                 ALOGE("%s: Invalid argument", __func__);
                 goto error;
         }
         if (gpt_utils_is_ufs_device()) {
                 //Need to find the lun that holds partition partname
-                snprintf(path, sizeof(path),
-                                "%s/%s",
-                                BOOT_DEV_DIR,
-                                partname);
-                if (stat(path, &st)) {
+                lun_path = gpt_topology_get_lun(partname);
+                if (!lun_path)
                         goto error;
-                }
-                if (readlink(path, buf, buflen) < 0)
-                {
-                        goto error;
-                } else {
-                        buf[PATH_TRUNCATE_LOC] = '\0';
-                }
+                strlcpy(buf, lun_path, buflen);
         } else {
                 snprintf(buf, buflen, "/dev/block/mmcblk0");
         }
@@ -1149,203 +1367,265 @@ error:
         return 0;
 }
 
-//Write the GPT header present in the passed in buffer back to the
-//disk represented by fd
-static int gpt_set_header(uint8_t *gpt_header, int fd,
-                enum gpt_instance instance)
+//Write the cached GPT header of the given instance back to the disk
+static int gpt_set_header(struct gpt_disk *disk, enum gpt_instance instance)
 {
-        uint32_t block_size = 0;
-        off_t gpt_header_offset = 0;
-        if (!gpt_header || fd < 0) {
-                ALOGE("%s: Invalid arguments",
-                                __func__);
-                goto error;
-        }
-        block_size = gpt_get_block_size(fd);
-        ALOGI("%s: Block size is : %d", __func__, block_size);
-        if (block_size == 0) {
-                ALOGE("%s: Failed to get block size", __func__);
-                goto error;
-        }
-        if (instance == PRIMARY_GPT)
-                gpt_header_offset = block_size;
-        else
-                gpt_header_offset = lseek64(fd, 0, SEEK_END) - block_size;
-        if (gpt_header_offset <= 0) {
-                ALOGE("%s: Failed to get gpt header offset",__func__);
-                goto error;
-        }
-        ALOGI("%s: Writing back header to offset %ld", __func__,
+        int64_t gpt_header_offset = gpt_hdr_offset(disk, instance);
+        uint8_t *gpt_header = (instance == PRIMARY_GPT) ?
+                disk->hdr : disk->hdr_bak;
+        ALOGI("%s: Writing back header to offset %" PRIi64, __func__,
                 gpt_header_offset);
-        if (blk_rw(fd, 1, gpt_header_offset, gpt_header, block_size)) {
+        if (blk_rw(disk->fd, 1, gpt_header_offset, gpt_header,
+                                disk->block_size)) {
                 ALOGE("%s: Failed to write back GPT header", __func__);
-                goto error;
+                return -1;
         }
         return 0;
-error:
-        return -1;
 }
 
-//Read out the GPT header for the disk that contains the partition partname
-static uint8_t* gpt_get_header(const char *partname, enum gpt_instance instance)
+//Check that hdr, read from hdr_offset, is a backup GPT header describing
+//itself and an entry array lying between the primary GPT and it. The
+//signature may have its first byte cleared, which is how a boot update in
+//progress marks a header as bad.
+static int gpt_check_backup_header(struct gpt_disk *disk, uint8_t *hdr,
+                int64_t hdr_offset)
 {
-        uint8_t* hdr = NULL;
-        char devpath[PATH_MAX] = {0};
-        int64_t hdr_offset = 0;
-        uint32_t block_size = 0;
-        int fd = -1;
-        if (!partname) {
-                ALOGE("%s: Invalid partition name", __func__);
-                goto error;
-        }
-        if (get_dev_path_from_partition_name(partname, devpath, sizeof(devpath))
-                        != 0) {
-                ALOGE("%s: Failed to resolve path for %s",
-                                __func__,
-                                partname);
-                goto error;
-        }
-        fd = open(devpath, O_RDWR);
-        if (fd < 0) {
-                ALOGE("%s: Failed to open %s : %s",
-                                __func__,
-                                devpath,
-                                strerror(errno));
-                goto error;
-        }
-        block_size = gpt_get_block_size(fd);
-        if (block_size == 0)
-        {
-                ALOGE("%s: Failed to get gpt block size for %s",
-                                __func__,
-                                partname);
-                goto error;
-        }
+        uint32_t gpt_header_size = GET_4_BYTES(hdr + HEADER_SIZE_OFFSET);
+        uint32_t crc = GET_4_BYTES(hdr + HEADER_CRC_OFFSET);
+        uint64_t pentries_start = 0;
+        int r = -1;
 
-        hdr = (uint8_t*)malloc(block_size);
-        if (!hdr) {
-                ALOGE("%s: Failed to allocate memory for gpt header",
-                                __func__);
+        if (memcmp(hdr + 1, GPT_SIGNATURE + 1, sizeof(GPT_SIGNATURE) - 1)) {
+                ALOGE("%s: Bad backup GPT signature", __func__);
+                goto end;
         }
-        if (instance == PRIMARY_GPT)
-                hdr_offset = block_size;
-        else {
-                hdr_offset = lseek64(fd, 0, SEEK_END) - block_size;
+        if (gpt_header_size < GPT_HEADER_MIN_SIZE) {
+                ALOGE("%s: Invalid backup GPT header size", __func__);
+                goto end;
         }
-        if (hdr_offset < 0) {
-                ALOGE("%s: Failed to get gpt header offset",
-                                __func__);
-                goto error;
+        /* header CRC is calculated with this field cleared */
+        PUT_4_BYTES(hdr + HEADER_CRC_OFFSET, 0);
+        if (gpt_crc32(0, hdr, gpt_header_size) != crc) {
+                ALOGE("%s: Bad backup GPT header CRC", __func__);
+                goto restore;
         }
-        if (blk_rw(fd, 0, hdr_offset, hdr, block_size)) {
-                ALOGE("%s: Failed to read GPT header from device",
+        if (GET_8_BYTES(hdr + PRIMARY_HEADER_OFFSET) !=
+                        (uint64_t) hdr_offset / disk->block_size) {
+                ALOGE("%s: Backup GPT header is not at its own LBA",
                                 __func__);
-                goto error;
+                goto restore;
+        }
+        pentries_start = GET_8_BYTES(hdr + PENTRIES_OFFSET) * disk->block_size;
+        if (pentries_start < 2 * (uint64_t) disk->block_size ||
+                        pentries_start > (uint64_t) hdr_offset ||
+                        (uint64_t) hdr_offset - pentries_start <
+                        disk->pentry_arr_size) {
+                ALOGE("%s: Backup partition entry array out of range",
+                                __func__);
+                goto restore;
         }
-        close(fd);
-        return hdr;
-error:
-        if (fd >= 0)
-                close(fd);
-        if (hdr)
-                free(hdr);
-        return NULL;
+        r = 0;
+restore:
+        PUT_4_BYTES(hdr + HEADER_CRC_OFFSET, crc);
+end:
+        return r;
 }
 
-//Returns the partition entry array based on the
-//passed in buffer which contains the gpt header.
-//The fd here is the descriptor for the 'disk' which
-//holds the partition
-static uint8_t* gpt_get_pentry_arr(uint8_t *hdr, int fd)
+//Load the GPT header of the given instance along with the partition entry
+//array it describes. The header and the window of the disk where the entry
+//array normally lies, right after the primary header or right before the
+//backup one, are read together.
+static int gpt_load(struct gpt_disk *disk, enum gpt_instance instance)
 {
+        int64_t hdr_offset = gpt_hdr_offset(disk, instance);
+        int64_t win_offset = hdr_offset;
+        uint32_t win_size = disk->block_size + GPT_PENTRY_ARR_PREFETCH_SIZE;
         uint64_t pentries_start = 0;
-        uint32_t pentry_size = 0;
-        uint32_t block_size = 0;
-        uint32_t pentries_arr_size = 0;
+        uint64_t pentries_arr_size = 0;
+        uint8_t *win = NULL;
+        uint8_t *hdr = NULL;
         uint8_t *pentry_arr = NULL;
-        int rc = 0;
-        if (!hdr) {
-                ALOGE("%s: Invalid header", __func__);
-                goto error;
+
+        if (instance == SECONDARY_GPT) {
+                win_offset = hdr_offset - GPT_PENTRY_ARR_PREFETCH_SIZE;
+                if (win_offset < 2 * (int64_t) disk->block_size) {
+                        win_offset = hdr_offset;
+                        win_size = disk->block_size;
+                }
         }
-        if (fd < 0) {
-                ALOGE("%s: Invalid fd", __func__);
+        win = (uint8_t*)malloc(win_size);
+        hdr = (uint8_t*)malloc(disk->block_size);
+        if (!win || !hdr) {
+                ALOGE("%s: Failed to allocate memory for gpt header",
+                                __func__);
                 goto error;
         }
-        block_size = gpt_get_block_size(fd);
-        if (!block_size) {
-                ALOGE("%s: Failed to get gpt block size for",
+        if (blk_rw(disk->fd, 0, win_offset, win, win_size)) {
+                ALOGE("%s: Failed to read GPT header from device",
                                 __func__);
                 goto error;
         }
-        pentries_start = GET_8_BYTES(hdr + PENTRIES_OFFSET) * block_size;
-        pentry_size = GET_4_BYTES(hdr + PENTRY_SIZE_OFFSET);
-        pentries_arr_size =
-                GET_4_BYTES(hdr + PARTITION_COUNT_OFFSET) * pentry_size;
+        memcpy(hdr, win + (hdr_offset - win_offset), disk->block_size);
+        if (GET_4_BYTES(hdr + HEADER_SIZE_OFFSET) > disk->block_size) {
+                ALOGE("%s: Invalid gpt header size", __func__);
+                goto error;
+        }
+        //Nothing in the backup header is trusted, the location of its entry
+        //array included, unless the header as a whole checks out
+        if (instance == SECONDARY_GPT &&
+                        gpt_check_backup_header(disk, hdr, hdr_offset))
+                goto error;
+
+        //The entry array size always comes from the primary header, the
+        //backup array is a copy of the primary one
+        if (instance == PRIMARY_GPT) {
+                disk->pentry_size = GET_4_BYTES(hdr + PENTRY_SIZE_OFFSET);
+                pentries_arr_size =
+                        (uint64_t) GET_4_BYTES(hdr + PARTITION_COUNT_OFFSET) *
+                        disk->pentry_size;
+                if (disk->pentry_size < PTN_ENTRY_SIZE ||
+                                pentries_arr_size == 0 ||
+                                pentries_arr_size > GPT_PENTRY_ARR_MAX_SIZE) {
+                        ALOGE("%s: Invalid partition entry array", __func__);
+                        goto error;
+                }
+                disk->pentry_arr_size = pentries_arr_size;
+        }
+        pentries_arr_size = disk->pentry_arr_size;
+        pentries_start = GET_8_BYTES(hdr + PENTRIES_OFFSET) * disk->block_size;
         pentry_arr = (uint8_t*)calloc(1, pentries_arr_size);
         if (!pentry_arr) {
                 ALOGE("%s: Failed to allocate memory for partition array",
                                 __func__);
                 goto error;
         }
-        rc = blk_rw(fd, 0,
-                        pentries_start,
-                        pentry_arr,
-                        pentries_arr_size);
-        if (rc) {
+        if (pentries_start >= (uint64_t) win_offset &&
+                        pentries_start + pentries_arr_size <=
+                        (uint64_t) win_offset + win_size) {
+                memcpy(pentry_arr, win + (pentries_start - win_offset),
+                                pentries_arr_size);
+        } else if (blk_rw(disk->fd, 0,
+                                pentries_start,
+                                pentry_arr,
+                                pentries_arr_size)) {
                 ALOGE("%s: Failed to read partition entry array",
                                 __func__);
                 goto error;
         }
-        return pentry_arr;
+        free(win);
+        if (instance == PRIMARY_GPT) {
+                disk->hdr = hdr;
+                disk->pentry_arr = pentry_arr;
+        } else {
+                disk->hdr_bak = hdr;
+                disk->pentry_arr_bak = pentry_arr;
+        }
+        return 0;
 error:
+        if (win)
+                free(win);
+        if (hdr)
+                free(hdr);
         if (pentry_arr)
                 free(pentry_arr);
-        return NULL;
+        return -1;
 }
 
-static int gpt_set_pentry_arr(uint8_t *hdr, int fd, uint8_t* arr)
+//Write bytes [start, end) of the cached partition entry array of the
+//given instance, widened to whole blocks, to the location recorded in its
+//header
+static int gpt_set_pentry_arr(struct gpt_disk *disk, enum gpt_instance instance,
+                uint32_t start, uint32_t end)
 {
-        uint32_t block_size = 0;
+        uint8_t *hdr = (instance == PRIMARY_GPT) ? disk->hdr : disk->hdr_bak;
+        uint8_t *arr = (instance == PRIMARY_GPT) ?
+                disk->pentry_arr : disk->pentry_arr_bak;
         uint64_t pentries_start = 0;
-        uint32_t pentry_size = 0;
-        uint32_t pentries_arr_size = 0;
-        int rc = 0;
-        if (!hdr || fd < 0 || !arr) {
-                ALOGE("%s: Invalid argument", __func__);
-                goto error;
-        }
-        block_size = gpt_get_block_size(fd);
-        if (!block_size) {
-                ALOGE("%s: Failed to get gpt block size for",
+        pentries_start = GET_8_BYTES(hdr + PENTRIES_OFFSET) * disk->block_size;
+        start -= start % disk->block_size;
+        end += disk->block_size - 1;
+        end -= end % disk->block_size;
+        if (end > disk->pentry_arr_size)
+                end = disk->pentry_arr_size;
+        ALOGI("%s: Writing %u bytes of partition entry array to offset %" PRIu64,
+                        __func__,
+                        end - start,
+                        pentries_start + start);
+        if (blk_rw(disk->fd, 1,
+                        pentries_start + start,
+                        arr + start,
+                        end - start)) {
+                ALOGE("%s: Failed to write partition entry array",
                                 __func__);
+                return -1;
+        }
+        return 0;
+}
+
+
+
+//Write every part of the disk marked dirty back to it and make them durable
+//with a single fsync. Entry arrays go out ahead of the headers describing
+//them. An update that must be durable before the next one starts, for the
+//crash safety of a boot update, is flushed on its own first.
+int gpt_disk_flush(struct gpt_disk *disk)
+{
+        if (!disk || disk->is_initialized != GPT_DISK_INIT_MAGIC) {
+                ALOGE("%s: Invalid args", __func__);
                 goto error;
         }
-        ALOGI("%s : Block size is %d", __func__, block_size);
-        pentries_start = GET_8_BYTES(hdr + PENTRIES_OFFSET) * block_size;
-        pentry_size = GET_4_BYTES(hdr + PENTRY_SIZE_OFFSET);
-        pentries_arr_size =
-                GET_4_BYTES(hdr + PARTITION_COUNT_OFFSET) * pentry_size;
-        ALOGI("%s: Writing partition entry array of size %d to offset %" PRIu64,
-                        __func__,
-                        pentries_arr_size,
-                        pentries_start);
-        rc = blk_rw(fd, 1,
-                        pentries_start,
-                        arr,
-                        pentries_arr_size);
-        if (rc) {
-                ALOGE("%s: Failed to read partition entry array",
-                                __func__);
+        //A stand-in for a backup GPT that could not be loaded must never
+        //overwrite whatever is at the backup location
+        if (disk->hdr_bak_is_copy) {
+                disk->dirty &= ~(GPT_DIRTY_HDR_BAK | GPT_DIRTY_PENTRY_ARR_BAK);
+                disk->pentry_arr_bak_dirty_start = 0;
+                disk->pentry_arr_bak_dirty_end = 0;
+        }
+        //Arrays dirty as a whole are written in full
+        if (disk->dirty & GPT_DIRTY_PENTRY_ARR) {
+                disk->pentry_arr_dirty_start = 0;
+                disk->pentry_arr_dirty_end = disk->pentry_arr_size;
+        }
+        if (disk->dirty & GPT_DIRTY_PENTRY_ARR_BAK) {
+                disk->pentry_arr_bak_dirty_start = 0;
+                disk->pentry_arr_bak_dirty_end = disk->pentry_arr_size;
+        }
+        if (!disk->dirty &&
+                        disk->pentry_arr_dirty_start >= disk->pentry_arr_dirty_end &&
+                        disk->pentry_arr_bak_dirty_start >=
+                        disk->pentry_arr_bak_dirty_end)
+                return 0;
+        if (disk->pentry_arr_dirty_start < disk->pentry_arr_dirty_end &&
+                        gpt_set_pentry_arr(disk, PRIMARY_GPT,
+                                disk->pentry_arr_dirty_start,
+                                disk->pentry_arr_dirty_end))
+                goto error;
+        if (disk->pentry_arr_bak_dirty_start < disk->pentry_arr_bak_dirty_end &&
+                        gpt_set_pentry_arr(disk, SECONDARY_GPT,
+                                disk->pentry_arr_bak_dirty_start,
+                                disk->pentry_arr_bak_dirty_end))
+                goto error;
+        if ((disk->dirty & GPT_DIRTY_HDR) &&
+                        gpt_set_header(disk, PRIMARY_GPT))
+                goto error;
+        if ((disk->dirty & GPT_DIRTY_HDR_BAK) &&
+                        gpt_set_header(disk, SECONDARY_GPT))
+                goto error;
+        if (fsync(disk->fd) < 0) {
+                ALOGE("%s: fsync of %s failed: %s",
+                                __func__,
+                                disk->devpath,
+                                strerror(errno));
                 goto error;
         }
+        disk->dirty = 0;
+        disk->pentry_arr_dirty_start = disk->pentry_arr_dirty_end = 0;
+        disk->pentry_arr_bak_dirty_start = disk->pentry_arr_bak_dirty_end = 0;
         return 0;
 error:
         return -1;
 }
 
-
-
 //Allocate a handle used by calls to the "gpt_disk" api's
 struct gpt_disk * gpt_disk_alloc()
 {
@@ -1356,15 +1636,14 @@ struct gpt_disk * gpt_disk_alloc()
                 goto end;
         }
         memset(disk, 0, sizeof(struct gpt_disk));
+        disk->fd = -1;
 end:
         return disk;
 }
 
-//Free previously allocated/initialized handle
-void gpt_disk_free(struct gpt_disk *disk)
+//Drop everything loaded into the handle and close the disk
+static void gpt_disk_release(struct gpt_disk *disk)
 {
-        if (!disk)
-                return;
         if (disk->hdr)
                 free(disk->hdr);
         if (disk->hdr_bak)
@@ -1373,81 +1652,162 @@ void gpt_disk_free(struct gpt_disk *disk)
                 free(disk->pentry_arr);
         if (disk->pentry_arr_bak)
                 free(disk->pentry_arr_bak);
+        delete disk->pentry_index;
+        delete disk->pentry_index_bak;
+        //Only a handle set up by gpt_disk_open owns its descriptor
+        if (disk->is_initialized == GPT_DISK_INIT_MAGIC && disk->fd >= 0)
+                close(disk->fd);
+        memset(disk, 0, sizeof(struct gpt_disk));
+        disk->fd = -1;
+}
+
+//Free previously allocated/initialized handle
+void gpt_disk_free(struct gpt_disk *disk)
+{
+        if (!disk)
+                return;
+        gpt_disk_release(disk);
         free(disk);
         return;
 }
 
-//fills up the passed in gpt_disk struct with information about the
-//disk represented by path dev. Returns 0 on success and -1 on error.
-int gpt_disk_get_disk_info(const char *dev, struct gpt_disk *dsk)
+//Open the block device at devpath and load its primary GPT into disk.
+//The device stays open and its block size cached until the handle is
+//freed, so later state changes and commits need no further lookups. The
+//backup GPT and the name indexes are only loaded by the calls needing
+//them, so a one-off query reads no more than the primary GPT.
+int gpt_disk_open(const char *devpath, struct gpt_disk *disk)
 {
-        struct gpt_disk *disk = NULL;
         int fd = -1;
+        int64_t disk_size = 0;
         uint32_t gpt_header_size = 0;
 
-        if (!dsk || !dev) {
-                ALOGE("%s: Invalid arguments", __func__);
+        gpt_disk_release(disk);
+        strlcpy(disk->devpath, devpath, sizeof(disk->devpath));
+        fd = open(disk->devpath, O_RDWR | O_CLOEXEC);
+        if (fd < 0) {
+                ALOGE("%s: Failed to open %s: %s",
+                                __func__,
+                                disk->devpath,
+                                strerror(errno));
                 goto error;
         }
-        disk = dsk;
-        disk->hdr = gpt_get_header(dev, PRIMARY_GPT);
-        if (!disk->hdr) {
-                ALOGE("%s: Failed to get primary header", __func__);
+        disk->fd = fd;
+        disk->block_size = gpt_get_block_size(fd);
+        if (!disk->block_size) {
+                ALOGE("%s: Failed to get gpt block size for %s",
+                                __func__,
+                                disk->devpath);
                 goto error;
         }
-        gpt_header_size = GET_4_BYTES(disk->hdr + HEADER_SIZE_OFFSET);
-        disk->hdr_crc = crc32(0, disk->hdr, gpt_header_size);
-        disk->hdr_bak = gpt_get_header(dev, PRIMARY_GPT);
-        if (!disk->hdr_bak) {
-                ALOGE("%s: Failed to get backup header", __func__);
+        disk_size = lseek64(fd, 0, SEEK_END);
+        if (disk_size < 3 * (int64_t) disk->block_size) {
+                ALOGE("%s: Failed to get size of %s",
+                                __func__,
+                                disk->devpath);
+                goto error;
+        }
+        disk->hdr_bak_offset = disk_size - disk->block_size;
+        if (gpt_load(disk, PRIMARY_GPT)) {
+                ALOGE("%s: Failed to load primary GPT", __func__);
                 goto error;
         }
-        disk->hdr_bak_crc = crc32(0, disk->hdr_bak, gpt_header_size);
+        gpt_header_size = GET_4_BYTES(disk->hdr + HEADER_SIZE_OFFSET);
+        disk->hdr_crc = gpt_crc32(0, disk->hdr, gpt_header_size);
+        disk->pentry_arr_crc = GET_4_BYTES(disk->hdr + PARTITION_CRC_OFFSET);
+        disk->is_initialized = GPT_DISK_INIT_MAGIC;
+        return 0;
+error:
+        if (fd >= 0)
+                close(fd);
+        disk->fd = -1;
+        gpt_disk_release(disk);
+        return -1;
+}
+
+//Load the backup GPT of a disk opened by gpt_disk_open, if not done yet
+static int gpt_disk_load_bak(struct gpt_disk *disk)
+{
+        uint32_t gpt_header_size = 0;
+
+        if (disk->hdr_bak)
+                return 0;
+        if (gpt_load(disk, SECONDARY_GPT)) {
+                //Readers only ever needed the primary GPT, keep serving them
+                //with a copy of it in place of the backup
+                ALOGW("%s: Failed to load backup GPT of %s, using the primary",
+                                __func__,
+                                disk->devpath);
+                disk->hdr_bak = (uint8_t*)malloc(disk->block_size);
+                disk->pentry_arr_bak = (uint8_t*)malloc(disk->pentry_arr_size);
+                if (!disk->hdr_bak || !disk->pentry_arr_bak) {
+                        ALOGE("%s: Failed to allocate memory for backup GPT",
+                                        __func__);
+                        goto error;
+                }
+                memcpy(disk->hdr_bak, disk->hdr, disk->block_size);
+                memcpy(disk->pentry_arr_bak, disk->pentry_arr,
+                                disk->pentry_arr_size);
+                disk->hdr_bak_is_copy = 1;
+        }
+        gpt_header_size = GET_4_BYTES(disk->hdr_bak + HEADER_SIZE_OFFSET);
+        disk->hdr_bak_crc = gpt_crc32(0, disk->hdr_bak, gpt_header_size);
+        disk->pentry_arr_bak_crc = GET_4_BYTES(disk->hdr_bak +
+                        PARTITION_CRC_OFFSET);
+        return 0;
+error:
+        if (disk->hdr_bak)
+                free(disk->hdr_bak);
+        if (disk->pentry_arr_bak)
+                free(disk->pentry_arr_bak);
+        disk->hdr_bak = NULL;
+        disk->pentry_arr_bak = NULL;
+        return -1;
+}
 
-        //Descriptor for the block device. We will use this for further
-        //modifications to the partition table
+//Name index of the entry array of the given instance, built on first use.
+//Lookups fall back to scanning the array if it cannot be built.
+static const struct gpt_pentry_index *gpt_disk_get_index(struct gpt_disk *disk,
+                enum gpt_instance instance)
+{
+        struct gpt_pentry_index **index = (instance == PRIMARY_GPT) ?
+                &disk->pentry_index : &disk->pentry_index_bak;
+        const uint8_t *ptn_arr = (instance == PRIMARY_GPT) ?
+                disk->pentry_arr : disk->pentry_arr_bak;
+
+        if (!*index && ptn_arr)
+                *index = gpt_pentry_index_build(ptn_arr,
+                                ptn_arr + disk->pentry_arr_size,
+                                disk->pentry_size);
+        return *index;
+}
+
+//fills up the passed in gpt_disk struct with information about the
+//disk represented by path dev. Returns 0 on success and -1 on error.
+int gpt_disk_get_disk_info(const char *dev, struct gpt_disk *dsk)
+{
+        char devpath[PATH_MAX] = {0};
+
+        if (!dsk || !dev) {
+                ALOGE("%s: Invalid arguments", __func__);
+                goto error;
+        }
         if (get_dev_path_from_partition_name(dev,
-                                disk->devpath,
-                                sizeof(disk->devpath)) != 0) {
+                                devpath,
+                                sizeof(devpath)) != 0) {
                 ALOGE("%s: Failed to resolve path for %s",
                                 __func__,
                                 dev);
                 goto error;
         }
-        fd = open(disk->devpath, O_RDWR);
-        if (fd < 0) {
-                ALOGE("%s: Failed to open %s: %s",
+        if (gpt_disk_open(devpath, dsk)) {
+                ALOGE("%s: Failed to load GPT from %s",
                                 __func__,
-                                disk->devpath,
-                                strerror(errno));
-                goto error;
-        }
-        disk->pentry_arr = gpt_get_pentry_arr(disk->hdr, fd);
-        if (!disk->pentry_arr) {
-                ALOGE("%s: Failed to obtain partition entry array",
-                                __func__);
-                goto error;
-        }
-        disk->pentry_arr_bak = gpt_get_pentry_arr(disk->hdr_bak, fd);
-        if (!disk->pentry_arr_bak) {
-                ALOGE("%s: Failed to obtain backup partition entry array",
-                                __func__);
+                                devpath);
                 goto error;
         }
-        disk->pentry_size = GET_4_BYTES(disk->hdr + PENTRY_SIZE_OFFSET);
-        disk->pentry_arr_size =
-                GET_4_BYTES(disk->hdr + PARTITION_COUNT_OFFSET) *
-                disk->pentry_size;
-        disk->pentry_arr_crc = GET_4_BYTES(disk->hdr + PARTITION_CRC_OFFSET);
-        disk->pentry_arr_bak_crc = GET_4_BYTES(disk->hdr_bak +
-                        PARTITION_CRC_OFFSET);
-        disk->block_size = gpt_get_block_size(fd);
-        close(fd);
-        disk->is_initialized = GPT_DISK_INIT_MAGIC;
         return 0;
 error:
-        if (fd >= 0)
-                close(fd);
         return -1;
 }
 
@@ -1457,19 +1817,201 @@ uint8_t* gpt_disk_get_pentry(struct gpt_disk *disk,
                 enum gpt_instance instance)
 {
         uint8_t *ptn_arr = NULL;
+        const struct gpt_pentry_index *index = NULL;
         if (!disk || !partname || disk->is_initialized != GPT_DISK_INIT_MAGIC) {
                 ALOGE("%s: Invalid argument",__func__);
                 goto error;
         }
+        if (instance == SECONDARY_GPT && gpt_disk_load_bak(disk))
+                goto error;
         ptn_arr = (instance == PRIMARY_GPT) ?
                 disk->pentry_arr : disk->pentry_arr_bak;
-        return (gpt_pentry_seek(partname, ptn_arr,
-                        ptn_arr + disk->pentry_arr_size ,
+        index = gpt_disk_get_index(disk, instance);
+        return (gpt_pentry_find(index, partname, ptn_arr, ptn_arr,
+                        ptn_arr + disk->pentry_arr_size,
                         disk->pentry_size));
 error:
         return NULL;
 }
 
+//Entry at pos of ptn_arr if it is named exactly name, NULL otherwise
+static uint8_t *gpt_disk_pentry_at(struct gpt_disk *disk, uint8_t *ptn_arr,
+                uint32_t pos, const string &name)
+{
+        char name8[MAX_GPT_NAME_SIZE / 2 + 1];
+        uint8_t *pentry = NULL;
+
+        if (pos == GPT_PENTRY_POS_NONE ||
+                        (uint64_t) pos * disk->pentry_size + PTN_ENTRY_SIZE >
+                        disk->pentry_arr_size)
+                return NULL;
+        pentry = ptn_arr + (uint64_t) pos * disk->pentry_size;
+        gpt_pentry_get_name(pentry, name8);
+        return name == name8 ? pentry : NULL;
+}
+
+//Get pointers to the entries of both slots of an A/B partition from a
+//allocated gpt_disk structure
+int gpt_disk_get_slot_pentries(struct gpt_disk *disk,
+                const char *partname,
+                enum gpt_instance instance,
+                uint8_t **pentry_a,
+                uint8_t **pentry_b)
+{
+        uint8_t *ptn_arr = NULL;
+        const struct gpt_pentry_index *index = NULL;
+        string name_a;
+        string name_b;
+
+        if (!disk || !partname || !pentry_a || !pentry_b ||
+                        disk->is_initialized != GPT_DISK_INIT_MAGIC) {
+                ALOGE("%s: Invalid argument",__func__);
+                goto error;
+        }
+        if (instance == SECONDARY_GPT && gpt_disk_load_bak(disk))
+                goto error;
+        ptn_arr = (instance == PRIMARY_GPT) ?
+                disk->pentry_arr : disk->pentry_arr_bak;
+        index = gpt_disk_get_index(disk, instance);
+        name_a = string(partname) + AB_SLOT_A_SUFFIX;
+        name_b = string(partname) + AB_SLOT_B_SUFFIX;
+        *pentry_a = *pentry_b = NULL;
+        if (index) {
+                auto it = index->slots.find(partname);
+                if (it != index->slots.end()) {
+                        *pentry_a = gpt_disk_pentry_at(disk, ptn_arr,
+                                        it->second.first, name_a);
+                        *pentry_b = gpt_disk_pentry_at(disk, ptn_arr,
+                                        it->second.second, name_b);
+                }
+        }
+        //Without an index, or with a stale one, look the slots up by name
+        if (!*pentry_a)
+                *pentry_a = gpt_disk_get_pentry(disk, name_a.c_str(), instance);
+        if (!*pentry_b)
+                *pentry_b = gpt_disk_get_pentry(disk, name_b.c_str(), instance);
+        if (!*pentry_a || !*pentry_b)
+                goto error;
+        return 0;
+error:
+        return -1;
+}
+
+void gpt_pentry_iter_init(struct gpt_pentry_iter *it,
+                struct gpt_disk *disk,
+                enum gpt_instance instance)
+{
+        it->disk = disk;
+        it->instance = instance;
+        it->entry = NULL;
+        it->index = 0;
+        it->next = 0;
+}
+
+int gpt_pentry_iter_next(struct gpt_pentry_iter *it)
+{
+        static const uint8_t unused_type[TYPE_GUID_SIZE] = {0};
+        struct gpt_disk *disk = it->disk;
+        uint8_t *arr;
+        uint32_t count;
+
+        if (!disk || disk->is_initialized != GPT_DISK_INIT_MAGIC)
+                goto end;
+        if (it->instance == SECONDARY_GPT && gpt_disk_load_bak(disk))
+                goto end;
+        arr = (it->instance == PRIMARY_GPT) ?
+                disk->pentry_arr : disk->pentry_arr_bak;
+        count = disk->pentry_arr_size / disk->pentry_size;
+        //Entries with a zero type GUID are unused
+        for (; it->next < count; it->next++) {
+                uint8_t *pentry = arr + it->next * disk->pentry_size;
+                if (memcmp(pentry + TYPE_GUID_OFFSET, unused_type,
+                                        TYPE_GUID_SIZE)) {
+                        it->entry = pentry;
+                        it->index = it->next++;
+                        return 1;
+                }
+        }
+end:
+        it->entry = NULL;
+        return 0;
+}
+
+int gpt_pentry_set_ab_attr(struct gpt_disk *disk,
+                enum gpt_instance instance,
+                uint8_t *pentry,
+                uint8_t mask,
+                uint8_t value)
+{
+        uint8_t *arr;
+        uint8_t *hdr;
+        uint32_t offset;
+        uint32_t gpt_header_size;
+        uint32_t crc;
+        uint32_t *dirty_start;
+        uint32_t *dirty_end;
+        uint8_t delta;
+
+        if (!disk || !pentry || disk->is_initialized != GPT_DISK_INIT_MAGIC) {
+                ALOGE("%s: Invalid argument", __func__);
+                goto error;
+        }
+        if (instance == SECONDARY_GPT && gpt_disk_load_bak(disk))
+                goto error;
+        if (instance == PRIMARY_GPT) {
+                arr = disk->pentry_arr;
+                hdr = disk->hdr;
+                dirty_start = &disk->pentry_arr_dirty_start;
+                dirty_end = &disk->pentry_arr_dirty_end;
+        } else {
+                arr = disk->pentry_arr_bak;
+                hdr = disk->hdr_bak;
+                dirty_start = &disk->pentry_arr_bak_dirty_start;
+                dirty_end = &disk->pentry_arr_bak_dirty_end;
+        }
+        if (pentry < arr || pentry >= arr + disk->pentry_arr_size ||
+                        (pentry - arr) % disk->pentry_size) {
+                ALOGE("%s: Entry is not part of the array", __func__);
+                goto error;
+        }
+        offset = pentry - arr + AB_FLAG_OFFSET;
+        delta = (arr[offset] ^ value) & mask;
+        if (!delta)
+                return 0;
+        arr[offset] ^= delta;
+
+        //Only the one byte changed, so its effect on the CRC of the array
+        //is all that needs working out
+        crc = gpt_crc32_apply_delta(GET_4_BYTES(hdr + PARTITION_CRC_OFFSET),
+                        &delta, 1, disk->pentry_arr_size - offset - 1);
+        PUT_4_BYTES(hdr + PARTITION_CRC_OFFSET, crc);
+        gpt_header_size = GET_4_BYTES(hdr + HEADER_SIZE_OFFSET);
+        PUT_4_BYTES(hdr + HEADER_CRC_OFFSET, 0);
+        crc = gpt_crc32(0, hdr, gpt_header_size);
+        PUT_4_BYTES(hdr + HEADER_CRC_OFFSET, crc);
+        if (instance == PRIMARY_GPT) {
+                disk->pentry_arr_crc = GET_4_BYTES(hdr + PARTITION_CRC_OFFSET);
+                disk->hdr_crc = crc;
+                disk->dirty |= GPT_DIRTY_HDR;
+        } else {
+                disk->pentry_arr_bak_crc = GET_4_BYTES(hdr +
+                                PARTITION_CRC_OFFSET);
+                disk->hdr_bak_crc = crc;
+                disk->dirty |= GPT_DIRTY_HDR_BAK;
+        }
+
+        if (*dirty_start >= *dirty_end) {
+                *dirty_start = offset;
+                *dirty_end = offset + 1;
+        } else {
+                *dirty_start = min(*dirty_start, offset);
+                *dirty_end = max(*dirty_end, offset + 1);
+        }
+        return 0;
+error:
+        return -1;
+}
+
 //Update CRC values for the various components of the gpt_disk
 //structure. This function should be called after any of the fields
 //have been updated before the structure contents are written back to
@@ -1482,26 +2024,29 @@ int gpt_disk_update_crc(struct gpt_disk *disk)
                 goto error;
         }
         //Recalculate the CRC of the primary partiton array
-        disk->pentry_arr_crc = crc32(0,
+        disk->pentry_arr_crc = gpt_crc32(0,
                         disk->pentry_arr,
                         disk->pentry_arr_size);
-        //Recalculate the CRC of the backup partition array
-        disk->pentry_arr_bak_crc = crc32(0,
-                        disk->pentry_arr_bak,
-                        disk->pentry_arr_size);
         //Update the partition CRC value in the primary GPT header
         PUT_4_BYTES(disk->hdr + PARTITION_CRC_OFFSET, disk->pentry_arr_crc);
-        //Update the partition CRC value in the backup GPT header
-        PUT_4_BYTES(disk->hdr_bak + PARTITION_CRC_OFFSET,
-                        disk->pentry_arr_bak_crc);
         //Update the CRC value of the primary header
         gpt_header_size = GET_4_BYTES(disk->hdr + HEADER_SIZE_OFFSET);
         //Header CRC is calculated with its own CRC field set to 0
         PUT_4_BYTES(disk->hdr + HEADER_CRC_OFFSET, 0);
-        PUT_4_BYTES(disk->hdr_bak + HEADER_CRC_OFFSET, 0);
-        disk->hdr_crc = crc32(0, disk->hdr, gpt_header_size);
-        disk->hdr_bak_crc = crc32(0, disk->hdr_bak, gpt_header_size);
+        disk->hdr_crc = gpt_crc32(0, disk->hdr, gpt_header_size);
         PUT_4_BYTES(disk->hdr + HEADER_CRC_OFFSET, disk->hdr_crc);
+        //A backup GPT that was never loaded has not been changed either
+        if (!disk->hdr_bak)
+                return 0;
+        //Recalculate the CRC of the backup partition array
+        disk->pentry_arr_bak_crc = gpt_crc32(0,
+                        disk->pentry_arr_bak,
+                        disk->pentry_arr_size);
+        //Update the partition CRC value in the backup GPT header
+        PUT_4_BYTES(disk->hdr_bak + PARTITION_CRC_OFFSET,
+                        disk->pentry_arr_bak_crc);
+        PUT_4_BYTES(disk->hdr_bak + HEADER_CRC_OFFSET, 0);
+        disk->hdr_bak_crc = gpt_crc32(0, disk->hdr_bak, gpt_header_size);
         PUT_4_BYTES(disk->hdr_bak + HEADER_CRC_OFFSET, disk->hdr_bak_crc);
         return 0;
 error:
@@ -1511,37 +2056,19 @@ error:
 //Write the contents of struct gpt_disk back to the actual disk
 int gpt_disk_commit(struct gpt_disk *disk)
 {
-        int fd = -1;
         if (!disk || (disk->is_initialized != GPT_DISK_INIT_MAGIC)){
                 ALOGE("%s: Invalid args", __func__);
                 goto error;
         }
-        fd = open(disk->devpath, O_RDWR);
-        if (fd < 0) {
-                ALOGE("%s: Failed to open %s: %s",
-                                __func__,
-                                disk->devpath,
-                                strerror(errno));
-                goto error;
-        }
-        ALOGI("%s: Writing back primary GPT header", __func__);
-        //Write the primary header
-        if(gpt_set_header(disk->hdr, fd, PRIMARY_GPT) != 0) {
-                ALOGE("%s: Failed to update primary GPT header",
-                                __func__);
-                goto error;
-        }
-        ALOGI("%s: Writing back primary partition array", __func__);
-        //Write back the primary partition array
-        if (gpt_set_pentry_arr(disk->hdr, fd, disk->pentry_arr)) {
-                ALOGE("%s: Failed to write primary GPT partition arr",
+        ALOGI("%s: Writing back primary GPT header and partition array",
+                        __func__);
+        disk->dirty |= GPT_DIRTY_HDR | GPT_DIRTY_PENTRY_ARR;
+        if (gpt_disk_flush(disk)) {
+                ALOGE("%s: Failed to update primary GPT",
                                 __func__);
                 goto error;
         }
-        close(fd);
         return 0;
 error:
-        if (fd >= 0)
-                close(fd);
         return -1;
 }
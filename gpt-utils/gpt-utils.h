@@ -37,6 +37,9 @@ extern "C" {
 #endif
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <endian.h>
 /******************************************************************************
  * GPT HEADER DEFINES
  ******************************************************************************/
@@ -69,6 +72,7 @@ extern "C" {
 //store our AB attributes.
 #define AB_FLAG_OFFSET (ATTRIBUTE_FLAG_OFFSET + 6)
 #define GPT_DISK_INIT_MAGIC 0xABCD
+#define AB_PARTITION_ATTR_PRIORITY_MASK (0x3)
 #define AB_PARTITION_ATTR_SLOT_ACTIVE (0x1<<2)
 #define AB_PARTITION_ATTR_BOOT_SUCCESSFUL (0x1<<6)
 #define AB_PARTITION_ATTR_UNBOOTABLE (0x1<<7)
@@ -86,7 +90,11 @@ extern "C" {
 
 #define AB_PTN_LIST PTN_SWAP_LIST, "boot", "system", "vendor", "modem", \
                                    "system_ext", "product"
+//Overridden by gpt_utils_test so that it never finds the partitions of
+//the device it runs on
+#ifndef BOOT_DEV_DIR
 #define BOOT_DEV_DIR    "/dev/block/bootdevice/by-name"
+#endif
 
 /******************************************************************************
  * HELPER MACROS
@@ -111,12 +119,14 @@ enum boot_chain {
 	BACKUP_BOOT
 };
 
+struct gpt_pentry_index;
+
 struct gpt_disk {
 	//GPT primary header
 	uint8_t *hdr;
 	//primary header crc
 	uint32_t hdr_crc;
-	//GPT backup header
+	//GPT backup header, NULL until the backup GPT is loaded
 	uint8_t *hdr_bak;
 	//backup header crc
 	uint32_t hdr_bak_crc;
@@ -136,13 +146,99 @@ struct gpt_disk {
 	char devpath[PATH_MAX];
 	//Block size of disk
 	uint32_t block_size;
+	//Descriptor for devpath, held open until gpt_disk_free
+	int fd;
+	//Offset of the backup GPT header, the last block of the disk
+	int64_t hdr_bak_offset;
+	//Set when the backup GPT could not be loaded and hdr_bak and
+	//pentry_arr_bak are copies of the primary ones. Nothing is then ever
+	//written to the backup location.
+	uint32_t hdr_bak_is_copy;
+	//Partition name indexes over pentry_arr and pentry_arr_bak, built by
+	//the first lookup in each
+	struct gpt_pentry_index *pentry_index;
+	struct gpt_pentry_index *pentry_index_bak;
+	//Parts changed since they were last written back to the disk
+	uint32_t dirty;
+	//Byte ranges [start, end) of the entry arrays changed in place since
+	//they were last written back. Only used while the array as a whole
+	//is not marked dirty.
+	uint32_t pentry_arr_dirty_start;
+	uint32_t pentry_arr_dirty_end;
+	uint32_t pentry_arr_bak_dirty_start;
+	uint32_t pentry_arr_bak_dirty_end;
 	uint32_t is_initialized;
 };
 
+//Walks the used entries of one of the entry arrays of a loaded disk
+//without copying them:
+//
+//	struct gpt_pentry_iter it;
+//	gpt_pentry_iter_init(&it, disk, PRIMARY_GPT);
+//	while (gpt_pentry_iter_next(&it))
+//		use it.entry with the gpt_pentry_get_* accessors
+struct gpt_pentry_iter {
+	struct gpt_disk *disk;
+	enum gpt_instance instance;
+	//Current entry, pointing into the array held by disk
+	uint8_t *entry;
+	//Position of entry in the array
+	uint32_t index;
+	//Position the next call to gpt_pentry_iter_next looks at
+	uint32_t next;
+};
+
+/******************************************************************************
+ * ENTRY ACCESSORS
+ ******************************************************************************/
+//Entries are only byte aligned, so fields are loaded through memcpy which
+//compiles to a single unaligned load where the CPU allows it
+static inline uint32_t gpt_get_le32(const uint8_t *ptr)
+{
+	uint32_t val;
+	memcpy(&val, ptr, sizeof(val));
+	return le32toh(val);
+}
+
+static inline uint64_t gpt_get_le64(const uint8_t *ptr)
+{
+	uint64_t val;
+	memcpy(&val, ptr, sizeof(val));
+	return le64toh(val);
+}
+
+static inline const uint8_t *gpt_pentry_get_type_guid(const uint8_t *pentry)
+{
+	return pentry + TYPE_GUID_OFFSET;
+}
+
+static inline uint64_t gpt_pentry_get_first_lba(const uint8_t *pentry)
+{
+	return gpt_get_le64(pentry + FIRST_LBA_OFFSET);
+}
+
+static inline uint64_t gpt_pentry_get_last_lba(const uint8_t *pentry)
+{
+	return gpt_get_le64(pentry + LAST_LBA_OFFSET);
+}
+
+static inline uint64_t gpt_pentry_get_attr(const uint8_t *pentry)
+{
+	return gpt_get_le64(pentry + ATTRIBUTE_FLAG_OFFSET);
+}
+
+//AB_PARTITION_ATTR_* bits of the entry
+static inline uint8_t gpt_pentry_get_ab_attr(const uint8_t *pentry)
+{
+	return pentry[AB_FLAG_OFFSET];
+}
+
 /******************************************************************************
  * FUNCTION PROTOTYPES
  ******************************************************************************/
 int prepare_boot_update(enum boot_update_stage stage);
+//Run one stage of a boot update on the block device at dev_path alone
+int prepare_partitions(enum boot_update_stage stage, const char *dev_path);
 //GPT disk methods
 struct gpt_disk* gpt_disk_alloc();
 //Free previously allocated gpt_disk struct
@@ -151,17 +247,62 @@ void gpt_disk_free(struct gpt_disk *disk);
 //is passed in via dev
 int gpt_disk_get_disk_info(const char *dev, struct gpt_disk *disk);
 
+//Load the primary GPT of the block device at devpath. The backup GPT is
+//loaded by the first call that needs it.
+int gpt_disk_open(const char *devpath, struct gpt_disk *disk);
+
+//Point the backup GPT at the normal or the backup copies of the boot
+//critical partitions. Returns 1 if the disk holds no backup copies. The
+//change is written back by gpt_disk_commit.
+int gpt2_set_boot_chain(struct gpt_disk *disk, enum boot_chain boot);
+
 //Get pointer to partition entry from a allocated gpt_disk structure
 uint8_t* gpt_disk_get_pentry(struct gpt_disk *disk,
 		const char *partname,
 		enum gpt_instance instance);
 
+//Get pointers to the entries of both slots of the A/B partition partname,
+//given without its slot suffix, with a single index lookup. Returns 0 if
+//both were found.
+int gpt_disk_get_slot_pentries(struct gpt_disk *disk,
+		const char *partname,
+		enum gpt_instance instance,
+		uint8_t **pentry_a,
+		uint8_t **pentry_b);
+
 //Update the crc fields of the modified disk structure
 int gpt_disk_update_crc(struct gpt_disk *disk);
 
 //Write the contents of struct gpt_disk back to the actual disk
 int gpt_disk_commit(struct gpt_disk *disk);
 
+//Write back only the parts of the disk changed through gpt2_set_boot_chain
+//and gpt_pentry_set_ab_attr, with a single fsync. Changes made through
+//pointers returned by gpt_disk_get_pentry need gpt_disk_commit.
+int gpt_disk_flush(struct gpt_disk *disk);
+
+//Start iterating over the entries of the given array of disk
+void gpt_pentry_iter_init(struct gpt_pentry_iter *it,
+		struct gpt_disk *disk,
+		enum gpt_instance instance);
+
+//Move to the next used entry. Returns 0 once there are none left.
+int gpt_pentry_iter_next(struct gpt_pentry_iter *it);
+
+//Copy the name of an entry, dropping the upper byte of each UTF-16 unit
+void gpt_pentry_get_name(const uint8_t *pentry,
+		char name8[MAX_GPT_NAME_SIZE / 2 + 1]);
+
+//Set the AB_PARTITION_ATTR_* bits selected by mask in an entry of the given
+//array of disk to those of value, in place. The CRCs of the array and its
+//header are patched rather than recomputed, so they must be current. Only
+//the blocks holding changed entries are written back by gpt_disk_flush.
+int gpt_pentry_set_ab_attr(struct gpt_disk *disk,
+		enum gpt_instance instance,
+		uint8_t *pentry,
+		uint8_t mask,
+		uint8_t value);
+
 //Return if the current device is UFS based or not
 int gpt_utils_is_ufs_device();
 
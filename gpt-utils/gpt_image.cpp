@@ -0,0 +1,243 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Android Open Source Project nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/loop.h>
+#include "gpt-utils.h"
+#include "gpt-crc32.h"
+#include "gpt_image.h"
+
+using namespace std;
+
+#define GPT_HEADER_SIZE             92
+#define GPT_REVISION                0x00010000
+
+static void put_le(uint8_t *ptr, uint64_t val, size_t len)
+{
+        size_t i;
+        for (i = 0; i < len; i++)
+                ptr[i] = (val >> (8 * i)) & 0xff;
+}
+
+//Deterministic stand-in for a random GUID
+static void fill_guid(uint8_t *guid, uint32_t seed, uint32_t salt)
+{
+        uint32_t x = seed * 2654435761u ^ salt;
+        int i;
+        for (i = 0; i < TYPE_GUID_SIZE; i++) {
+                x = x * 1103515245u + 12345u;
+                guid[i] = x >> 24;
+        }
+}
+
+static void fill_pentry(uint8_t *pentry, const char *name, uint32_t type,
+                uint32_t id, uint64_t first_lba)
+{
+        size_t i;
+        fill_guid(pentry + TYPE_GUID_OFFSET, type, 0x7479);
+        fill_guid(pentry + UNIQUE_GUID_OFFSET, id, 0x7569);
+        put_le(pentry + FIRST_LBA_OFFSET, first_lba, 8);
+        put_le(pentry + LAST_LBA_OFFSET,
+                        first_lba + GPT_IMAGE_PTN_BLOCKS - 1, 8);
+        //Partition names are UTF-16LE
+        for (i = 0; name[i] && i < MAX_GPT_NAME_SIZE / 2; i++)
+                pentry[PARTITION_NAME_OFFSET + 2 * i] = name[i];
+}
+
+static void fill_header(uint8_t *hdr, uint64_t current_lba, uint64_t backup_lba,
+                uint64_t first_usable, uint64_t last_usable,
+                uint64_t pentries_lba, uint32_t entries, uint32_t arr_crc)
+{
+        //The header CRC is calculated with its own field cleared
+        memset(hdr, 0, GPT_HEADER_SIZE);
+        memcpy(hdr, GPT_SIGNATURE, strlen(GPT_SIGNATURE));
+        put_le(hdr + 8, GPT_REVISION, 4);
+        put_le(hdr + HEADER_SIZE_OFFSET, GPT_HEADER_SIZE, 4);
+        put_le(hdr + PRIMARY_HEADER_OFFSET, current_lba, 8);
+        put_le(hdr + BACKUP_HEADER_OFFSET, backup_lba, 8);
+        put_le(hdr + FIRST_USABLE_LBA_OFFSET, first_usable, 8);
+        put_le(hdr + LAST_USABLE_LBA_OFFSET, last_usable, 8);
+        fill_guid(hdr + 56, 0, 0x6469);
+        put_le(hdr + PENTRIES_OFFSET, pentries_lba, 8);
+        put_le(hdr + PARTITION_COUNT_OFFSET, entries, 4);
+        put_le(hdr + PENTRY_SIZE_OFFSET, PTN_ENTRY_SIZE, 4);
+        put_le(hdr + PARTITION_CRC_OFFSET, arr_crc, 4);
+        put_le(hdr + HEADER_CRC_OFFSET, gpt_crc32(0, hdr, GPT_HEADER_SIZE), 4);
+}
+
+int gpt_image_write(const char *path, const vector<string> &names,
+                uint32_t entries, uint32_t block_size)
+{
+        vector<uint8_t> arr(entries * PTN_ENTRY_SIZE);
+        vector<uint8_t> hdr(block_size);
+        uint64_t arr_blocks = (arr.size() + block_size - 1) / block_size;
+        uint64_t first_usable = 2 + arr_blocks;
+        uint64_t last_usable = first_usable +
+                (uint64_t)entries * GPT_IMAGE_PTN_BLOCKS - 1;
+        uint64_t last_lba = last_usable + arr_blocks + 1;
+        uint32_t arr_crc;
+        uint32_t i;
+        int fd = -1;
+
+        for (i = 0; i < entries; i++) {
+                string name = i < names.size() ? names[i] :
+                        "filler" + to_string(i);
+                string type = name;
+                //A partition and its backup share a type GUID
+                if (type.size() > strlen(BAK_PTN_NAME_EXT) &&
+                                !type.compare(type.size() - strlen(BAK_PTN_NAME_EXT),
+                                        string::npos, BAK_PTN_NAME_EXT))
+                        type.resize(type.size() - strlen(BAK_PTN_NAME_EXT));
+                fill_pentry(&arr[i * PTN_ENTRY_SIZE], name.c_str(),
+                                gpt_crc32(0, (const uint8_t *)type.c_str(),
+                                        type.size()),
+                                i + 1,
+                                first_usable +
+                                (uint64_t)i * GPT_IMAGE_PTN_BLOCKS);
+        }
+        arr_crc = gpt_crc32(0, arr.data(), arr.size());
+
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+                fprintf(stderr, "%s: Failed to create %s: %s\n",
+                                __func__, path, strerror(errno));
+                goto error;
+        }
+        //Everything but the two GPTs is left as a hole
+        if (ftruncate(fd, (last_lba + 1) * block_size)) {
+                fprintf(stderr, "%s: Failed to size %s: %s\n",
+                                __func__, path, strerror(errno));
+                goto error;
+        }
+        fill_header(hdr.data(), 1, last_lba, first_usable, last_usable, 2,
+                        entries, arr_crc);
+        if (pwrite(fd, hdr.data(), block_size, block_size) != block_size ||
+                        pwrite(fd, arr.data(), arr.size(), 2 * block_size) !=
+                        (ssize_t)arr.size())
+                goto write_error;
+        fill_header(hdr.data(), last_lba, 1, first_usable, last_usable,
+                        last_usable + 1, entries, arr_crc);
+        if (pwrite(fd, hdr.data(), block_size, last_lba * block_size) !=
+                        block_size ||
+                        pwrite(fd, arr.data(), arr.size(),
+                                (last_usable + 1) * block_size) !=
+                        (ssize_t)arr.size())
+                goto write_error;
+        if (close(fd)) {
+                fd = -1;
+                goto write_error;
+        }
+        return 0;
+write_error:
+        fprintf(stderr, "%s: Failed to write %s: %s\n",
+                        __func__, path, strerror(errno));
+error:
+        if (fd >= 0)
+                close(fd);
+        return -1;
+}
+
+//Find the block size an image was created with from where its primary
+//GPT header is
+uint32_t gpt_image_probe_block_size(int fd)
+{
+        const uint32_t sizes[] = { 512, 4096 };
+        char sig[sizeof(GPT_SIGNATURE) - 1];
+        size_t i;
+        for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+                if (pread(fd, sig, sizeof(sig), sizes[i]) == (ssize_t)sizeof(sig) &&
+                                !memcmp(sig, GPT_SIGNATURE, sizeof(sig)))
+                        return sizes[i];
+        }
+        return 0;
+}
+
+//Attach image_fd to a free loop device with the given logical block size.
+//Returns an open descriptor for the loop device and its path in dev_path.
+int gpt_image_loop_attach(int image_fd, uint32_t block_size, char *dev_path,
+                size_t dev_path_size)
+{
+        int ctl_fd = -1;
+        int loop_fd = -1;
+        int loop_id;
+
+        ctl_fd = open("/dev/loop-control", O_RDWR | O_CLOEXEC);
+        if (ctl_fd < 0) {
+                fprintf(stderr, "%s: Failed to open loop-control: %s\n",
+                                __func__, strerror(errno));
+                goto error;
+        }
+        loop_id = ioctl(ctl_fd, LOOP_CTL_GET_FREE);
+        if (loop_id < 0) {
+                fprintf(stderr, "%s: No free loop device: %s\n",
+                                __func__, strerror(errno));
+                goto error;
+        }
+        snprintf(dev_path, dev_path_size, "/dev/block/loop%d", loop_id);
+        if (access(dev_path, F_OK))
+                snprintf(dev_path, dev_path_size, "/dev/loop%d", loop_id);
+        loop_fd = open(dev_path, O_RDWR | O_CLOEXEC);
+        if (loop_fd < 0) {
+                fprintf(stderr, "%s: Failed to open %s: %s\n",
+                                __func__, dev_path, strerror(errno));
+                goto error;
+        }
+        if (ioctl(loop_fd, LOOP_SET_FD, image_fd)) {
+                fprintf(stderr, "%s: Failed to attach %s: %s\n",
+                                __func__, dev_path, strerror(errno));
+                goto error;
+        }
+        if (ioctl(loop_fd, LOOP_SET_BLOCK_SIZE, (unsigned long)block_size)) {
+                fprintf(stderr, "%s: Failed to set %u byte blocks on %s: %s\n",
+                                __func__, block_size, dev_path, strerror(errno));
+                ioctl(loop_fd, LOOP_CLR_FD, 0);
+                goto error;
+        }
+        close(ctl_fd);
+        return loop_fd;
+error:
+        if (loop_fd >= 0)
+                close(loop_fd);
+        if (ctl_fd >= 0)
+                close(ctl_fd);
+        return -1;
+}
+
+void gpt_image_loop_detach(int loop_fd)
+{
+        ioctl(loop_fd, LOOP_CLR_FD, 0);
+        close(loop_fd);
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Android Open Source Project nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+//Synthetic GPT images on loop devices, shared by gpt_image_tool and
+//gpt_utils_test so that both run libgptutils against real block devices
+//without touching the boot device.
+
+#ifndef __GPT_IMAGE_H__
+#define __GPT_IMAGE_H__
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+//Suffix libgptutils expects on the backup twin of a partition
+#define BAK_PTN_NAME_EXT            "bak"
+//Blocks given to each synthetic partition
+#define GPT_IMAGE_PTN_BLOCKS        8
+
+//Write a sparse image at path with a primary and a backup GPT of entries
+//partition entries, the first ones named after names and the rest filler
+//partitions. A partition and its backup twin share a type GUID.
+int gpt_image_write(const char *path, const std::vector<std::string> &names,
+                uint32_t entries, uint32_t block_size);
+
+//Find the block size an image was created with from where its primary
+//GPT header is. Returns 0 if it has none.
+uint32_t gpt_image_probe_block_size(int fd);
+
+//Attach image_fd to a free loop device with the given logical block size.
+//Returns an open descriptor for the loop device and its path in dev_path.
+int gpt_image_loop_attach(int image_fd, uint32_t block_size, char *dev_path,
+                size_t dev_path_size);
+
+//Detach and close a loop device set up by gpt_image_loop_attach
+void gpt_image_loop_detach(int loop_fd);
+#endif /* __GPT_IMAGE_H__ */
@@ -0,0 +1,399 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Android Open Source Project nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+//Exercises libgptutils against synthetic GPT images instead of the boot
+//device. The images are sparse files attached to loop devices, so the
+//library sees real block devices of the chosen block size and runs its
+//normal load, lookup, swap and write back paths on them.
+//
+//Usage:
+//  gpt_image_tool create <dir> [-l luns] [-e entries] [-b block size]
+//      Write lun<N>.img files holding the boot critical partitions of
+//      PTN_SWAP_LIST and their backups spread over the LUNs, padded to
+//      <entries> partition entries per GPT.
+//  gpt_image_tool bench <dir> [-n iterations]
+//      Time gpt_disk_open, gpt_disk_get_pentry, gpt2_set_boot_chain,
+//      gpt_disk_update_crc and gpt_disk_commit on every image and report
+//      the read/write syscalls and fsyncs each of them issues. The images
+//      are left as they were found.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <dirent.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "gpt-utils.h"
+#include "gpt_image.h"
+
+using namespace std;
+
+#define DEFAULT_LUNS                1
+#define DEFAULT_ENTRIES             128
+#define DEFAULT_BLOCK_SIZE          4096
+#define DEFAULT_ITERATIONS          100
+//Largest array libgptutils accepts, GPT_PENTRY_ARR_MAX_SIZE
+#define MAX_ENTRIES                 (1024 * 1024 / PTN_ENTRY_SIZE)
+
+//Counts fsync calls made by the statically linked library. Android.bp
+//links this binary with --wrap=fsync.
+static uint64_t fsync_count;
+extern "C" int __real_fsync(int fd);
+extern "C" int __wrap_fsync(int fd)
+{
+        fsync_count++;
+        return __real_fsync(fd);
+}
+
+struct io_counters {
+        uint64_t syscr;
+        uint64_t syscw;
+        uint64_t fsyncs;
+};
+
+struct op_stats {
+        const char *name;
+        uint64_t total_ns;
+        uint64_t min_ns;
+        uint64_t max_ns;
+        uint64_t runs;
+        struct io_counters io;
+};
+
+enum bench_op {
+        OP_LOAD = 0,
+        OP_SEEK,
+        OP_SWAP,
+        OP_CRC,
+        OP_COMMIT,
+        OP_COUNT
+};
+
+static int create_images(const char *dir, uint32_t luns, uint32_t entries,
+                uint32_t block_size)
+{
+        const char ptn_swap_list[][MAX_GPT_NAME_SIZE] = { PTN_SWAP_LIST };
+        vector<vector<string>> lun_ptns(luns);
+        char path[PATH_MAX];
+        uint32_t i;
+
+        //Boot critical partitions are spread over the LUNs, each one on
+        //the same LUN as its backup
+        for (i = 0; i < ARRAY_SIZE(ptn_swap_list); i++) {
+                lun_ptns[i % luns].push_back(ptn_swap_list[i]);
+                lun_ptns[i % luns].push_back(string(ptn_swap_list[i]) +
+                                BAK_PTN_NAME_EXT);
+        }
+        for (i = 0; i < luns; i++) {
+                if (lun_ptns[i].size() > entries) {
+                        fprintf(stderr, "%s: %u entries cannot hold the %zu partitions of lun%u\n",
+                                        __func__, entries, lun_ptns[i].size(), i);
+                        return -1;
+                }
+                snprintf(path, sizeof(path), "%s/lun%u.img", dir, i);
+                if (gpt_image_write(path, lun_ptns[i], entries, block_size))
+                        return -1;
+                printf("%s: %zu boot critical partitions, %u entries, %u byte blocks\n",
+                                path, lun_ptns[i].size(), entries, block_size);
+        }
+        return 0;
+}
+
+static uint64_t now_ns()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void read_io_counters(struct io_counters *io)
+{
+        char line[128];
+        FILE *fp = fopen("/proc/self/io", "re");
+        memset(io, 0, sizeof(*io));
+        io->fsyncs = fsync_count;
+        if (!fp)
+                return;
+        while (fgets(line, sizeof(line), fp)) {
+                sscanf(line, "syscr: %" SCNu64, &io->syscr);
+                sscanf(line, "syscw: %" SCNu64, &io->syscw);
+        }
+        fclose(fp);
+}
+
+//Syscalls read_io_counters itself adds to the counts it returns
+static struct io_counters io_overhead;
+
+static void calibrate_io_counters()
+{
+        struct io_counters before, after;
+        read_io_counters(&before);
+        read_io_counters(&after);
+        io_overhead.syscr = after.syscr - before.syscr;
+        io_overhead.syscw = after.syscw - before.syscw;
+}
+
+#define BENCH_OP(stats, call) do { \
+        struct io_counters before, after; \
+        uint64_t start, elapsed; \
+        read_io_counters(&before); \
+        start = now_ns(); \
+        r = (call); \
+        elapsed = now_ns() - start; \
+        read_io_counters(&after); \
+        (stats).total_ns += elapsed; \
+        (stats).min_ns = (stats).runs ? min((stats).min_ns, elapsed) : elapsed; \
+        (stats).max_ns = max((stats).max_ns, elapsed); \
+        (stats).runs++; \
+        (stats).io.syscr += after.syscr - before.syscr - io_overhead.syscr; \
+        (stats).io.syscw += after.syscw - before.syscw - io_overhead.syscw; \
+        (stats).io.fsyncs += after.fsyncs - before.fsyncs; \
+} while (0)
+
+static int seek_all(struct gpt_disk *disk, const vector<string> &names)
+{
+        int found = 0;
+        for (const string &name : names) {
+                found += gpt_disk_get_pentry(disk, name.c_str(),
+                                PRIMARY_GPT) != NULL;
+                found += gpt_disk_get_pentry(disk, name.c_str(),
+                                SECONDARY_GPT) != NULL;
+        }
+        return found ? 0 : -1;
+}
+
+static int bench_image(const char *path, uint32_t iterations)
+{
+        const char ptn_swap_list[][MAX_GPT_NAME_SIZE] = { PTN_SWAP_LIST };
+        struct op_stats stats[OP_COUNT];
+        struct gpt_disk *disk = NULL;
+        vector<string> names;
+        char dev_path[PATH_MAX] = {0};
+        uint32_t block_size;
+        uint32_t i;
+        int image_fd = -1;
+        int loop_fd = -1;
+        int ret = -1;
+        int r;
+
+        memset(stats, 0, sizeof(stats));
+        stats[OP_LOAD].name = "load";
+        stats[OP_SEEK].name = "seek";
+        stats[OP_SWAP].name = "swap";
+        stats[OP_CRC].name = "crc";
+        stats[OP_COMMIT].name = "commit";
+        for (i = 0; i < ARRAY_SIZE(ptn_swap_list); i++) {
+                names.push_back(ptn_swap_list[i]);
+                names.push_back(string(ptn_swap_list[i]) + BAK_PTN_NAME_EXT);
+        }
+
+        image_fd = open(path, O_RDWR | O_CLOEXEC);
+        if (image_fd < 0) {
+                fprintf(stderr, "%s: Failed to open %s: %s\n",
+                                __func__, path, strerror(errno));
+                goto EXIT;
+        }
+        block_size = gpt_image_probe_block_size(image_fd);
+        if (!block_size) {
+                fprintf(stderr, "%s: No GPT found on %s\n", __func__, path);
+                goto EXIT;
+        }
+        loop_fd = gpt_image_loop_attach(image_fd, block_size, dev_path,
+                        sizeof(dev_path));
+        if (loop_fd < 0)
+                goto EXIT;
+
+        for (i = 0; i < iterations; i++) {
+                disk = gpt_disk_alloc();
+                if (!disk)
+                        goto EXIT;
+                BENCH_OP(stats[OP_LOAD], gpt_disk_open(dev_path, disk));
+                if (r) {
+                        fprintf(stderr, "%s: Failed to load %s\n", __func__, path);
+                        goto EXIT;
+                }
+                BENCH_OP(stats[OP_SEEK], seek_all(disk, names));
+                if (r) {
+                        fprintf(stderr, "%s: No partitions found on %s\n",
+                                        __func__, path);
+                        goto EXIT;
+                }
+                //A LUN without backups makes this return 1 and leaves the
+                //disk alone, same as during an update
+                BENCH_OP(stats[OP_SWAP], gpt2_set_boot_chain(disk, BACKUP_BOOT));
+                if (r < 0)
+                        goto EXIT;
+                BENCH_OP(stats[OP_CRC], gpt_disk_update_crc(disk));
+                if (r)
+                        goto EXIT;
+                BENCH_OP(stats[OP_COMMIT], gpt_disk_commit(disk));
+                if (r)
+                        goto EXIT;
+                //Put the backup GPT back the way it was
+                if (gpt2_set_boot_chain(disk, NORMAL_BOOT) < 0 ||
+                                gpt_disk_commit(disk)) {
+                        fprintf(stderr, "%s: Failed to restore %s\n",
+                                        __func__, path);
+                        goto EXIT;
+                }
+                gpt_disk_free(disk);
+                disk = NULL;
+        }
+
+        printf("%s (%s, %u byte blocks), %u iterations\n",
+                        path, dev_path, block_size, iterations);
+        printf("  %-8s %10s %10s %10s %8s %8s %8s\n",
+                        "op", "mean us", "min us", "max us",
+                        "reads", "writes", "fsyncs");
+        for (i = 0; i < OP_COUNT; i++) {
+                struct op_stats *s = &stats[i];
+                if (!s->runs)
+                        continue;
+                printf("  %-8s %10.1f %10.1f %10.1f %8.1f %8.1f %8.1f\n",
+                                s->name,
+                                s->total_ns / 1000.0 / s->runs,
+                                s->min_ns / 1000.0,
+                                s->max_ns / 1000.0,
+                                (double)s->io.syscr / s->runs,
+                                (double)s->io.syscw / s->runs,
+                                (double)s->io.fsyncs / s->runs);
+        }
+        ret = 0;
+EXIT:
+        if (disk)
+                gpt_disk_free(disk);
+        if (loop_fd >= 0)
+                gpt_image_loop_detach(loop_fd);
+        if (image_fd >= 0)
+                close(image_fd);
+        return ret;
+}
+
+static int bench_images(const char *dir, uint32_t iterations)
+{
+        vector<string> images;
+        struct dirent *de;
+        DIR *d = opendir(dir);
+        int ret = 0;
+
+        if (!d) {
+                fprintf(stderr, "%s: Failed to open %s: %s\n",
+                                __func__, dir, strerror(errno));
+                return -1;
+        }
+        while ((de = readdir(d))) {
+                size_t len = strlen(de->d_name);
+                if (!strncmp(de->d_name, "lun", 3) && len > 4 &&
+                                !strcmp(&de->d_name[len - 4], ".img"))
+                        images.push_back(string(dir) + "/" + de->d_name);
+        }
+        closedir(d);
+        if (images.empty()) {
+                fprintf(stderr, "%s: No lun*.img images in %s\n", __func__, dir);
+                return -1;
+        }
+        sort(images.begin(), images.end());
+        for (const string &image : images) {
+                if (bench_image(image.c_str(), iterations))
+                        ret = -1;
+        }
+        return ret;
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "Usage: %s create <dir> [-l luns] [-e entries] [-b block size]\n"
+                "       %s bench <dir> [-n iterations]\n",
+                prog, prog);
+}
+
+int main(int argc, char **argv)
+{
+        uint32_t luns = DEFAULT_LUNS;
+        uint32_t entries = DEFAULT_ENTRIES;
+        uint32_t block_size = DEFAULT_BLOCK_SIZE;
+        uint32_t iterations = DEFAULT_ITERATIONS;
+        const char *cmd;
+        const char *dir;
+        int opt;
+
+        if (argc < 3) {
+                usage(argv[0]);
+                return 1;
+        }
+        cmd = argv[1];
+        dir = argv[2];
+        optind = 3;
+        while ((opt = getopt(argc, argv, "l:e:b:n:")) != -1) {
+                switch (opt) {
+                case 'l':
+                        luns = strtoul(optarg, NULL, 0);
+                        break;
+                case 'e':
+                        entries = strtoul(optarg, NULL, 0);
+                        break;
+                case 'b':
+                        block_size = strtoul(optarg, NULL, 0);
+                        break;
+                case 'n':
+                        iterations = strtoul(optarg, NULL, 0);
+                        break;
+                default:
+                        usage(argv[0]);
+                        return 1;
+                }
+        }
+        if (!strcmp(cmd, "create")) {
+                if (luns < 1 || luns > 26 || entries < 1 ||
+                                entries > MAX_ENTRIES ||
+                                (block_size != 512 && block_size != 4096)) {
+                        usage(argv[0]);
+                        return 1;
+                }
+                return create_images(dir, luns, entries, block_size) ? 1 : 0;
+        } else if (!strcmp(cmd, "bench")) {
+                if (iterations < 1) {
+                        usage(argv[0]);
+                        return 1;
+                }
+                calibrate_io_counters();
+                return bench_images(dir, iterations) ? 1 : 0;
+        }
+        usage(argv[0]);
+        return 1;
+}
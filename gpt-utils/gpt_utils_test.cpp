@@ -0,0 +1,379 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ *       copyright notice, this list of conditions and the following
+ *       disclaimer in the documentation and/or other materials provided
+ *       with the distribution.
+ *     * Neither the name of The Android Open Source Project nor the names
+ *       of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written
+ *       permission.
+ *
+ * THIS SOFTWARE IS PROVIDED "AS IS" AND ANY EXPRESS OR IMPLIED
+ * WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NON-INFRINGEMENT
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS
+ * BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+ * BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+ * OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+ * IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+//Runs libgptutils against synthetic GPT images on loop devices and checks
+//what it leaves on them against a reference built with zlib. The library
+//sources are built into the test with BOOT_DEV_DIR pointing nowhere, so
+//prepare_partitions never finds the xbl LUNs of the device it runs on and
+//never switches its boot LUN.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include <zlib.h>
+#include "gpt-utils.h"
+#include "gpt-crc32.h"
+#include "gpt_image.h"
+
+using namespace std;
+
+#define TEST_ENTRIES                128
+#define TEST_HEADER_SIZE            92
+
+//Contents of the image backing the loop device after every fsync the
+//library issued on it, i.e. each state a crash could leave behind.
+//Android.bp links the test with --wrap=fsync.
+static int snapshot_fd = -1;
+static vector<vector<uint8_t>> barriers;
+
+static vector<uint8_t> read_image(int fd)
+{
+        struct stat st;
+        vector<uint8_t> img;
+        if (fstat(fd, &st))
+                return img;
+        img.resize(st.st_size);
+        if (pread(fd, img.data(), img.size(), 0) != (ssize_t)img.size())
+                img.clear();
+        return img;
+}
+
+extern "C" int __real_fsync(int fd);
+extern "C" int __wrap_fsync(int fd)
+{
+        int r = __real_fsync(fd);
+        if (!r && snapshot_fd >= 0)
+                barriers.push_back(read_image(snapshot_fd));
+        return r;
+}
+
+static uint64_t get_le(const uint8_t *ptr, size_t len)
+{
+        uint64_t val = 0;
+        while (len--)
+                val = val << 8 | ptr[len];
+        return val;
+}
+
+static void put_le(uint8_t *ptr, uint64_t val, size_t len)
+{
+        size_t i;
+        for (i = 0; i < len; i++)
+                ptr[i] = (val >> (8 * i)) & 0xff;
+}
+
+static uint32_t zlib_crc(const uint8_t *buf, size_t len)
+{
+        return crc32(0, buf, len);
+}
+
+//Reference model of the two GPTs of an image
+class GptModel {
+public:
+        GptModel(const vector<uint8_t> &img, uint32_t block_size)
+                : img(img), block_size(block_size)
+        {
+                hdr_off = block_size;
+                hdr_bak_off = img.size() - block_size;
+                arr_bak_off = get_le(&img[hdr_bak_off + PENTRIES_OFFSET], 8) *
+                        block_size;
+                arr_size = get_le(&img[hdr_off + PARTITION_COUNT_OFFSET], 4) *
+                        PTN_ENTRY_SIZE;
+        }
+
+        //Mark a header bad the way a boot update does, or good again
+        void set_signature(enum gpt_instance gpt, bool ok)
+        {
+                size_t off = gpt == PRIMARY_GPT ? hdr_off : hdr_bak_off;
+                if (ok)
+                        memcpy(&img[off], GPT_SIGNATURE, strlen(GPT_SIGNATURE));
+                else
+                        img[off] = 0;
+                reseal(off);
+        }
+
+        //Swap entries i and j of the backup array
+        void swap_bak(uint32_t i, uint32_t j)
+        {
+                uint8_t *a = &img[arr_bak_off + i * PTN_ENTRY_SIZE];
+                uint8_t *b = &img[arr_bak_off + j * PTN_ENTRY_SIZE];
+                uint8_t tmp[PTN_ENTRY_SIZE];
+                memcpy(tmp, a, PTN_ENTRY_SIZE);
+                memcpy(a, b, PTN_ENTRY_SIZE);
+                memcpy(b, tmp, PTN_ENTRY_SIZE);
+                put_le(&img[hdr_bak_off + PARTITION_CRC_OFFSET],
+                                zlib_crc(&img[arr_bak_off], arr_size), 4);
+                reseal(hdr_bak_off);
+        }
+
+        vector<uint8_t> img;
+
+private:
+        void reseal(size_t off)
+        {
+                put_le(&img[off + HEADER_CRC_OFFSET], 0, 4);
+                put_le(&img[off + HEADER_CRC_OFFSET],
+                                zlib_crc(&img[off], TEST_HEADER_SIZE), 4);
+        }
+
+        uint32_t block_size;
+        size_t hdr_off;
+        size_t hdr_bak_off;
+        size_t arr_bak_off;
+        size_t arr_size;
+};
+
+//Deterministic test data
+static vector<uint8_t> pattern(size_t len, uint32_t seed)
+{
+        vector<uint8_t> buf(len);
+        uint32_t x = seed;
+        for (size_t i = 0; i < len; i++) {
+                x = x * 1103515245u + 12345u;
+                buf[i] = x >> 24;
+        }
+        return buf;
+}
+
+TEST(GptCrc32Test, MatchesZlib)
+{
+        const size_t lens[] = { 0, 1, 2, 3, 4, 7, 8, 9, 15, 16, 17, 31, 63,
+                64, 65, TEST_HEADER_SIZE, 127, 128, 129, 1000, 4095, 4096,
+                16384, 65536 };
+        vector<uint8_t> buf = pattern(65536 + 8, 1);
+        size_t i, off;
+
+        for (i = 0; i < ARRAY_SIZE(lens); i++) {
+                //Every alignment of the start of the data
+                for (off = 0; off < 8; off++) {
+                        EXPECT_EQ(zlib_crc(&buf[off], lens[i]),
+                                        gpt_crc32(0, &buf[off], lens[i]))
+                                << "len " << lens[i] << " offset " << off;
+                }
+                //Continuing over the data in two parts
+                off = lens[i] / 3;
+                EXPECT_EQ(zlib_crc(buf.data(), lens[i]),
+                                gpt_crc32(gpt_crc32(0, buf.data(), off),
+                                        &buf[off], lens[i] - off))
+                        << "len " << lens[i] << " split at " << off;
+        }
+}
+
+TEST(GptCrc32Test, ApplyDeltaMatchesZlib)
+{
+        const size_t arr_size = TEST_ENTRIES * PTN_ENTRY_SIZE;
+        //Changed byte ranges as [start, start + len)
+        const size_t changes[][2] = {
+                { 0, 1 },
+                { 0, PTN_ENTRY_SIZE },
+                { 55, 1 },
+                { 5 * PTN_ENTRY_SIZE, PTN_ENTRY_SIZE },
+                { 5 * PTN_ENTRY_SIZE + 55, 1 },
+                { arr_size - PTN_ENTRY_SIZE, PTN_ENTRY_SIZE },
+                { arr_size - 1, 1 },
+                { 100, 3000 },
+        };
+        size_t i, j;
+
+        for (i = 0; i < ARRAY_SIZE(changes); i++) {
+                size_t start = changes[i][0];
+                size_t len = changes[i][1];
+                vector<uint8_t> buf = pattern(arr_size, 2);
+                vector<uint8_t> delta = pattern(len, 3 + i);
+                uint32_t crc = gpt_crc32(0, buf.data(), buf.size());
+
+                for (j = 0; j < len; j++)
+                        buf[start + j] ^= delta[j];
+                EXPECT_EQ(zlib_crc(buf.data(), buf.size()),
+                                gpt_crc32_apply_delta(crc, delta.data(), len,
+                                        arr_size - start - len))
+                        << "change of " << len << " bytes at " << start;
+        }
+}
+
+class GptImageTest : public ::testing::TestWithParam<uint32_t> {
+protected:
+        void SetUp() override
+        {
+                const char ptn_swap_list[][MAX_GPT_NAME_SIZE] = { PTN_SWAP_LIST };
+                const char *tmp = getenv("TMPDIR");
+                uint32_t i;
+                int fd;
+
+                if (access("/dev/loop-control", R_OK | W_OK))
+                        GTEST_SKIP() << "Loop devices are not available";
+                block_size = GetParam();
+                for (i = 0; i < ARRAY_SIZE(ptn_swap_list); i++) {
+                        names.push_back(ptn_swap_list[i]);
+                        names.push_back(string(ptn_swap_list[i]) +
+                                        BAK_PTN_NAME_EXT);
+                }
+                names.push_back("boot" AB_SLOT_A_SUFFIX);
+                names.push_back("boot" AB_SLOT_B_SUFFIX);
+
+                if (!tmp)
+                        tmp = access("/data/local/tmp", W_OK) ?
+                                "/tmp" : "/data/local/tmp";
+                path = string(tmp) + "/gpt_utils_test.XXXXXX";
+                fd = mkstemp(&path[0]);
+                ASSERT_GE(fd, 0);
+                close(fd);
+                ASSERT_EQ(0, gpt_image_write(path.c_str(), names,
+                                        TEST_ENTRIES, block_size));
+                image_fd = open(path.c_str(), O_RDWR | O_CLOEXEC);
+                ASSERT_GE(image_fd, 0);
+                loop_fd = gpt_image_loop_attach(image_fd, block_size,
+                                dev_path, sizeof(dev_path));
+                ASSERT_GE(loop_fd, 0);
+                orig = read_image(image_fd);
+                ASSERT_FALSE(orig.empty());
+        }
+
+        void TearDown() override
+        {
+                snapshot_fd = -1;
+                barriers.clear();
+                if (loop_fd >= 0)
+                        gpt_image_loop_detach(loop_fd);
+                if (image_fd >= 0)
+                        close(image_fd);
+                if (!path.empty())
+                        unlink(path.c_str());
+        }
+
+        //Run one stage of a boot update and return the image contents at
+        //each fsync it issued
+        vector<vector<uint8_t>> run_stage(enum boot_update_stage stage)
+        {
+                vector<vector<uint8_t>> r;
+                barriers.clear();
+                snapshot_fd = image_fd;
+                EXPECT_EQ(0, prepare_partitions(stage, dev_path))
+                        << "stage " << stage;
+                snapshot_fd = -1;
+                r.swap(barriers);
+                return r;
+        }
+
+        uint32_t block_size = 0;
+        vector<string> names;
+        string path;
+        char dev_path[PATH_MAX] = {0};
+        int image_fd = -1;
+        int loop_fd = -1;
+        vector<uint8_t> orig;
+};
+
+//Each stage of a boot update must leave the disk in a state the
+//bootloader can boot from at every fsync: the backup GPT points at the
+//backup boot chain before the primary one is given up, and the primary
+//GPT is good again before the backup one is.
+TEST_P(GptImageTest, UpdateStages)
+{
+        const char ptn_swap_list[][MAX_GPT_NAME_SIZE] = { PTN_SWAP_LIST };
+        GptModel model(orig, block_size);
+        vector<vector<uint8_t>> expected;
+        vector<vector<uint8_t>> got;
+        uint32_t i;
+
+        //The images hold every partition right before its backup twin.
+        //On UFS the xbl partitions are switched through the boot LUN
+        //instead.
+        for (i = 0; i < ARRAY_SIZE(ptn_swap_list); i++) {
+                if (gpt_utils_is_ufs_device() &&
+                                !strncmp(ptn_swap_list[i], PTN_XBL,
+                                        strlen(PTN_XBL)))
+                        continue;
+                model.swap_bak(2 * i, 2 * i + 1);
+        }
+        expected.push_back(model.img);
+        model.set_signature(PRIMARY_GPT, false);
+        expected.push_back(model.img);
+        got = run_stage(UPDATE_MAIN);
+        ASSERT_EQ(2u, got.size());
+        EXPECT_TRUE(expected == got) << "UPDATE_MAIN";
+
+        expected.clear();
+        model.set_signature(PRIMARY_GPT, true);
+        expected.push_back(model.img);
+        model.set_signature(SECONDARY_GPT, false);
+        expected.push_back(model.img);
+        got = run_stage(UPDATE_BACKUP);
+        ASSERT_EQ(2u, got.size());
+        EXPECT_TRUE(expected == got) << "UPDATE_BACKUP";
+
+        //Finalizing puts the disk back exactly as it was
+        got = run_stage(UPDATE_FINALIZE);
+        ASSERT_EQ(1u, got.size());
+        EXPECT_TRUE(orig == got[0]) << "UPDATE_FINALIZE";
+}
+
+//Lookups through the backup GPT follow the entries moved by a boot chain
+//switch
+TEST_P(GptImageTest, LookupsAfterBootChainSwitch)
+{
+        struct gpt_disk *disk = gpt_disk_alloc();
+        uint8_t *pentry_a = NULL;
+        uint8_t *pentry_b = NULL;
+        uint8_t *pentry;
+        char name[MAX_GPT_NAME_SIZE / 2 + 1];
+
+        ASSERT_NE(nullptr, disk);
+        ASSERT_EQ(0, gpt_disk_open(dev_path, disk));
+        ASSERT_EQ(0, gpt2_set_boot_chain(disk, BACKUP_BOOT));
+        pentry = gpt_disk_get_pentry(disk, "tz", SECONDARY_GPT);
+        ASSERT_NE(nullptr, pentry);
+        gpt_pentry_get_name(pentry, name);
+        EXPECT_STREQ("tz" BAK_PTN_NAME_EXT, name);
+        pentry = gpt_disk_get_pentry(disk, "tz", PRIMARY_GPT);
+        ASSERT_NE(nullptr, pentry);
+        gpt_pentry_get_name(pentry, name);
+        EXPECT_STREQ("tz", name);
+
+        ASSERT_EQ(0, gpt_disk_get_slot_pentries(disk, "boot", SECONDARY_GPT,
+                                &pentry_a, &pentry_b));
+        EXPECT_EQ(gpt_disk_get_pentry(disk, "boot" AB_SLOT_A_SUFFIX,
+                                SECONDARY_GPT), pentry_a);
+        EXPECT_EQ(gpt_disk_get_pentry(disk, "boot" AB_SLOT_B_SUFFIX,
+                                SECONDARY_GPT), pentry_b);
+        EXPECT_NE(0, gpt_disk_get_slot_pentries(disk, "tz", SECONDARY_GPT,
+                                &pentry_a, &pentry_b));
+        gpt_disk_free(disk);
+}
+
+INSTANTIATE_TEST_SUITE_P(BlockSizes, GptImageTest,
+                ::testing::Values(512u, 4096u));
@@ -0,0 +1,60 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "libpixelpowerstats"
+
+#include "CachedStateResidencyDataProvider.h"
+
+#include <utility>
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+CachedStateResidencyDataProvider::CachedStateResidencyDataProvider(
+        uint32_t id, const std::vector<uint32_t> &stateIds, std::chrono::milliseconds freshness)
+    : mPowerEntityId(id), mFreshness(freshness), mValid(false) {
+    mResult.powerEntityId = id;
+    mResult.stateResidencyData.resize(stateIds.size());
+    for (size_t i = 0; i < stateIds.size(); i++) {
+        mResult.stateResidencyData[i] = {.powerEntityStateId = stateIds[i],
+                                         .totalTimeInStateMs = 0,
+                                         .totalStateEntryCount = 0,
+                                         .lastEntryTimestampMs = 0};
+    }
+}
+
+bool CachedStateResidencyDataProvider::getResults(
+        std::unordered_map<uint32_t, PowerEntityStateResidencyResult> &results) {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto now = std::chrono::steady_clock::now();
+    if (!mValid || now - mLastRefresh >= mFreshness) {
+        mValid = refresh(mResult.stateResidencyData);
+        if (!mValid) {
+            return false;
+        }
+        mLastRefresh = now;
+    }
+    results.insert(std::make_pair(mPowerEntityId, mResult));
+    return true;
+}
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
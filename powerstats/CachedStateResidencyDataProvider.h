@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HARDWARE_GOOGLE_PIXEL_POWERSTATS_CACHEDSTATERESIDENCYDATAPROVIDER_H
+#define HARDWARE_GOOGLE_PIXEL_POWERSTATS_CACHEDSTATERESIDENCYDATAPROVIDER_H
+
+#include <pixelpowerstats/PowerStats.h>
+
+#include <chrono>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+/**
+ * Base for providers of a single power entity whose counters are expensive to
+ * fetch. The result is laid out once and only its counters are refreshed, and
+ * at most once per freshness window; calls within the window are served from
+ * the cached result. A zero window refreshes on every call.
+ **/
+class CachedStateResidencyDataProvider : public IStateResidencyDataProvider {
+  public:
+    bool getResults(
+            std::unordered_map<uint32_t, PowerEntityStateResidencyResult> &results) final;
+
+  protected:
+    CachedStateResidencyDataProvider(uint32_t id, const std::vector<uint32_t> &stateIds,
+                                     std::chrono::milliseconds freshness);
+    ~CachedStateResidencyDataProvider() = default;
+
+    // Updates the counters of stateResidencyData, which holds one entry per
+    // state id passed to the constructor, in that order. A provider that
+    // discovers its states on first read may resize it, setting the state
+    // id of each new entry.
+    virtual bool refresh(hidl_vec<PowerEntityStateResidencyData> &stateResidencyData) = 0;
+
+    const uint32_t mPowerEntityId;
+
+  private:
+    const std::chrono::milliseconds mFreshness;
+    std::mutex mLock;
+    PowerEntityStateResidencyResult mResult;
+    bool mValid;
+    std::chrono::steady_clock::time_point mLastRefresh;
+};
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
+
+#endif  // HARDWARE_GOOGLE_PIXEL_POWERSTATS_CACHEDSTATERESIDENCYDATAPROVIDER_H
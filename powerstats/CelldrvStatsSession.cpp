@@ -0,0 +1,140 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "libpixelpowerstats"
+
+#include "CelldrvStatsSession.h"
+
+#include <android-base/logging.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+CelldrvStatsSession::CelldrvStatsSession()
+    : mPath("/dev/iaxxx-module-celldrv"),
+      mQuery(1),
+      mWantPowerStats(false),
+      mWantSensorModeStats(false),
+      mPowerStatsQuery(0),
+      mSensorModeStatsQuery(0),
+      mPowerStatsValid(false),
+      mSensorModeStatsValid(false) {}
+
+void CelldrvStatsSession::beginQuery(bool powerStats, bool sensorModeStats) {
+    std::lock_guard<std::mutex> lock(mLock);
+    mQuery++;
+    mWantPowerStats = powerStats;
+    mWantSensorModeStats = sensorModeStats;
+}
+
+bool CelldrvStatsSession::openLocked() {
+    if (mDevNode >= 0) {
+        return true;
+    }
+    mDevNode.reset(TEMP_FAILURE_RETRY(open(mPath.c_str(), O_RDWR | O_CLOEXEC)));
+    if (mDevNode < 0) {
+        PLOG(ERROR) << __func__ << ":Failed to open file " << mPath;
+        return false;
+    }
+    return true;
+}
+
+void CelldrvStatsSession::ioctlFailedLocked(const char *request) {
+    int err = errno;
+    PLOG(ERROR) << request << " IOCTL failed on " << mPath;
+    // Only a reloaded driver needs the node reopened; other errors are
+    // retried on the same fd by the next query
+    if (err == ENODEV || err == ENXIO) {
+        mDevNode.reset();
+    }
+}
+
+void CelldrvStatsSession::fetchLocked(bool powerStats, bool sensorModeStats) {
+    if (powerStats) {
+        mPowerStatsQuery = mQuery;
+        mPowerStatsValid = false;
+    }
+    if (sensorModeStats) {
+        mSensorModeStatsQuery = mQuery;
+        mSensorModeStatsValid = false;
+    }
+    if (!openLocked()) {
+        return;
+    }
+
+    if (powerStats) {
+        if (ioctl(mDevNode.get(), IAXXX_POWER_STATS_COUNT, &mPowerStats) != 0) {
+            ioctlFailedLocked("IAXXX_POWER_STATS_COUNT");
+        } else {
+            mPowerStatsValid = true;
+        }
+    }
+
+    if (sensorModeStats && mDevNode >= 0) {
+        struct iaxxx_sensor_param sp = {
+            .inst_id = 0,
+            .param_id = SENSOR_PARAM_DUMP_STATS,
+            .param_val = 1,
+            .block_id = 0,
+        };
+
+        if (ioctl(mDevNode.get(), MODULE_SENSOR_SET_PARAM, (unsigned long)&sp) != 0) {
+            ioctlFailedLocked("MODULE_SENSOR_SET_PARAM");
+        } else if (ioctl(mDevNode.get(), IAXXX_SENSOR_MODE_STATS,
+                         (unsigned long)mSensorModeStats) != 0) {
+            ioctlFailedLocked("IAXXX_SENSOR_MODE_STATS");
+        } else {
+            mSensorModeStatsValid = true;
+        }
+    }
+}
+
+bool CelldrvStatsSession::getPowerStats(struct iaxxx_pwr_stats *stats) {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mPowerStatsQuery != mQuery) {
+        fetchLocked(true, mWantSensorModeStats && mSensorModeStatsQuery != mQuery);
+    }
+    if (!mPowerStatsValid) {
+        return false;
+    }
+    *stats = mPowerStats;
+    return true;
+}
+
+bool CelldrvStatsSession::getSensorModeStats(
+        struct iaxxx_sensor_mode_stats (&stats)[SENSOR_NUM_MODE]) {
+    std::lock_guard<std::mutex> lock(mLock);
+    if (mSensorModeStatsQuery != mQuery) {
+        fetchLocked(mWantPowerStats && mPowerStatsQuery != mQuery, true);
+    }
+    if (!mSensorModeStatsValid) {
+        return false;
+    }
+    memcpy(stats, mSensorModeStats, sizeof(mSensorModeStats));
+    return true;
+}
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,79 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HARDWARE_GOOGLE_PIXEL_POWERSTATS_CELLDRVSTATSSESSION_H
+#define HARDWARE_GOOGLE_PIXEL_POWERSTATS_CELLDRVSTATSSESSION_H
+
+#include <android-base/unique_fd.h>
+
+#include <mutex>
+#include <string>
+
+#include <linux/mfd/adnc/iaxxx-module.h>
+#include "tests/oslo_iaxxx_sensor_control.h"
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+/**
+ * Owns the one /dev/iaxxx-module-celldrv fd shared by the IAXXX and Oslo
+ * providers. Stats are fetched at most once per stats query: the first
+ * request of a query collects every part that query asked for in a single
+ * pass, so that a query for both entities wakes the DSP once rather than
+ * once per provider, and the sensor mode dump is only requested from the
+ * DSP when the query includes Oslo.
+ **/
+class CelldrvStatsSession {
+  public:
+    CelldrvStatsSession();
+    ~CelldrvStatsSession() = default;
+    // Must be called at the start of every stats query with the parts it
+    // asked for
+    void beginQuery(bool powerStats, bool sensorModeStats);
+    bool getPowerStats(struct iaxxx_pwr_stats *stats);
+    bool getSensorModeStats(struct iaxxx_sensor_mode_stats (&stats)[SENSOR_NUM_MODE]);
+
+  private:
+    void fetchLocked(bool powerStats, bool sensorModeStats);
+    bool openLocked();
+    void ioctlFailedLocked(const char *request);
+
+    const std::string mPath;
+    std::mutex mLock;
+    // Opened on first use and kept until the driver reports it gone
+    android::base::unique_fd mDevNode;
+    // Bumped by beginQuery; a part is fetched again once the query it was
+    // fetched for is over
+    uint64_t mQuery;
+    bool mWantPowerStats;
+    bool mWantSensorModeStats;
+    uint64_t mPowerStatsQuery;
+    uint64_t mSensorModeStatsQuery;
+    bool mPowerStatsValid;
+    struct iaxxx_pwr_stats mPowerStats;
+    bool mSensorModeStatsValid;
+    struct iaxxx_sensor_mode_stats mSensorModeStats[SENSOR_NUM_MODE];
+};
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
+
+#endif  // HARDWARE_GOOGLE_PIXEL_POWERSTATS_CELLDRVSTATSSESSION_H
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HARDWARE_GOOGLE_PIXEL_POWERSTATS_ENERGYTRACEFORMAT_H
+#define HARDWARE_GOOGLE_PIXEL_POWERSTATS_ENERGYTRACEFORMAT_H
+
+#include <stdint.h>
+
+/**
+ * On-disk layout of the rail energy trace written by EnergyTraceRecorder.
+ * Shared with the host-side energy_trace_dump tool, so it only depends on
+ * fixed-width types. All fields are little-endian.
+ *
+ * The file is an EnergyTraceHeader, followed by numRails rail names of
+ * kEnergyTraceNameLen bytes each, followed at dataOffset by a ring of
+ * capacity records of recordSize bytes. Record n is stored in slot
+ * n % capacity, and count is only advanced once a record is complete.
+ * Sample times are CLOCK_BOOTTIME, so a trace only ever covers the boot
+ * named by bootId.
+ **/
+
+#define ENERGY_TRACE_MAGIC "PWRTRACE"
+#define ENERGY_TRACE_VERSION 2
+
+constexpr uint32_t kEnergyTraceNameLen = 64;
+constexpr uint32_t kEnergyTraceBootIdLen = 40;
+
+struct EnergyTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t numRails;
+    uint32_t capacity;
+    uint32_t recordSize;
+    uint64_t dataOffset;
+    // Records ever written
+    uint64_t count;
+    // /proc/sys/kernel/random/boot_id of the boot that wrote the records,
+    // NUL padded
+    char bootId[kEnergyTraceBootIdLen];
+};
+
+// Same layout as power.stats@1.0 EnergyData
+struct EnergyTraceRail {
+    uint32_t index;
+    uint32_t reserved;
+    uint64_t timestamp;
+    uint64_t energy;
+};
+
+// A record is the CLOCK_BOOTTIME in ms at which the sample was taken,
+// followed by one EnergyTraceRail per rail
+inline uint32_t energyTraceRecordSize(uint32_t numRails) {
+    return sizeof(uint64_t) + numRails * sizeof(EnergyTraceRail);
+}
+
+#endif  // HARDWARE_GOOGLE_PIXEL_POWERSTATS_ENERGYTRACEFORMAT_H
@@ -0,0 +1,153 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "libpixelpowerstats"
+
+#include "EnergyTraceRecorder.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/strings.h>
+#include <android-base/unique_fd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include <algorithm>
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+static_assert(sizeof(EnergyTraceRail) == sizeof(EnergyData),
+              "EnergyTraceRail must match the EnergyData layout");
+
+EnergyTraceRecorder::~EnergyTraceRecorder() {
+    if (mMap != nullptr) {
+        munmap(mMap, mMapSize);
+    }
+}
+
+constexpr char kBootIdPath[] = "/proc/sys/kernel/random/boot_id";
+
+bool EnergyTraceRecorder::isCompatible(const std::vector<std::string> &railNames,
+                                       uint32_t capacity, const std::string &bootId) const {
+    if (memcmp(mHeader->magic, ENERGY_TRACE_MAGIC, sizeof(mHeader->magic)) != 0 ||
+        mHeader->version != ENERGY_TRACE_VERSION || mHeader->numRails != railNames.size() ||
+        mHeader->capacity != capacity) {
+        return false;
+    }
+    // Sample times from an earlier boot are on another CLOCK_BOOTTIME
+    // timeline, so a trace is never continued across a reboot
+    if (bootId.empty() ||
+        strncmp(mHeader->bootId, bootId.c_str(), sizeof(mHeader->bootId)) != 0) {
+        return false;
+    }
+    const char *names = reinterpret_cast<const char *>(mHeader + 1);
+    for (size_t i = 0; i < railNames.size(); i++) {
+        if (strncmp(names + i * kEnergyTraceNameLen, railNames[i].c_str(),
+                    kEnergyTraceNameLen) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool EnergyTraceRecorder::open(const std::string &path, const std::vector<std::string> &railNames,
+                               uint32_t capacity) {
+    if (mMap != nullptr || railNames.empty() || capacity == 0) {
+        return false;
+    }
+    std::string bootId;
+    if (!android::base::ReadFileToString(kBootIdPath, &bootId)) {
+        PLOG(WARNING) << __func__ << ":Failed to read " << kBootIdPath;
+    }
+    bootId = android::base::Trim(bootId);
+
+    mNumRails = railNames.size();
+    uint32_t recordSize = energyTraceRecordSize(mNumRails);
+    uint64_t dataOffset = sizeof(EnergyTraceHeader) + mNumRails * kEnergyTraceNameLen;
+    mMapSize = dataOffset + static_cast<uint64_t>(capacity) * recordSize;
+
+    android::base::unique_fd fd(
+            TEMP_FAILURE_RETRY(::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0640)));
+    if (fd < 0) {
+        PLOG(ERROR) << __func__ << ":Failed to open file " << path;
+        return false;
+    }
+    // Reserve the blocks up front so appends never fail for lack of space
+    int err = posix_fallocate(fd.get(), 0, mMapSize);
+    if (err != 0) {
+        LOG(ERROR) << __func__ << ":Failed to allocate " << mMapSize << " bytes for " << path
+                   << ": " << strerror(err);
+        return false;
+    }
+    void *map = mmap(nullptr, mMapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd.get(), 0);
+    if (map == MAP_FAILED) {
+        PLOG(ERROR) << __func__ << ":Failed to map " << path;
+        return false;
+    }
+    mMap = static_cast<uint8_t *>(map);
+    mHeader = reinterpret_cast<EnergyTraceHeader *>(mMap);
+
+    if (isCompatible(railNames, capacity, bootId)) {
+        LOG(INFO) << "Appending to energy trace " << path << " after " << mHeader->count
+                  << " records";
+        return true;
+    }
+
+    memset(mMap, 0, dataOffset);
+    char *names = reinterpret_cast<char *>(mHeader + 1);
+    for (size_t i = 0; i < railNames.size(); i++) {
+        strncpy(names + i * kEnergyTraceNameLen, railNames[i].c_str(), kEnergyTraceNameLen - 1);
+    }
+    memcpy(mHeader->magic, ENERGY_TRACE_MAGIC, sizeof(mHeader->magic));
+    mHeader->version = ENERGY_TRACE_VERSION;
+    mHeader->numRails = mNumRails;
+    mHeader->capacity = capacity;
+    mHeader->recordSize = recordSize;
+    mHeader->dataOffset = dataOffset;
+    mHeader->count = 0;
+    strncpy(mHeader->bootId, bootId.c_str(), sizeof(mHeader->bootId) - 1);
+    LOG(INFO) << "Recording energy trace to " << path << ", " << capacity << " records";
+    return true;
+}
+
+void EnergyTraceRecorder::append(const std::vector<EnergyData> &sample) {
+    if (mMap == nullptr) {
+        return;
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    uint64_t sampleTimeMs = now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+
+    uint64_t count = mHeader->count;
+    uint8_t *record = mMap + mHeader->dataOffset + (count % mHeader->capacity) * mHeader->recordSize;
+    memcpy(record, &sampleTimeMs, sizeof(sampleTimeMs));
+    memcpy(record + sizeof(sampleTimeMs), sample.data(),
+           std::min<size_t>(sample.size(), mNumRails) * sizeof(EnergyTraceRail));
+    // Publish the record only once it is complete
+    __atomic_store_n(&mHeader->count, count + 1, __ATOMIC_RELEASE);
+}
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,67 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HARDWARE_GOOGLE_PIXEL_POWERSTATS_ENERGYTRACERECORDER_H
+#define HARDWARE_GOOGLE_PIXEL_POWERSTATS_ENERGYTRACERECORDER_H
+
+#include <pixelpowerstats/PowerStats.h>
+
+#include <string>
+#include <vector>
+
+#include "EnergyTraceFormat.h"
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+/**
+ * Appends rail energy samples to a preallocated, memory-mapped ring file
+ * (see EnergyTraceFormat.h), so long captures need neither a binder client
+ * nor unbounded memory. An existing trace written earlier in the same boot
+ * with the same rails and capacity is appended to rather than truncated.
+ *
+ * The trace directory needs a vendor sepolicy label and write access for
+ * hal_power_stats_default; see /data/vendor/powerstats in init.hardware.rc.
+ **/
+class EnergyTraceRecorder {
+  public:
+    EnergyTraceRecorder() = default;
+    ~EnergyTraceRecorder();
+    // railNames is indexed by EnergyData::index
+    bool open(const std::string &path, const std::vector<std::string> &railNames,
+              uint32_t capacity);
+    // Not thread safe; called by the sampler only
+    void append(const std::vector<EnergyData> &sample);
+
+  private:
+    bool isCompatible(const std::vector<std::string> &railNames, uint32_t capacity,
+                      const std::string &bootId) const;
+
+    uint8_t *mMap = nullptr;
+    size_t mMapSize = 0;
+    EnergyTraceHeader *mHeader = nullptr;
+    uint32_t mNumRails = 0;
+};
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
+
+#endif  // HARDWARE_GOOGLE_PIXEL_POWERSTATS_ENERGYTRACERECORDER_H
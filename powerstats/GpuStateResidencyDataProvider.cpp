@@ -17,10 +17,16 @@
 
 #include "GpuStateResidencyDataProvider.h"
 
+#include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <unistd.h>
 
-#include <fstream>
 #include <sstream>
+#include <utility>
 
 namespace android {
 namespace hardware {
@@ -28,69 +34,153 @@ namespace google {
 namespace pixel {
 namespace powerstats {
 
-GpuStateResidencyDataProvider::GpuStateResidencyDataProvider(uint32_t id)
-    : mPowerEntityId(id), mActiveId(0) /* (TODO (b/117228832): enable this) , mSuspendId(1) */ {}
+#define GPU_CLOCK_STATS_PATH "/sys/class/kgsl/kgsl-3d0/gpu_clock_stats"
+#define GPU_FREQUENCIES_PATH "/sys/class/kgsl/kgsl-3d0/gpu_available_frequencies"
+#define GPU_SUSPEND_TIME_PATH "/sys/class/kgsl/kgsl-3d0/devfreq/suspend_time"
+// Large enough for one line of per power level times
+#define CLOCK_STATS_BUF_LEN 256
 
-bool GpuStateResidencyDataProvider::getTotalTime(const std::string &path, uint64_t &totalTimeMs) {
-    std::ifstream inFile(path, std::ifstream::in);
-    if (!inFile.is_open()) {
-        PLOG(ERROR) << __func__ << ":Failed to open file " << path;
-        return false;
+static std::vector<uint64_t> readValues(const char *path) {
+    std::vector<uint64_t> values;
+    std::string content;
+    if (!android::base::ReadFileToString(path, &content)) {
+        PLOG(ERROR) << __func__ << ":Failed to read file " << path;
+        return values;
+    }
+    std::istringstream stream(content);
+    uint64_t value;
+    while (stream >> value) {
+        values.push_back(value);
     }
+    return values;
+}
 
-    std::string line;
-    std::getline(inFile, line);
-    std::istringstream lineStream(line, std::istringstream::in);
+GpuStateResidencyDataProvider::GpuStateResidencyDataProvider(uint32_t id,
+                                                             std::chrono::milliseconds freshness)
+    : CachedStateResidencyDataProvider(id, {}, freshness),
+      mLevelsDiscovered(false),
+      mSuspendSupported(false),
+      mBuf(CLOCK_STATS_BUF_LEN + 1) {}
 
-    totalTimeMs = 0;
-    uint64_t curTimeMs = 0;
-    while (lineStream >> curTimeMs) {
-        totalTimeMs += curTimeMs;
+// Names each power level counted by gpu_clock_stats after its frequency.
+// gpu_available_frequencies may omit the lowest levels, which are numbered.
+void GpuStateResidencyDataProvider::discoverLevels(
+        size_t numLevels, hidl_vec<PowerEntityStateResidencyData> &stateResidencyData) {
+    std::vector<uint64_t> frequencies = readValues(GPU_FREQUENCIES_PATH);
+    std::vector<std::string> names;
+    for (size_t level = 0; level < numLevels; level++) {
+        if (level < frequencies.size()) {
+            names.push_back(
+                    android::base::StringPrintf("%" PRIu64 "MHz", frequencies[level] / 1000000));
+        } else {
+            names.push_back(android::base::StringPrintf("Level%zu", level));
+        }
     }
-    return true;
+    bool suspendSupported = access(GPU_SUSPEND_TIME_PATH, R_OK) == 0;
+
+    stateResidencyData.resize(numLevels + suspendSupported);
+    for (uint32_t stateId = 0; stateId < stateResidencyData.size(); stateId++) {
+        stateResidencyData[stateId] = {.powerEntityStateId = stateId,
+                                       .totalTimeInStateMs = 0,
+                                       .totalStateEntryCount = 0,
+                                       .lastEntryTimestampMs = 0};
+    }
+
+    std::lock_guard<std::mutex> lock(mLevelsLock);
+    mLevelNames = std::move(names);
+    mSuspendSupported = suspendSupported;
+    mLevelsDiscovered = true;
 }
 
-bool GpuStateResidencyDataProvider::getResults(
-    std::unordered_map<uint32_t, PowerEntityStateResidencyResult> &results) {
-    uint64_t totalActiveTimeUs = 0;
-    if (!getTotalTime("/sys/class/kgsl/kgsl-3d0/gpu_clock_stats", totalActiveTimeUs)) {
-        LOG(ERROR) << __func__ << "Failed to get results for GPU:Active";
+bool GpuStateResidencyDataProvider::readNode(const std::string &path,
+                                             android::base::unique_fd &fd) {
+    if (fd < 0) {
+        fd.reset(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+        if (fd < 0) {
+            PLOG(ERROR) << __func__ << ":Failed to open file " << path;
+            return false;
+        }
+    }
+
+    ssize_t len = TEMP_FAILURE_RETRY(pread(fd.get(), mBuf.data(), mBuf.size() - 1, 0));
+    if (len < 0) {
+        PLOG(ERROR) << __func__ << ":Failed to read file " << path;
+        fd.reset();
+        return false;
+    }
+    // A full buffer means the contents were cut short
+    if (static_cast<size_t>(len) >= mBuf.size() - 1) {
+        LOG(ERROR) << __func__ << ":" << path << " does not fit in " << mBuf.size() - 1
+                   << " bytes";
         return false;
     }
+    mBuf[len] = '\0';
+    return true;
+}
 
-    /* (TODO (b/117228832): enable this)
-    uint64_t totalSuspendTimeMs = 0;
-    if (!getTotalTime("/sys/class/kgsl/kgsl-3d0/devfreq/suspend_time", totalSuspendTimeMs)) {
-        LOG(ERROR) << __func__ << "Failed to get results for GPU:Suspend";
+bool GpuStateResidencyDataProvider::refresh(
+        hidl_vec<PowerEntityStateResidencyData> &stateResidencyData) {
+    if (!readNode(GPU_CLOCK_STATS_PATH, mClockStatsFd)) {
+        LOG(ERROR) << __func__ << "Failed to get results for GPU power levels";
         return false;
     }
-    */
-
-    PowerEntityStateResidencyResult result = {
-        .powerEntityId = mPowerEntityId,
-        .stateResidencyData = {
-            {.powerEntityStateId = mActiveId, .totalTimeInStateMs = totalActiveTimeUs / 1000},
-            /* (TODO (b/117228832): enable this)
-            {.powerEntityStateId = mSuspendId, .totalTimeInStateMs = totalSuspendTimeMs},
-            */
-        }};
-
-    results.emplace(std::make_pair(mPowerEntityId, result));
+    // Times are in us, one per power level
+    std::vector<uint64_t> timesUs;
+    const char *pos = mBuf.data();
+    char *end;
+    while (true) {
+        uint64_t timeUs = strtoull(pos, &end, 10);
+        if (end == pos) {
+            break;
+        }
+        timesUs.push_back(timeUs);
+        pos = end;
+    }
+
+    // Only refresh() writes the state space, so it can be read here unlocked
+    if (!mLevelsDiscovered) {
+        if (timesUs.empty()) {
+            LOG(ERROR) << __func__ << ": No GPU power levels in " << GPU_CLOCK_STATS_PATH;
+            return false;
+        }
+        discoverLevels(timesUs.size(), stateResidencyData);
+    }
+    for (size_t level = 0; level < mLevelNames.size() && level < timesUs.size(); level++) {
+        stateResidencyData[level].totalTimeInStateMs = timesUs[level] / 1000;
+    }
+
+    if (mSuspendSupported) {
+        if (!readNode(GPU_SUSPEND_TIME_PATH, mSuspendTimeFd)) {
+            LOG(ERROR) << __func__ << "Failed to get results for GPU:Suspend";
+            return false;
+        }
+        stateResidencyData[mLevelNames.size()].totalTimeInStateMs =
+                strtoull(mBuf.data(), nullptr, 10);
+    }
     return true;
 }
 
 std::vector<PowerEntityStateSpace> GpuStateResidencyDataProvider::getStateSpaces() {
-    return {{.powerEntityId = mPowerEntityId,
-             .states = {
-                 {.powerEntityStateId = mActiveId, .powerEntityStateName = "Active"},
-                 /* (TODO (b/117228832): enable this)
-                 {.powerEntityStateId = mSuspendId, .powerEntityStateName = "Suspend"}
-                 */
-             }}};
+    std::lock_guard<std::mutex> lock(mLevelsLock);
+    std::vector<PowerEntityStateSpace> stateSpace = {{.powerEntityId = mPowerEntityId}};
+    hidl_vec<PowerEntityStateInfo> states;
+    states.resize(mLevelNames.size() + mSuspendSupported);
+    for (uint32_t stateId = 0; stateId < mLevelNames.size(); stateId++) {
+        states[stateId] = PowerEntityStateInfo{.powerEntityStateId = stateId,
+                                               .powerEntityStateName = mLevelNames[stateId]};
+    }
+    if (mSuspendSupported) {
+        uint32_t suspendId = mLevelNames.size();
+        states[suspendId] = PowerEntityStateInfo{.powerEntityStateId = suspendId,
+                                                 .powerEntityStateName = "Suspend"};
+    }
+    stateSpace[0].states = states;
+
+    return stateSpace;
 }
 
 }  // namespace powerstats
 }  // namespace pixel
 }  // namespace google
 }  // namespace hardware
-}  // namespace android
\ No newline at end of file
+}  // namespace android
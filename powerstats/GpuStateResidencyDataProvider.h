@@ -16,8 +16,15 @@
 #ifndef HARDWARE_GOOGLE_PIXEL_POWERSTATS_GPUSTATERESIDENCYDATAPROVIDER_H
 #define HARDWARE_GOOGLE_PIXEL_POWERSTATS_GPUSTATERESIDENCYDATAPROVIDER_H
 
+#include <android-base/unique_fd.h>
 #include <pixelpowerstats/PowerStats.h>
 
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "CachedStateResidencyDataProvider.h"
+
 using android::hardware::power::stats::V1_0::PowerEntityStateResidencyResult;
 using android::hardware::power::stats::V1_0::PowerEntityStateSpace;
 
@@ -27,19 +34,42 @@ namespace google {
 namespace pixel {
 namespace powerstats {
 
-class GpuStateResidencyDataProvider : public IStateResidencyDataProvider {
+/**
+ * Reports the time the GPU spent at each kgsl power level, from
+ * gpu_clock_stats, and in devfreq suspend. Levels are named after their
+ * frequency in gpu_available_frequencies; the power levels are discovered
+ * on the first successful read of gpu_clock_stats, so kgsl coming up late
+ * in boot only delays them, and the state space is empty until then.
+ **/
+class GpuStateResidencyDataProvider : public CachedStateResidencyDataProvider {
   public:
-    GpuStateResidencyDataProvider(uint32_t id);
+    GpuStateResidencyDataProvider(uint32_t id,
+                                  std::chrono::milliseconds freshness = std::chrono::milliseconds(0));
     ~GpuStateResidencyDataProvider() = default;
-    bool getResults(
-            std::unordered_map<uint32_t, PowerEntityStateResidencyResult> &results) override;
     std::vector<PowerEntityStateSpace> getStateSpaces() override;
 
+  protected:
+    bool refresh(hidl_vec<PowerEntityStateResidencyData> &stateResidencyData) override;
+
   private:
-    bool getTotalTime(const std::string &path, uint64_t &totalTimeMs);
-    const uint32_t mPowerEntityId;
-    const uint32_t mActiveId;
-    /* (TODO (b/117228832): enable this) const uint32_t mSuspendId; */
+    // Reads the node at path into mBuf, opening fd first if needed. Fails if
+    // the contents do not fit.
+    bool readNode(const std::string &path, android::base::unique_fd &fd);
+    // Names numLevels power levels and sizes stateResidencyData to match
+    void discoverLevels(size_t numLevels,
+                        hidl_vec<PowerEntityStateResidencyData> &stateResidencyData);
+
+    // Guards the state space, which getStateSpaces() may read while it is
+    // being discovered
+    std::mutex mLevelsLock;
+    bool mLevelsDiscovered;
+    // State ids are the power levels, then Suspend if devfreq reports it
+    std::vector<std::string> mLevelNames;
+    bool mSuspendSupported;
+    // Kept open across refreshes; sysfs regenerates the contents on each read from offset 0
+    android::base::unique_fd mClockStatsFd;
+    android::base::unique_fd mSuspendTimeFd;
+    std::vector<char> mBuf;
 };
 
 }  // namespace powerstats
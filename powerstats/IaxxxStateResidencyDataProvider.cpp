@@ -17,12 +17,8 @@
 
 #include "IaxxxStateResidencyDataProvider.h"
 
-#include <android-base/logging.h>
-#include <android-base/unique_fd.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
-
 #include <utility>
+#include <vector>
 
 #include <linux/mfd/adnc/iaxxx-module.h>
 
@@ -32,46 +28,40 @@ namespace google {
 namespace pixel {
 namespace powerstats {
 
-IaxxxStateResidencyDataProvider::IaxxxStateResidencyDataProvider(uint32_t id)
-    : mPath("/dev/iaxxx-module-celldrv"), mPowerEntityId(id) {}
-
-bool IaxxxStateResidencyDataProvider::getResults(
-        std::unordered_map<uint32_t, PowerEntityStateResidencyResult> &results) {
-    android::base::unique_fd devNode(open(mPath.c_str(), O_RDWR));
-    if (devNode.get() < 0) {
-        PLOG(ERROR) << __func__ << ":Failed to open file " << mPath;
-        return false;
+// Each of the MPLL frequencies and sleep, identified by their index
+static std::vector<uint32_t> iaxxxStateIds() {
+    std::vector<uint32_t> stateIds;
+    for (uint32_t stateId = MPLL_CLK_3000; stateId <= NUM_MPLL_CLK_FREQ; stateId++) {
+        stateIds.push_back(stateId);
     }
+    return stateIds;
+}
 
+IaxxxStateResidencyDataProvider::IaxxxStateResidencyDataProvider(
+        uint32_t id, std::shared_ptr<CelldrvStatsSession> session,
+        std::chrono::milliseconds freshness)
+    : CachedStateResidencyDataProvider(id, iaxxxStateIds(), freshness),
+      mSession(std::move(session)) {}
+
+bool IaxxxStateResidencyDataProvider::refresh(
+        hidl_vec<PowerEntityStateResidencyData> &stateResidencyData) {
     struct iaxxx_pwr_stats pwrStatsCount;
-    int err = ioctl(devNode.get(), IAXXX_POWER_STATS_COUNT, &pwrStatsCount);
-    if (err != 0) {
-        PLOG(ERROR) << __func__ << "Failed to retrieve stats from " << mPath;
+    if (!mSession->getPowerStats(&pwrStatsCount)) {
         return false;
     }
 
-    PowerEntityStateResidencyResult result = {.powerEntityId = mPowerEntityId};
-    hidl_vec<PowerEntityStateResidencyData> stateResidencyData;
-    stateResidencyData.resize(NUM_MPLL_CLK_FREQ + 1);  // Each of the MPLL frequencies and sleep
-
     // Populate stats for each MPLL frequency
     for (uint32_t stateId = MPLL_CLK_3000; stateId != NUM_MPLL_CLK_FREQ; stateId++) {
-        stateResidencyData[stateId] = PowerEntityStateResidencyData{
-                .powerEntityStateId = stateId,
-                .totalTimeInStateMs = pwrStatsCount.mpllCumulativeDur[stateId],
-                .totalStateEntryCount = pwrStatsCount.mpll_cumulative_cnts[stateId],
-                .lastEntryTimestampMs = pwrStatsCount.mpllTimeStamp[stateId]};
+        PowerEntityStateResidencyData &data = stateResidencyData[stateId];
+        data.totalTimeInStateMs = pwrStatsCount.mpllCumulativeDur[stateId];
+        data.totalStateEntryCount = pwrStatsCount.mpll_cumulative_cnts[stateId];
+        data.lastEntryTimestampMs = pwrStatsCount.mpllTimeStamp[stateId];
     }
 
-    // Populate stats for Sleep mode
-    stateResidencyData[NUM_MPLL_CLK_FREQ] = PowerEntityStateResidencyData{
-            .powerEntityStateId = NUM_MPLL_CLK_FREQ,
-            .totalTimeInStateMs = pwrStatsCount.sleepModeCumulativeDur,
-            .totalStateEntryCount = 0,  // Sleep entry count is not available
-            .lastEntryTimestampMs = pwrStatsCount.sleepModeTimeStamp};
-
-    result.stateResidencyData = stateResidencyData;
-    results.insert(std::make_pair(mPowerEntityId, result));
+    // Populate stats for Sleep mode. Sleep entry count is not available.
+    PowerEntityStateResidencyData &sleep = stateResidencyData[NUM_MPLL_CLK_FREQ];
+    sleep.totalTimeInStateMs = pwrStatsCount.sleepModeCumulativeDur;
+    sleep.lastEntryTimestampMs = pwrStatsCount.sleepModeTimeStamp;
     return true;
 }
 
@@ -18,8 +18,12 @@
 
 #include <pixelpowerstats/PowerStats.h>
 
+#include <memory>
 #include <unordered_map>
 
+#include "CachedStateResidencyDataProvider.h"
+#include "CelldrvStatsSession.h"
+
 #include <linux/mfd/adnc/iaxxx-module.h>
 
 namespace android {
@@ -28,17 +32,19 @@ namespace google {
 namespace pixel {
 namespace powerstats {
 
-class IaxxxStateResidencyDataProvider : public IStateResidencyDataProvider {
+class IaxxxStateResidencyDataProvider : public CachedStateResidencyDataProvider {
   public:
-    IaxxxStateResidencyDataProvider(uint32_t id);
+    IaxxxStateResidencyDataProvider(
+            uint32_t id, std::shared_ptr<CelldrvStatsSession> session,
+            std::chrono::milliseconds freshness = std::chrono::milliseconds(0));
     ~IaxxxStateResidencyDataProvider() = default;
-    bool getResults(
-            std::unordered_map<uint32_t, PowerEntityStateResidencyResult> &results) override;
     std::vector<PowerEntityStateSpace> getStateSpaces() override;
 
+  protected:
+    bool refresh(hidl_vec<PowerEntityStateResidencyData> &stateResidencyData) override;
+
   private:
-    const std::string mPath;
-    const uint32_t mPowerEntityId;
+    const std::shared_ptr<CelldrvStatsSession> mSession;
     static constexpr std::string_view mStateNames[] = {
         "MPLL_3MHz",  "MPLL_5MHz",  "MPLL_6MHz",   "MPLL_8MHz",  "MPLL_10MHz", "MPLL_15MHz",
         "MPLL_30MHz", "MPLL_35MHz", "MPLL_40MHz",  "MPLL_45MHz", "MPLL_50MHz", "MPLL_55MHz",
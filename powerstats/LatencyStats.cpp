@@ -0,0 +1,100 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "libpixelpowerstats"
+
+#include "LatencyStats.h"
+
+#include <android-base/stringprintf.h>
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+static size_t latencyBucket(std::chrono::nanoseconds latency) {
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+    size_t bucket = 0;
+    while (bucket < kLatencyHistogramBuckets - 1 && us >= (1LL << bucket)) {
+        bucket++;
+    }
+    return bucket;
+}
+
+void LatencyStats::record(const std::string &name, std::chrono::nanoseconds latency,
+                          const std::string &failure) {
+    std::lock_guard<std::mutex> lock(mLock);
+    Entry &entry = mEntries[name];
+    entry.calls++;
+    entry.total += latency;
+    entry.max = std::max(entry.max, latency);
+    entry.histogram[latencyBucket(latency)]++;
+    if (!failure.empty()) {
+        entry.errors++;
+        entry.lastFailure = failure;
+        entry.lastFailureTime = std::chrono::steady_clock::now();
+    }
+}
+
+void LatencyStats::recordFailure(const std::string &name, const std::string &failure) {
+    std::lock_guard<std::mutex> lock(mLock);
+    Entry &entry = mEntries[name];
+    entry.errors++;
+    entry.lastFailure = failure;
+    entry.lastFailureTime = std::chrono::steady_clock::now();
+}
+
+void LatencyStats::dump(int fd) {
+    std::lock_guard<std::mutex> lock(mLock);
+    auto now = std::chrono::steady_clock::now();
+    dprintf(fd, "Call latency (us; histogram buckets <1, <2, <4, ...):\n");
+    dprintf(fd, "  %-48s %8s %8s %10s %10s  %s\n", "Name", "Calls", "Errors", "Avg", "Max",
+            "Histogram");
+    for (const auto &[name, entry] : mEntries) {
+        std::string histogram;
+        size_t last = kLatencyHistogramBuckets;
+        while (last > 0 && entry.histogram[last - 1] == 0) {
+            last--;
+        }
+        for (size_t i = 0; i < last; i++) {
+            histogram += android::base::StringPrintf(" %" PRIu64, entry.histogram[i]);
+        }
+        int64_t avgUs = entry.calls == 0
+                                ? 0
+                                : std::chrono::duration_cast<std::chrono::microseconds>(
+                                          entry.total / entry.calls)
+                                          .count();
+        int64_t maxUs = std::chrono::duration_cast<std::chrono::microseconds>(entry.max).count();
+        dprintf(fd, "  %-48s %8" PRIu64 " %8" PRIu64 " %10" PRId64 " %10" PRId64 " %s\n",
+                name.c_str(), entry.calls, entry.errors, avgUs, maxUs, histogram.c_str());
+        if (entry.errors > 0) {
+            int64_t agoS = std::chrono::duration_cast<std::chrono::seconds>(
+                                   now - entry.lastFailureTime)
+                                   .count();
+            dprintf(fd, "    last failure %" PRId64 "s ago: %s\n", agoS, entry.lastFailure.c_str());
+        }
+    }
+}
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
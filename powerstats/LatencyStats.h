@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HARDWARE_GOOGLE_PIXEL_POWERSTATS_LATENCYSTATS_H
+#define HARDWARE_GOOGLE_PIXEL_POWERSTATS_LATENCYSTATS_H
+
+#include <array>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+// Bucket i counts calls that took less than 2^i us, the last one all others
+constexpr size_t kLatencyHistogramBuckets = 24;
+
+/**
+ * Call counts, errors and latency histograms of the HIDL methods and state
+ * residency providers of the service, keyed by name and dumped through
+ * debug().
+ **/
+class LatencyStats {
+  public:
+    LatencyStats() = default;
+    ~LatencyStats() = default;
+    // An empty failure records a successful call
+    void record(const std::string &name, std::chrono::nanoseconds latency,
+                const std::string &failure);
+    // Records an error that has no latency of its own, such as a missed deadline
+    void recordFailure(const std::string &name, const std::string &failure);
+    void dump(int fd);
+
+  private:
+    struct Entry {
+        uint64_t calls = 0;
+        uint64_t errors = 0;
+        std::chrono::nanoseconds total{0};
+        std::chrono::nanoseconds max{0};
+        std::array<uint64_t, kLatencyHistogramBuckets> histogram = {};
+        std::string lastFailure;
+        std::chrono::steady_clock::time_point lastFailureTime;
+    };
+
+    std::mutex mLock;
+    std::map<std::string, Entry> mEntries;
+};
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
+
+#endif  // HARDWARE_GOOGLE_PIXEL_POWERSTATS_LATENCYSTATS_H
@@ -17,11 +17,6 @@
 
 #include "OsloStateResidencyDataProvider.h"
 
-#include <android-base/logging.h>
-#include <android-base/unique_fd.h>
-#include <fcntl.h>
-#include <sys/ioctl.h>
-
 #include <utility>
 
 #include <linux/mfd/adnc/iaxxx-module.h>
@@ -33,55 +28,27 @@ namespace google {
 namespace pixel {
 namespace powerstats {
 
-OsloStateResidencyDataProvider::OsloStateResidencyDataProvider(uint32_t id)
-        : mPath("/dev/iaxxx-module-celldrv"), mPowerEntityId(id) {}
-
-bool OsloStateResidencyDataProvider::getResults(
-        std::unordered_map<uint32_t, PowerEntityStateResidencyResult> &results) {
-    android::base::unique_fd devNode(open(mPath.c_str(), O_RDWR));
-    if (devNode.get() < 0) {
-        PLOG(ERROR) << __func__ << ":Failed to open file " << mPath;
-        return false;
-    }
-
-    int err = 0;
-    struct iaxxx_sensor_param sp = {
-        .inst_id = 0,
-        .param_id = SENSOR_PARAM_DUMP_STATS,
-        .param_val = 1,
-        .block_id = 0,
-    };
-
-    err = ioctl(devNode.get(), MODULE_SENSOR_SET_PARAM, (unsigned long)&sp);
-    if (err) {
-        PLOG(ERROR) << __func__ << ": MODULE_SENSOR_SET_PARAM IOCTL failed";
-        return false;
-    }
+OsloStateResidencyDataProvider::OsloStateResidencyDataProvider(
+        uint32_t id, std::shared_ptr<CelldrvStatsSession> session,
+        std::chrono::milliseconds freshness)
+    : CachedStateResidencyDataProvider(
+              id, {SENSOR_MODE_OFF, SENSOR_MODE_ENTRANCE, SENSOR_MODE_INTERACTIVE}, freshness),
+      mSession(std::move(session)) {}
 
+bool OsloStateResidencyDataProvider::refresh(
+        hidl_vec<PowerEntityStateResidencyData> &stateResidencyData) {
     struct iaxxx_sensor_mode_stats stats[SENSOR_NUM_MODE];
-    err = ioctl(devNode.get(), IAXXX_SENSOR_MODE_STATS, (unsigned long)stats);
-    if (err) {
-        PLOG(ERROR) << __func__ << ": IAXXX_SENSOR_MODE_STATS IOCTL failed";
+    if (!mSession->getSensorModeStats(stats)) {
         return false;
     }
 
-    PowerEntityStateResidencyResult result = {
-        .powerEntityId = mPowerEntityId,
-        .stateResidencyData = {
-            {.powerEntityStateId = SENSOR_MODE_OFF,
-             .totalTimeInStateMs = stats[SENSOR_MODE_OFF].totalTimeSpentMs,
-             .totalStateEntryCount = stats[SENSOR_MODE_OFF].totalNumEntries,
-             .lastEntryTimestampMs = stats[SENSOR_MODE_OFF].lastEntryTimeStampMs},
-            {.powerEntityStateId = SENSOR_MODE_ENTRANCE,
-             .totalTimeInStateMs = stats[SENSOR_MODE_ENTRANCE].totalTimeSpentMs,
-             .totalStateEntryCount = stats[SENSOR_MODE_ENTRANCE].totalNumEntries,
-             .lastEntryTimestampMs = stats[SENSOR_MODE_ENTRANCE].lastEntryTimeStampMs},
-            {.powerEntityStateId = SENSOR_MODE_INTERACTIVE,
-             .totalTimeInStateMs = stats[SENSOR_MODE_INTERACTIVE].totalTimeSpentMs,
-             .totalStateEntryCount = stats[SENSOR_MODE_INTERACTIVE].totalNumEntries,
-             .lastEntryTimestampMs = stats[SENSOR_MODE_INTERACTIVE].lastEntryTimeStampMs}}};
-
-    results.insert(std::make_pair(mPowerEntityId, result));
+    // The state ids are the sensor modes
+    for (auto &data : stateResidencyData) {
+        const struct iaxxx_sensor_mode_stats &mode = stats[data.powerEntityStateId];
+        data.totalTimeInStateMs = mode.totalTimeSpentMs;
+        data.totalStateEntryCount = mode.totalNumEntries;
+        data.lastEntryTimestampMs = mode.lastEntryTimeStampMs;
+    }
     return true;
 }
 
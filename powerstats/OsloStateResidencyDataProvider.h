@@ -18,24 +18,31 @@
 
 #include <pixelpowerstats/PowerStats.h>
 
+#include <memory>
 #include <unordered_map>
 
+#include "CachedStateResidencyDataProvider.h"
+#include "CelldrvStatsSession.h"
+
 namespace android {
 namespace hardware {
 namespace google {
 namespace pixel {
 namespace powerstats {
 
-class OsloStateResidencyDataProvider : public IStateResidencyDataProvider {
+class OsloStateResidencyDataProvider : public CachedStateResidencyDataProvider {
   public:
-    OsloStateResidencyDataProvider(uint32_t id);
+    OsloStateResidencyDataProvider(
+            uint32_t id, std::shared_ptr<CelldrvStatsSession> session,
+            std::chrono::milliseconds freshness = std::chrono::milliseconds(0));
     ~OsloStateResidencyDataProvider() = default;
-    bool getResults(std::unordered_map<uint32_t, PowerEntityStateResidencyResult> &results) override;
     std::vector<PowerEntityStateSpace> getStateSpaces() override;
 
+  protected:
+    bool refresh(hidl_vec<PowerEntityStateResidencyData> &stateResidencyData) override;
+
   private:
-    const std::string mPath;
-    const uint32_t mPowerEntityId;
+    const std::shared_ptr<CelldrvStatsSession> mSession;
 };
 
 }  // namespace powerstats
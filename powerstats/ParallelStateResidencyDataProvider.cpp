@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "libpixelpowerstats"
+#define ATRACE_TAG ATRACE_TAG_POWER
+
+#include "ParallelStateResidencyDataProvider.h"
+
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <unistd.h>
+#include <utils/Trace.h>
+
+#include <algorithm>
+#include <utility>
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+ParallelStateResidencyDataProvider::ParallelStateResidencyDataProvider(
+        std::shared_ptr<LatencyStats> latencyStats)
+    : mLatencyStats(std::move(latencyStats)) {}
+
+ParallelStateResidencyDataProvider::~ParallelStateResidencyDataProvider() {
+    {
+        std::lock_guard<std::mutex> lock(mLock);
+        mWorkersExit = true;
+    }
+    mWorkerCv.notify_all();
+    for (auto &worker : mWorkers) {
+        worker->thread.join();
+    }
+}
+
+void ParallelStateResidencyDataProvider::addProvider(sp<IStateResidencyDataProvider> provider,
+                                                     std::chrono::milliseconds deadline,
+                                                     const std::string &name,
+                                                     const std::string &node) {
+    mWorkers.emplace_back(std::make_unique<ProviderWorker>());
+    ProviderWorker &worker = *mWorkers.back();
+    worker.provider = std::move(provider);
+    worker.deadline = deadline;
+    worker.name = name;
+    worker.node = node;
+    for (const auto &stateSpace : worker.provider->getStateSpaces()) {
+        mWorkerByEntity[stateSpace.powerEntityId] = mWorkers.size() - 1;
+        PowerEntityStateResidencyResult &result = worker.lastResults[stateSpace.powerEntityId];
+        result.powerEntityId = stateSpace.powerEntityId;
+        result.stateResidencyData.resize(stateSpace.states.size());
+        for (size_t i = 0; i < stateSpace.states.size(); i++) {
+            result.stateResidencyData[i] = {
+                    .powerEntityStateId = stateSpace.states[i].powerEntityStateId,
+                    .totalTimeInStateMs = 0,
+                    .totalStateEntryCount = 0,
+                    .lastEntryTimestampMs = 0};
+        }
+    }
+    worker.thread = std::thread([this, &worker]() { providerWorker(worker); });
+}
+
+void ParallelStateResidencyDataProvider::providerWorker(ProviderWorker &worker) {
+    std::unique_lock<std::mutex> lock(mLock);
+    while (true) {
+        mWorkerCv.wait(lock, [&] { return mWorkersExit || worker.requested; });
+        if (mWorkersExit) {
+            return;
+        }
+        worker.requested = false;
+        worker.busy = true;
+        lock.unlock();
+        std::unordered_map<uint32_t, PowerEntityStateResidencyResult> results;
+        bool ok;
+        {
+            ATRACE_NAME(worker.name.c_str());
+            auto start = std::chrono::steady_clock::now();
+            ok = worker.provider->getResults(results);
+            mLatencyStats->record(worker.name, std::chrono::steady_clock::now() - start,
+                                  ok ? "" : "getResults failed");
+        }
+        lock.lock();
+        worker.busy = false;
+        worker.lastOk = ok;
+        if (ok) {
+            worker.lastResults = std::move(results);
+        }
+        mWorkerDoneCv.notify_all();
+    }
+}
+
+bool ParallelStateResidencyDataProvider::nodePresentLocked(ProviderWorker &worker) {
+    if (worker.node.empty()) {
+        return true;
+    }
+    bool missing = access(worker.node.c_str(), F_OK) != 0;
+    if (missing != worker.nodeMissing) {
+        LOG(INFO) << __func__ << ": " << worker.node
+                  << (missing ? " is missing, skipping its entities" : " appeared");
+        worker.nodeMissing = missing;
+    }
+    return !missing;
+}
+
+bool ParallelStateResidencyDataProvider::getResults(
+        std::unordered_map<uint32_t, PowerEntityStateResidencyResult> &results) {
+    return getResults({}, results);
+}
+
+bool ParallelStateResidencyDataProvider::getResults(
+        const std::vector<uint32_t> &powerEntityIds,
+        std::unordered_map<uint32_t, PowerEntityStateResidencyResult> &results) {
+    std::vector<ProviderWorker *> workers;
+    if (powerEntityIds.empty()) {
+        for (auto &worker : mWorkers) {
+            workers.push_back(worker.get());
+        }
+    } else {
+        std::vector<bool> selected(mWorkers.size(), false);
+        for (uint32_t id : powerEntityIds) {
+            auto it = mWorkerByEntity.find(id);
+            if (it != mWorkerByEntity.end() && !selected[it->second]) {
+                selected[it->second] = true;
+                workers.push_back(mWorkers[it->second].get());
+            }
+        }
+    }
+
+    for (const auto &listener : mQueryListeners) {
+        listener(powerEntityIds);
+    }
+
+    std::unique_lock<std::mutex> lock(mLock);
+    // Nodes of drivers loaded after the service started show up here
+    workers.erase(std::remove_if(workers.begin(), workers.end(),
+                                 [this](ProviderWorker *w) { return !nodePresentLocked(*w); }),
+                  workers.end());
+    auto start = std::chrono::steady_clock::now();
+    for (auto worker : workers) {
+        // A provider still running late from an earlier query is waited for instead
+        if (!worker->busy) {
+            worker->requested = true;
+        }
+    }
+    mWorkerCv.notify_all();
+
+    bool ok = true;
+    for (auto worker : workers) {
+        ProviderWorker &w = *worker;
+        bool done = mWorkerDoneCv.wait_until(lock, start + w.deadline,
+                                             [&] { return !w.requested && !w.busy; });
+        if (done && !w.lastOk) {
+            ok = false;
+            continue;
+        }
+        if (!done) {
+            std::string failure = android::base::StringPrintf(
+                    "missed its %lldms deadline", static_cast<long long>(w.deadline.count()));
+            LOG(WARNING) << __func__ << ": " << w.name << " " << failure
+                         << ", reporting its last results";
+            mLatencyStats->recordFailure(w.name, failure);
+        }
+        for (const auto &result : w.lastResults) {
+            results.insert(result);
+        }
+    }
+    return ok;
+}
+
+void ParallelStateResidencyDataProvider::addQueryListener(
+        std::function<void(const std::vector<uint32_t> &)> listener) {
+    mQueryListeners.push_back(std::move(listener));
+}
+
+bool ParallelStateResidencyDataProvider::hasEntity(uint32_t powerEntityId) const {
+    return mWorkerByEntity.count(powerEntityId) != 0;
+}
+
+std::vector<uint32_t> ParallelStateResidencyDataProvider::getEntityIds() const {
+    std::vector<uint32_t> ids;
+    for (const auto &entry : mWorkerByEntity) {
+        ids.push_back(entry.first);
+    }
+    std::sort(ids.begin(), ids.end());
+    return ids;
+}
+
+std::vector<PowerEntityStateSpace> ParallelStateResidencyDataProvider::getStateSpaces() {
+    std::vector<PowerEntityStateSpace> stateSpaces;
+    for (auto &worker : mWorkers) {
+        std::vector<PowerEntityStateSpace> providerStateSpaces = worker->provider->getStateSpaces();
+        stateSpaces.insert(stateSpaces.end(), providerStateSpaces.begin(),
+                           providerStateSpaces.end());
+    }
+    return stateSpaces;
+}
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
@@ -0,0 +1,113 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HARDWARE_GOOGLE_PIXEL_POWERSTATS_PARALLELSTATERESIDENCYDATAPROVIDER_H
+#define HARDWARE_GOOGLE_PIXEL_POWERSTATS_PARALLELSTATERESIDENCYDATAPROVIDER_H
+
+#include <pixelpowerstats/PowerStats.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "LatencyStats.h"
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+/**
+ * Executor that queries the providers added to it concurrently, each on its
+ * own worker thread. It is registered with PowerStats in their place, so a
+ * query waits for the slowest provider rather than for the sum of all of
+ * them. Only the providers owning the requested entities are run, and
+ * results are merged by power entity id.
+ *
+ * A provider that misses its deadline keeps running in the background and
+ * its entities are reported with the last results it returned, or with zero
+ * residency if it never returned any. Its next run only starts once the
+ * late one has finished.
+ *
+ * Each run is traced and its latency recorded in latencyStats under the
+ * name given to addProvider(), along with missed deadlines.
+ **/
+class ParallelStateResidencyDataProvider : public IStateResidencyDataProvider {
+  public:
+    ParallelStateResidencyDataProvider(std::shared_ptr<LatencyStats> latencyStats);
+    ~ParallelStateResidencyDataProvider();
+    // Must be called before this provider is added to PowerStats. If node is
+    // set, provider is only run while node exists, and its entities are left
+    // out of the results otherwise.
+    void addProvider(sp<IStateResidencyDataProvider> provider, std::chrono::milliseconds deadline,
+                     const std::string &name, const std::string &node = "");
+    // Runs the providers of powerEntityIds, or every provider if it is empty,
+    // and merges their results. Unknown ids are ignored. Returns false if one
+    // of the providers failed, in which case its entities are left out.
+    bool getResults(const std::vector<uint32_t> &powerEntityIds,
+                    std::unordered_map<uint32_t, PowerEntityStateResidencyResult> &results);
+    bool getResults(
+            std::unordered_map<uint32_t, PowerEntityStateResidencyResult> &results) override;
+    bool hasEntity(uint32_t powerEntityId) const;
+    // listener is called with the requested ids, empty for all of them, at
+    // the start of every query. Must be called before the first query.
+    void addQueryListener(std::function<void(const std::vector<uint32_t> &)> listener);
+    std::vector<uint32_t> getEntityIds() const;
+    std::vector<PowerEntityStateSpace> getStateSpaces() override;
+
+  private:
+    struct ProviderWorker {
+        sp<IStateResidencyDataProvider> provider;
+        std::chrono::milliseconds deadline;
+        std::string name;
+        std::string node;
+        std::thread thread;
+        // The fields below are guarded by mLock
+        bool requested = false;
+        bool busy = false;
+        bool lastOk = false;
+        bool nodeMissing = false;
+        // Results of the last successful run, zero residency until then
+        std::unordered_map<uint32_t, PowerEntityStateResidencyResult> lastResults;
+    };
+
+    void providerWorker(ProviderWorker &worker);
+    bool nodePresentLocked(ProviderWorker &worker);
+
+    const std::shared_ptr<LatencyStats> mLatencyStats;
+    std::vector<std::unique_ptr<ProviderWorker>> mWorkers;
+    // Index into mWorkers of the provider of each entity
+    std::unordered_map<uint32_t, size_t> mWorkerByEntity;
+    std::vector<std::function<void(const std::vector<uint32_t> &)>> mQueryListeners;
+    std::mutex mLock;
+    std::condition_variable mWorkerCv;
+    std::condition_variable mWorkerDoneCv;
+    bool mWorkersExit = false;
+};
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
+
+#endif  // HARDWARE_GOOGLE_PIXEL_POWERSTATS_PARALLELSTATERESIDENCYDATAPROVIDER_H
@@ -0,0 +1,274 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "libpixelpowerstats"
+#define ATRACE_TAG ATRACE_TAG_POWER
+
+#include "PixelPowerStats.h"
+
+#include <android-base/parseint.h>
+#include <utils/Trace.h>
+
+#include <inttypes.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+PixelPowerStats::PixelPowerStats(RailDataProvider *railDataProvider,
+                                 sp<ParallelStateResidencyDataProvider> executor,
+                                 std::shared_ptr<LatencyStats> latencyStats)
+    : mRailDataProvider(railDataProvider),
+      mExecutor(std::move(executor)),
+      mLatencyStats(std::move(latencyStats)) {}
+
+void PixelPowerStats::recordCall(const char *method, std::chrono::steady_clock::time_point start,
+                                 Status status) {
+    mLatencyStats->record(std::string("IPowerStats::") + method,
+                          std::chrono::steady_clock::now() - start,
+                          status == Status::SUCCESS ? "" : toString(status));
+}
+
+Return<void> PixelPowerStats::getRailInfo(getRailInfo_cb _hidl_cb) {
+    ATRACE_CALL();
+    auto start = std::chrono::steady_clock::now();
+    return PowerStats::getRailInfo([&](const auto &rails, Status status) {
+        recordCall("getRailInfo", start, status);
+        _hidl_cb(rails, status);
+    });
+}
+
+Return<void> PixelPowerStats::getEnergyData(const hidl_vec<uint32_t> &railIndices,
+                                            getEnergyData_cb _hidl_cb) {
+    ATRACE_CALL();
+    auto start = std::chrono::steady_clock::now();
+    return PowerStats::getEnergyData(railIndices, [&](const auto &energyData, Status status) {
+        recordCall("getEnergyData", start, status);
+        _hidl_cb(energyData, status);
+    });
+}
+
+Return<void> PixelPowerStats::streamEnergyData(uint32_t timeMs, uint32_t samplingRate,
+                                               streamEnergyData_cb _hidl_cb) {
+    ATRACE_CALL();
+    auto start = std::chrono::steady_clock::now();
+    return PowerStats::streamEnergyData(
+            timeMs, samplingRate,
+            [&](const auto &mqDesc, uint32_t numSamples, uint32_t railsPerSample, Status status) {
+                recordCall("streamEnergyData", start, status);
+                _hidl_cb(mqDesc, numSamples, railsPerSample, status);
+            });
+}
+
+Return<void> PixelPowerStats::getPowerEntityInfo(getPowerEntityInfo_cb _hidl_cb) {
+    ATRACE_CALL();
+    auto start = std::chrono::steady_clock::now();
+    return PowerStats::getPowerEntityInfo([&](const auto &powerEntities, Status status) {
+        recordCall("getPowerEntityInfo", start, status);
+        _hidl_cb(powerEntities, status);
+    });
+}
+
+Return<void> PixelPowerStats::getPowerEntityStateInfo(const hidl_vec<uint32_t> &powerEntityIds,
+                                                      getPowerEntityStateInfo_cb _hidl_cb) {
+    ATRACE_CALL();
+    auto start = std::chrono::steady_clock::now();
+    // Read from the providers on each call rather than from the copy PowerStats took at
+    // registration, since some providers only discover their states once their node is readable
+    std::vector<PowerEntityStateSpace> stateSpaces = mExecutor->getStateSpaces();
+    hidl_vec<PowerEntityStateSpace> results;
+    Status status = Status::SUCCESS;
+    if (stateSpaces.empty()) {
+        status = Status::NOT_SUPPORTED;
+    } else if (powerEntityIds.size() == 0) {
+        results = stateSpaces;
+    } else {
+        std::vector<PowerEntityStateSpace> found;
+        for (uint32_t id : powerEntityIds) {
+            auto it = std::find_if(stateSpaces.begin(), stateSpaces.end(),
+                                   [id](const auto &stateSpace) {
+                                       return stateSpace.powerEntityId == id;
+                                   });
+            if (it == stateSpaces.end()) {
+                status = Status::INVALID_INPUT;
+            } else {
+                found.push_back(*it);
+            }
+        }
+        results = found;
+    }
+    recordCall("getPowerEntityStateInfo", start, status);
+    _hidl_cb(results, status);
+    return Void();
+}
+
+Return<void> PixelPowerStats::getPowerEntityStateResidencyData(
+        const hidl_vec<uint32_t> &powerEntityIds, getPowerEntityStateResidencyData_cb _hidl_cb) {
+    ATRACE_CALL();
+    auto start = std::chrono::steady_clock::now();
+    hidl_vec<PowerEntityStateResidencyResult> results;
+    std::vector<uint32_t> ids = mExecutor->getEntityIds();
+    if (ids.empty()) {
+        recordCall("getPowerEntityStateResidencyData", start, Status::NOT_SUPPORTED);
+        _hidl_cb(results, Status::NOT_SUPPORTED);
+        return Void();
+    }
+
+    // An empty request returns every entity. As before the providers ran in
+    // parallel, a request either returns every entity asked for or nothing
+    // but an error.
+    Status status = Status::SUCCESS;
+    if (powerEntityIds.size() != 0) {
+        ids.clear();
+        for (uint32_t id : powerEntityIds) {
+            if (!mExecutor->hasEntity(id)) {
+                status = Status::INVALID_INPUT;
+                break;
+            }
+            ids.push_back(id);
+        }
+    }
+
+    std::unordered_map<uint32_t, PowerEntityStateResidencyResult> stateResidencies;
+    if (status == Status::SUCCESS && !mExecutor->getResults(ids, stateResidencies)) {
+        status = Status::FILESYSTEM_ERROR;
+    }
+    if (status == Status::SUCCESS) {
+        std::vector<PowerEntityStateResidencyResult> found;
+        for (uint32_t id : ids) {
+            auto it = stateResidencies.find(id);
+            // Entities whose node is missing are left out
+            if (it != stateResidencies.end()) {
+                found.push_back(it->second);
+            }
+        }
+        results = found;
+    }
+
+    recordCall("getPowerEntityStateResidencyData", start, status);
+    _hidl_cb(results, status);
+    return Void();
+}
+
+void PixelPowerStats::dumpStateResidency(int fd) {
+    std::unordered_map<uint32_t, std::string> entityNames;
+    PowerStats::getPowerEntityInfo([&](const auto &infos, Status status) {
+        if (status == Status::SUCCESS) {
+            for (const auto &info : infos) {
+                entityNames[info.powerEntityId] = info.powerEntityName;
+            }
+        }
+    });
+
+    std::unordered_map<uint32_t, PowerEntityStateResidencyResult> results;
+    bool ok = mExecutor->getResults(results);
+    // Read after the residencies, so states the providers discovered on this read are named
+    std::unordered_map<uint32_t, std::unordered_map<uint32_t, std::string>> stateNames;
+    for (const auto &stateSpace : mExecutor->getStateSpaces()) {
+        for (const auto &state : stateSpace.states) {
+            stateNames[stateSpace.powerEntityId][state.powerEntityStateId] =
+                    state.powerEntityStateName;
+        }
+    }
+
+    std::vector<uint32_t> ids;
+    for (const auto &result : results) {
+        ids.push_back(result.first);
+    }
+    std::sort(ids.begin(), ids.end());
+
+    dprintf(fd, "State residency%s:\n", ok ? "" : " (some providers failed)");
+    dprintf(fd, "  %-24s %-24s %14s %14s %16s\n", "Entity", "State", "Time(ms)", "Entries",
+            "LastEntry(ms)");
+    for (uint32_t id : ids) {
+        auto entityName = entityNames.find(id);
+        std::string entity =
+                entityName != entityNames.end() ? entityName->second : std::to_string(id);
+        for (const auto &data : results[id].stateResidencyData) {
+            auto stateName = stateNames[id].find(data.powerEntityStateId);
+            std::string state = stateName != stateNames[id].end()
+                                        ? stateName->second
+                                        : std::to_string(data.powerEntityStateId);
+            dprintf(fd, "  %-24s %-24s %14" PRIu64 " %14" PRIu64 " %16" PRIu64 "\n",
+                    entity.c_str(), state.c_str(), data.totalTimeInStateMs,
+                    data.totalStateEntryCount, data.lastEntryTimestampMs);
+        }
+    }
+}
+
+void PixelPowerStats::dumpEnergyData(int fd) {
+    std::vector<std::pair<std::string, std::string>> railNames;
+    PowerStats::getRailInfo([&](const auto &rails, Status status) {
+        if (status == Status::SUCCESS) {
+            for (const auto &rail : rails) {
+                if (rail.index >= railNames.size()) {
+                    railNames.resize(rail.index + 1);
+                }
+                railNames[rail.index] = {rail.railName, rail.subsysName};
+            }
+        }
+    });
+    if (railNames.empty()) {
+        return;
+    }
+
+    dprintf(fd, "Rail energy:\n");
+    dprintf(fd, "  %-32s %-16s %16s\n", "Rail", "Subsystem", "Energy(mWs)");
+    PowerStats::getEnergyData({}, [&](const auto &energyData, Status status) {
+        if (status != Status::SUCCESS) {
+            dprintf(fd, "  unavailable (%s)\n", toString(status).c_str());
+            return;
+        }
+        for (const auto &data : energyData) {
+            if (data.index < railNames.size()) {
+                dprintf(fd, "  %-32s %-16s %16.2f\n", railNames[data.index].first.c_str(),
+                        railNames[data.index].second.c_str(), data.energy / 1000.0);
+            }
+        }
+    });
+}
+
+Return<void> PixelPowerStats::debug(const hidl_handle &handle,
+                                    const hidl_vec<hidl_string> &args) {
+    if (handle == nullptr || handle->numFds < 1) {
+        return Void();
+    }
+    uint64_t windowMs = kDefaultSummaryWindowMs;
+    for (const auto &arg : args) {
+        android::base::ParseUint(arg.c_str(), &windowMs);
+    }
+    // Dumped here rather than by PowerStats::debug, which names the states from the state
+    // spaces it copied at registration and so misses the states providers discover later
+    dumpStateResidency(handle->data[0]);
+    dumpEnergyData(handle->data[0]);
+    mRailDataProvider->dumpPowerSummary(handle->data[0], std::chrono::milliseconds(windowMs));
+    mLatencyStats->dump(handle->data[0]);
+    return Void();
+}
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
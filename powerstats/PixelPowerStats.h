@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HARDWARE_GOOGLE_PIXEL_POWERSTATS_PIXELPOWERSTATS_H
+#define HARDWARE_GOOGLE_PIXEL_POWERSTATS_PIXELPOWERSTATS_H
+
+#include <pixelpowerstats/PowerStats.h>
+
+#include <chrono>
+#include <memory>
+
+#include "LatencyStats.h"
+#include "ParallelStateResidencyDataProvider.h"
+#include "RailDataProvider.h"
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+using android::hardware::hidl_handle;
+using android::hardware::hidl_string;
+using android::hardware::power::stats::V1_0::implementation::PowerStats;
+
+/**
+ * PowerStats with the IPowerStats methods traced and timed into latencyStats.
+ * State spaces and residency are read from executor, which only runs the
+ * providers of the requested entities. executor must be the only state residency
+ * provider added to this service. debug() dumps the state residency, named from the
+ * current state spaces, and the rail energy, followed by the on-device rail power summary
+ * and the latency stats. A numeric argument selects the summary window in milliseconds.
+ **/
+class PixelPowerStats : public PowerStats {
+  public:
+    PixelPowerStats(RailDataProvider *railDataProvider,
+                    sp<ParallelStateResidencyDataProvider> executor,
+                    std::shared_ptr<LatencyStats> latencyStats);
+
+    Return<void> getRailInfo(getRailInfo_cb _hidl_cb) override;
+    Return<void> getEnergyData(const hidl_vec<uint32_t> &railIndices,
+                               getEnergyData_cb _hidl_cb) override;
+    Return<void> streamEnergyData(uint32_t timeMs, uint32_t samplingRate,
+                                  streamEnergyData_cb _hidl_cb) override;
+    Return<void> getPowerEntityInfo(getPowerEntityInfo_cb _hidl_cb) override;
+    Return<void> getPowerEntityStateInfo(const hidl_vec<uint32_t> &powerEntityIds,
+                                         getPowerEntityStateInfo_cb _hidl_cb) override;
+    Return<void> getPowerEntityStateResidencyData(
+            const hidl_vec<uint32_t> &powerEntityIds,
+            getPowerEntityStateResidencyData_cb _hidl_cb) override;
+    Return<void> debug(const hidl_handle &handle, const hidl_vec<hidl_string> &args) override;
+
+  private:
+    // Records a call made at start, up to its callback being invoked with status
+    void recordCall(const char *method, std::chrono::steady_clock::time_point start,
+                    Status status);
+    void dumpStateResidency(int fd);
+    void dumpEnergyData(int fd);
+
+    static constexpr uint64_t kDefaultSummaryWindowMs = 60000;
+    RailDataProvider *const mRailDataProvider;
+    const sp<ParallelStateResidencyDataProvider> mExecutor;
+    const std::shared_ptr<LatencyStats> mLatencyStats;
+};
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
+
+#endif  // HARDWARE_GOOGLE_PIXEL_POWERSTATS_PIXELPOWERSTATS_H
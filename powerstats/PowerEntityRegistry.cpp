@@ -0,0 +1,290 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "libpixelpowerstats"
+
+#include "PowerEntityRegistry.h"
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/strings.h>
+#include <pixelpowerstats/WlanStateResidencyDataProvider.h>
+
+#include <algorithm>
+
+#include "GpuStateResidencyDataProvider.h"
+#include "IaxxxStateResidencyDataProvider.h"
+#include "OsloStateResidencyDataProvider.h"
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+// Splits a line on whitespace. A double quoted string, which may hold
+// whitespace, is one token without its quotes.
+static bool tokenize(const std::string &line, std::vector<std::string> *tokens) {
+    tokens->clear();
+    size_t pos = 0;
+    while (true) {
+        pos = line.find_first_not_of(" \t\r", pos);
+        if (pos == std::string::npos) {
+            return true;
+        }
+        if (line[pos] == '"') {
+            size_t end = line.find('"', pos + 1);
+            if (end == std::string::npos) {
+                return false;
+            }
+            tokens->push_back(line.substr(pos + 1, end - pos - 1));
+            pos = end + 1;
+        } else {
+            size_t end = line.find_first_of(" \t\r", pos);
+            tokens->push_back(line.substr(pos, end - pos));
+            pos = end;
+        }
+    }
+}
+
+static bool parseEntityType(const std::string &token, PowerEntityType *type) {
+    if (token == "SUBSYSTEM") {
+        *type = PowerEntityType::SUBSYSTEM;
+    } else if (token == "PERIPHERAL") {
+        *type = PowerEntityType::PERIPHERAL;
+    } else if (token == "POWER_DOMAIN") {
+        *type = PowerEntityType::POWER_DOMAIN;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Parses the attributes of a state directive, starting at tokens[2]
+static bool parseState(const std::vector<std::string> &tokens, StateResidencyConfig *config) {
+    for (size_t i = 2; i < tokens.size(); i += 2) {
+        if (i + 1 >= tokens.size()) {
+            return false;
+        }
+        const std::string &key = tokens[i];
+        const std::string &value = tokens[i + 1];
+
+        uint64_t divisor = 1;
+        if (i + 3 < tokens.size() && tokens[i + 2] == "/") {
+            if (key == "header" || key == "count" ||
+                !android::base::ParseUint(tokens[i + 3], &divisor) || divisor == 0) {
+                return false;
+            }
+            i += 2;
+        }
+        std::function<uint64_t(uint64_t)> transform = [divisor](uint64_t a) {
+            return a / divisor;
+        };
+
+        if (key == "header") {
+            config->header = value;
+        } else if (key == "count") {
+            config->entryCountSupported = true;
+            config->entryCountPrefix = value;
+        } else if (key == "time") {
+            config->totalTimeSupported = true;
+            config->totalTimePrefix = value;
+            config->totalTimeTransform = transform;
+        } else if (key == "last") {
+            config->lastEntrySupported = true;
+            config->lastEntryPrefix = value;
+            config->lastEntryTransform = transform;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+PowerEntityRegistry::PowerEntityRegistry(std::chrono::milliseconds residencyCache,
+                                         std::chrono::milliseconds providerDeadline)
+    : mResidencyCache(residencyCache), mProviderDeadline(providerDeadline) {}
+
+bool PowerEntityRegistry::parseLine(const std::vector<std::string> &tokens,
+                                    std::string *currentPath) {
+    const std::string &directive = tokens[0];
+    if (directive == "file") {
+        if (tokens.size() != 2) {
+            return false;
+        }
+        *currentPath = tokens[1];
+        return true;
+    }
+
+    if (directive == "state") {
+        if (tokens.size() < 2 || mEntities.empty() || mEntities.back().kind != Kind::GENERIC) {
+            return false;
+        }
+        StateResidencyConfig config = {.name = tokens[1]};
+        if (!parseState(tokens, &config)) {
+            return false;
+        }
+        mEntities.back().states.push_back(config);
+        return true;
+    }
+
+    EntityDef def = {.hasHeader = false};
+    if (tokens.size() < 3 || !parseEntityType(tokens[2], &def.type)) {
+        return false;
+    }
+    def.name = tokens[1];
+    if (directive == "entity") {
+        if (currentPath->empty()) {
+            return false;
+        }
+        def.kind = Kind::GENERIC;
+        def.path = *currentPath;
+        if (tokens.size() == 5 && tokens[3] == "header") {
+            def.hasHeader = true;
+            def.header = tokens[4];
+        } else if (tokens.size() != 3) {
+            return false;
+        }
+    } else if (directive == "wlan") {
+        if (tokens.size() != 4) {
+            return false;
+        }
+        def.kind = Kind::WLAN;
+        def.path = tokens[3];
+    } else if (directive == "gpu" || directive == "oslo" || directive == "iaxxx") {
+        if (tokens.size() != 3) {
+            return false;
+        }
+        def.kind = directive == "gpu" ? Kind::GPU : directive == "oslo" ? Kind::OSLO : Kind::IAXXX;
+    } else if (directive == "aidl") {
+        def.kind = Kind::AIDL;
+        def.aidlStates.assign(tokens.begin() + 3, tokens.end());
+    } else {
+        return false;
+    }
+    mEntities.push_back(def);
+    return true;
+}
+
+bool PowerEntityRegistry::load(const std::string &path) {
+    std::string content;
+    if (!android::base::ReadFileToString(path, &content)) {
+        PLOG(ERROR) << __func__ << ":Failed to read " << path;
+        return false;
+    }
+
+    std::vector<std::string> lines = android::base::Split(content, "\n");
+    std::vector<std::string> tokens;
+    std::string currentPath;
+    for (size_t i = 0; i < lines.size(); i++) {
+        if (!tokenize(lines[i], &tokens)) {
+            LOG(ERROR) << path << ":" << i + 1 << ": unterminated string";
+            return false;
+        }
+        if (tokens.empty() || tokens[0][0] == '#') {
+            continue;
+        }
+        if (!parseLine(tokens, &currentPath)) {
+            LOG(ERROR) << path << ":" << i + 1 << ": invalid " << tokens[0] << " directive";
+            return false;
+        }
+    }
+    return true;
+}
+
+void PowerEntityRegistry::registerEntities(PowerStats *service,
+                                           const sp<ParallelStateResidencyDataProvider> &executor,
+                                           const sp<AidlStateResidencyDataProvider> &aidlSdp) {
+    // Generic providers are added once all of their entities are
+    std::vector<std::pair<std::string, sp<GenericStateResidencyDataProvider>>> genericSdps;
+    std::unordered_map<std::string, sp<GenericStateResidencyDataProvider>> genericSdpByPath;
+    std::shared_ptr<CelldrvStatsSession> celldrvSession;
+    std::vector<uint32_t> osloIds;
+    std::vector<uint32_t> iaxxxIds;
+
+    for (const auto &def : mEntities) {
+        if ((def.kind == Kind::OSLO || def.kind == Kind::IAXXX) && celldrvSession == nullptr) {
+            celldrvSession = std::make_shared<CelldrvStatsSession>();
+        }
+
+        uint32_t id = service->addPowerEntity(def.name, def.type);
+        switch (def.kind) {
+            case Kind::GENERIC: {
+                sp<GenericStateResidencyDataProvider> &sdp = genericSdpByPath[def.path];
+                if (sdp == nullptr) {
+                    sdp = new GenericStateResidencyDataProvider(def.path);
+                    genericSdps.emplace_back(def.path, sdp);
+                }
+                if (def.hasHeader) {
+                    sdp->addEntity(id, PowerEntityConfig(def.header, def.states));
+                } else {
+                    sdp->addEntity(id, PowerEntityConfig(def.states));
+                }
+                break;
+            }
+            case Kind::WLAN:
+                executor->addProvider(new WlanStateResidencyDataProvider(id, def.path),
+                                      mProviderDeadline, def.name, def.path);
+                break;
+            case Kind::GPU:
+                executor->addProvider(new GpuStateResidencyDataProvider(id, mResidencyCache),
+                                      mProviderDeadline, def.name);
+                break;
+            case Kind::OSLO:
+                osloIds.push_back(id);
+                executor->addProvider(
+                        new OsloStateResidencyDataProvider(id, celldrvSession, mResidencyCache),
+                        mProviderDeadline, def.name);
+                break;
+            case Kind::IAXXX:
+                iaxxxIds.push_back(id);
+                executor->addProvider(
+                        new IaxxxStateResidencyDataProvider(id, celldrvSession, mResidencyCache),
+                        mProviderDeadline, def.name);
+                break;
+            case Kind::AIDL:
+                aidlSdp->addEntity(id, def.name, def.aidlStates);
+                break;
+        }
+    }
+
+    // Generic providers are named after the file they read
+    for (const auto &[path, sdp] : genericSdps) {
+        executor->addProvider(sdp, mProviderDeadline, path, path);
+    }
+
+    // Tell the celldrv session which of its stats each query needs
+    if (celldrvSession != nullptr) {
+        executor->addQueryListener(
+                [celldrvSession, osloIds, iaxxxIds](const std::vector<uint32_t> &ids) {
+                    auto requested = [&ids](const std::vector<uint32_t> &entityIds) {
+                        for (uint32_t id : entityIds) {
+                            if (ids.empty() || std::find(ids.begin(), ids.end(), id) != ids.end()) {
+                                return true;
+                            }
+                        }
+                        return false;
+                    };
+                    celldrvSession->beginQuery(requested(iaxxxIds), requested(osloIds));
+                });
+    }
+}
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
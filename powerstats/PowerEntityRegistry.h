@@ -0,0 +1,102 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HARDWARE_GOOGLE_PIXEL_POWERSTATS_POWERENTITYREGISTRY_H
+#define HARDWARE_GOOGLE_PIXEL_POWERSTATS_POWERENTITYREGISTRY_H
+
+#include <pixelpowerstats/AidlStateResidencyDataProvider.h>
+#include <pixelpowerstats/GenericStateResidencyDataProvider.h>
+#include <pixelpowerstats/PowerStats.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "CelldrvStatsSession.h"
+#include "ParallelStateResidencyDataProvider.h"
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+using android::hardware::power::stats::V1_0::implementation::PowerStats;
+
+/**
+ * Power entities described by a config file, one directive per line:
+ *
+ *   file "<path>"                     following entities read <path>
+ *   entity <name> <type> [header "<header>"]
+ *   state <name> [header "<header>"] [count "<prefix>" [/ <divisor>]]
+ *         [time "<prefix>" [/ <divisor>]] [last "<prefix>" [/ <divisor>]]
+ *   wlan <name> <type> "<path>"
+ *   gpu|oslo|iaxxx <name> <type>
+ *   aidl <name> <type> "<state>"...
+ *
+ * <type> is a PowerEntityType. A state belongs to the preceding entity and an
+ * entity to the preceding file; a divisor scales the value parsed after the
+ * prefix. Blank lines and lines starting with # are ignored.
+ *
+ * Every entity is registered, in file order, so entity ids do not depend on
+ * which drivers have loaded. Their providers are added to an executor that
+ * queries them in parallel. Entities reading the same file share one
+ * GenericStateResidencyDataProvider, so the file is read once per query
+ * however many entities it holds. Entities whose node does not exist are
+ * left out of query results until it appears.
+ **/
+class PowerEntityRegistry {
+  public:
+    PowerEntityRegistry(std::chrono::milliseconds residencyCache,
+                        std::chrono::milliseconds providerDeadline);
+    ~PowerEntityRegistry() = default;
+    bool load(const std::string &path);
+    // Adds the loaded entities to service and their providers to executor. Entities of type aidl
+    // are added to aidlSdp, which the caller adds to executor once all entities have been added
+    void registerEntities(PowerStats *service,
+                          const sp<ParallelStateResidencyDataProvider> &executor,
+                          const sp<AidlStateResidencyDataProvider> &aidlSdp);
+
+  private:
+    enum class Kind { GENERIC, WLAN, GPU, OSLO, IAXXX, AIDL };
+
+    struct EntityDef {
+        Kind kind;
+        std::string name;
+        PowerEntityType type;
+        // Node read by GENERIC and WLAN entities
+        std::string path;
+        bool hasHeader;
+        std::string header;
+        std::vector<StateResidencyConfig> states;
+        std::vector<std::string> aidlStates;
+    };
+
+    bool parseLine(const std::vector<std::string> &tokens, std::string *currentPath);
+
+    const std::chrono::milliseconds mResidencyCache;
+    const std::chrono::milliseconds mProviderDeadline;
+    std::vector<EntityDef> mEntities;
+};
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
+
+#endif  // HARDWARE_GOOGLE_PIXEL_POWERSTATS_POWERENTITYREGISTRY_H
@@ -15,17 +15,23 @@
  */
 
 #define LOG_TAG "libpixelpowerstats"
+#define ATRACE_TAG ATRACE_TAG_POWER
 
 #include <algorithm>
 #include <thread>
 #include <exception>
+#include <fcntl.h>
 #include <inttypes.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <android-base/file.h>
 #include <android-base/logging.h>
 #include <android-base/properties.h>
 #include <android-base/strings.h>
 #include <android-base/stringprintf.h>
+#include <utils/Trace.h>
 #include "RailDataProvider.h"
 
 namespace android {
@@ -37,12 +43,25 @@ namespace powerstats {
 #define MAX_FILE_PATH_LEN 128
 #define MAX_DEVICE_NAME_LEN 64
 #define MAX_QUEUE_SIZE 8192
+#define MAX_STREAM_SESSIONS 8
+#define DEFAULT_AGGREGATION_WINDOW_S 600
+#define DEFAULT_AGGREGATION_EWMA_MS 10000
+#define DEFAULT_TRACE_PATH "/data/vendor/powerstats/energy_trace"
+#define DEFAULT_TRACE_RECORDS 65536
+// sysfs attributes are at most one page
+#define MAX_ENERGY_BUF_LEN 4096
 
 constexpr char kIioDirRoot[] = "/sys/bus/iio/devices/";
 constexpr char kDeviceName[] = "microchip,pac1934";
 constexpr char kDeviceType[] = "iio:device";
-constexpr uint32_t MAX_SAMPLING_RATE = 10;
 constexpr uint64_t WRITE_TIMEOUT_NS = 1000000000;
+constexpr char kSnapshotMaxAgeProp[] = "ro.vendor.powerstats.snapshot_max_age_ms";
+constexpr char kAggregationRateProp[] = "ro.vendor.powerstats.aggregation_rate_hz";
+constexpr char kAggregationWindowProp[] = "ro.vendor.powerstats.aggregation_window_s";
+constexpr char kAggregationEwmaProp[] = "ro.vendor.powerstats.aggregation_ewma_ms";
+constexpr char kTraceRateProp[] = "ro.vendor.powerstats.trace_rate_hz";
+constexpr char kTracePathProp[] = "ro.vendor.powerstats.trace_path";
+constexpr char kTraceRecordsProp[] = "ro.vendor.powerstats.trace_records";
 
 void RailDataProvider::findIioPowerMonitorNodes() {
   struct dirent *ent;
@@ -90,7 +109,21 @@ size_t RailDataProvider::parsePowerRails() {
   std::string spsFileName;
   uint32_t index = 0;
   unsigned long samplingRate;
-  for (const auto &path : mOdpm.devicePaths) {
+
+  mOdpm.maxSamplingRate = UINT32_MAX;
+  mOdpm.energyNodes.resize(mOdpm.devicePaths.size());
+  for (size_t i = 0; i < mOdpm.devicePaths.size(); i++) {
+    IioEnergyNode &node = mOdpm.energyNodes[i];
+    node.path = mOdpm.devicePaths[i] + "/energy_value";
+    node.fd.reset(TEMP_FAILURE_RETRY(open(node.path.c_str(), O_RDONLY | O_CLOEXEC)));
+    if (node.fd < 0) {
+      ALOGE("Error opening file: %s, error: %d", node.path.c_str(), errno);
+    }
+    node.buf.resize(MAX_ENERGY_BUF_LEN + 1);
+  }
+
+  for (size_t i = 0; i < mOdpm.devicePaths.size(); i++) {
+    const std::string &path = mOdpm.devicePaths[i];
     railFileName = path + "/enabled_rails";
     spsFileName = path + "/sampling_rate";
     if (!android::base::ReadFileToString(spsFileName, &data)) {
@@ -102,6 +135,9 @@ size_t RailDataProvider::parsePowerRails() {
       ALOGE("Error parsing: %s", spsFileName.c_str());
       break;
     }
+    mOdpm.energyNodes[i].samplingRate = static_cast<uint32_t>(samplingRate);
+    mOdpm.maxSamplingRate =
+        std::min(mOdpm.maxSamplingRate, static_cast<uint32_t>(samplingRate));
     if (!android::base::ReadFileToString(railFileName, &data)) {
       ALOGW("Error reading file: %s", railFileName.c_str());
       continue;
@@ -111,13 +147,17 @@ size_t RailDataProvider::parsePowerRails() {
     while (std::getline(railNames, line)) {
       std::vector<std::string> words = android::base::Split(line, ":");
       if (words.size() == 2) {
-        mOdpm.railsInfo.emplace(words[0],
+        auto inserted = mOdpm.railsInfo.emplace(words[0],
                            RailData {
                              .devicePath = path,
                              .index = index,
                              .subsysName = words[1],
                              .samplingRate = static_cast<uint32_t>(samplingRate)
                            });
+        if (inserted.second) {
+          mOdpm.energyNodes[i].rails.emplace_back(words[0], index);
+          mOdpm.energyNodes[i].staged.push_back({.index = index, .timestamp = 0, .energy = 0});
+        }
         index++;
       } else {
         ALOGW("Unexpected format in file: %s", railFileName.c_str());
@@ -127,64 +167,184 @@ size_t RailDataProvider::parsePowerRails() {
   return index;
 }
 
-int RailDataProvider::parseIioEnergyNode(std::string devName) {
-   int ret = 0;
-   std::string data;
-   std::string fileName = devName + "/energy_value";
-   if (!android::base::ReadFileToString(fileName, &data)) {
-     ALOGE("Error reading file: %s", fileName.c_str());
+// Returns the position in rails of the rail named [name, name + len), or -1.
+// energy_value lists rails in enabled_rails order, so the entry after the
+// previous match is tried first.
+static int64_t findRail(const std::vector<RailIndex> &rails, size_t *hint,
+                             const char *name, size_t len) {
+  for (size_t n = 0; n < rails.size(); n++) {
+    size_t i = (*hint + n) % rails.size();
+    const std::string &railName = rails[i].first;
+    if (railName.size() == len && memcmp(railName.data(), name, len) == 0) {
+      *hint = i + 1;
+      return i;
+    }
+  }
+  return -1;
+}
+
+int RailDataProvider::parseIioEnergyNode(IioEnergyNode &node) {
+   ssize_t len = -1;
+   if (node.fd >= 0) {
+     len = TEMP_FAILURE_RETRY(pread(node.fd.get(), node.buf.data(), node.buf.size() - 1, 0));
+   }
+   if (len < 0) {
+     ALOGE("Error reading file: %s", node.path.c_str());
      return -1;
    }
+   node.buf[len] = '\0';
 
-   std::istringstream energyData(data);
-   std::string line;
+   const char *line = node.buf.data();
+   const char *end = line + len;
    uint64_t timestamp = 0;
    bool timestampRead = false;
-   while (std::getline(energyData, line)) {
-     std::vector<std::string> words = android::base::Split(line, ",");
+   size_t hint = 0;
+   while (line < end) {
+     const char *eol = static_cast<const char *>(memchr(line, '\n', end - line));
+     if (eol == nullptr) {
+       eol = end;
+     }
+     const char *comma = static_cast<const char *>(memchr(line, ',', eol - line));
+     const char *secondComma = comma == nullptr ? nullptr :
+         static_cast<const char *>(memchr(comma + 1, ',', eol - comma - 1));
      if (timestampRead == false) {
-       if (words.size() == 1) {
-         timestamp = strtoull(words[0].c_str(), NULL, 10);
+       if (comma == nullptr) {
+         timestamp = strtoull(line, NULL, 10);
          if (timestamp == 0 || timestamp == ULLONG_MAX) {
            ALOGW("Potentially wrong timestamp: %" PRIu64, timestamp);
          }
          timestampRead = true;
        }
-     } else if (words.size() == 2) {
-         std::string railName = words[0];
-         if (mOdpm.railsInfo.count(railName) != 0) {
-           size_t index = mOdpm.railsInfo[railName].index;
-           mOdpm.reading[index].index = index;
-           mOdpm.reading[index].timestamp = timestamp;
-           mOdpm.reading[index].energy = strtoull(words[1].c_str(), NULL, 10);
-           if (mOdpm.reading[index].energy == ULLONG_MAX) {
+     } else if (comma != nullptr && secondComma == nullptr) {
+         int64_t pos = findRail(node.rails, &hint, line, comma - line);
+         if (pos >= 0) {
+           node.staged[pos].timestamp = timestamp;
+           node.staged[pos].energy = strtoull(comma + 1, NULL, 10);
+           if (node.staged[pos].energy == ULLONG_MAX) {
              ALOGW("Potentially wrong energy value: %" PRIu64,
-                   mOdpm.reading[index].energy);
+                   node.staged[pos].energy);
            }
          }
      } else {
-       ALOGW("Unexpected format in file: %s", fileName.c_str());
-       ret = -1;
-       break;
+       ALOGW("Unexpected format in file: %s", node.path.c_str());
+       return -1;
      }
+     line = eol + 1;
    }
-   return ret;
+   return 0;
+}
+
+void RailDataProvider::samplingWorker(IioEnergyNode &node) {
+  uint64_t sampleGen = 0;
+  std::unique_lock<std::mutex> lock(mWorkerLock);
+  while (true) {
+    mWorkerCv.wait(lock, [&] { return mWorkersExit || mSampleGen != sampleGen; });
+    if (mWorkersExit) {
+      return;
+    }
+    sampleGen = mSampleGen;
+    lock.unlock();
+    node.status = parseIioEnergyNode(node);
+    lock.lock();
+    if (--mWorkersPending == 0) {
+      mWorkerDoneCv.notify_one();
+    }
+  }
 }
 
+void RailDataProvider::startSamplingWorkers() {
+  for (size_t i = 1; i < mOdpm.energyNodes.size(); i++) {
+    IioEnergyNode &node = mOdpm.energyNodes[i];
+    mWorkers.emplace_back([this, &node]() { samplingWorker(node); });
+  }
+}
+
+// Takes a new reading and publishes it. Callers hold mSampleLock.
 Status RailDataProvider::parseIioEnergyNodes() {
-  Status ret = Status::SUCCESS;
+  ATRACE_CALL();
   if (mOdpm.hwEnabled == false) {
     return Status::NOT_SUPPORTED;
   }
 
-  for (const auto &devicePath : mOdpm.devicePaths) {
-    if(parseIioEnergyNode(devicePath) < 0) {
+  auto time = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> _lock(mWorkerLock);
+    mWorkersPending = mWorkers.size();
+    mSampleGen++;
+  }
+  mWorkerCv.notify_all();
+  mOdpm.energyNodes[0].status = parseIioEnergyNode(mOdpm.energyNodes[0]);
+  {
+    std::unique_lock<std::mutex> lock(mWorkerLock);
+    mWorkerDoneCv.wait(lock, [this] { return mWorkersPending == 0; });
+  }
+
+  for (const auto &node : mOdpm.energyNodes) {
+    if (node.status < 0) {
       ALOGE("Error in parsing power stats");
-      ret = Status::FILESYSTEM_ERROR;
-      break;
+      return Status::FILESYSTEM_ERROR;
     }
   }
-  return ret;
+
+  for (const auto &node : mOdpm.energyNodes) {
+    for (const auto &data : node.staged) {
+      mOdpm.reading[data.index] = data;
+    }
+  }
+  publishReading(time);
+  return Status::SUCCESS;
+}
+
+static_assert(sizeof(EnergyData) % sizeof(uint64_t) == 0,
+              "EnergyData is published as 64-bit words");
+
+// Only called with mSampleLock held, so there is a single writer
+void RailDataProvider::publishReading(std::chrono::steady_clock::time_point time) {
+  uint32_t seq = mOdpm.snapshotSeq.load(std::memory_order_relaxed);
+  mOdpm.snapshotSeq.store(seq + 1, std::memory_order_relaxed);
+  // Keep the word stores below from becoming visible before the odd sequence
+  std::atomic_thread_fence(std::memory_order_release);
+  mOdpm.snapshotTimeNs.store(time.time_since_epoch().count(), std::memory_order_relaxed);
+  const char *src = reinterpret_cast<const char *>(mOdpm.reading.data());
+  for (size_t i = 0; i < mOdpm.snapshotWords; i++) {
+    uint64_t word;
+    memcpy(&word, src + i * sizeof(word), sizeof(word));
+    mOdpm.snapshot[i].store(word, std::memory_order_relaxed);
+  }
+  mOdpm.snapshotSeq.store(seq + 2, std::memory_order_release);
+}
+
+// Copies the rails in railIndices, or all of them if it is empty, from the
+// latest published reading into out and sets time to when it was taken.
+// railIndices must be in range. Returns false if nothing was published yet.
+bool RailDataProvider::readSnapshot(const hidl_vec<uint32_t> &railIndices, EnergyData *out,
+                                    std::chrono::steady_clock::time_point *time) {
+  constexpr size_t kEntryWords = sizeof(EnergyData) / sizeof(uint64_t);
+  size_t count = railIndices.size() == 0 ? mOdpm.reading.size() : railIndices.size();
+  char *dst = reinterpret_cast<char *>(out);
+  int64_t timeNs;
+  uint32_t seq;
+  do {
+    seq = mOdpm.snapshotSeq.load(std::memory_order_acquire);
+    if (seq == 0) {
+      return false;
+    }
+    if (seq & 1) {
+      continue;
+    }
+    timeNs = mOdpm.snapshotTimeNs.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < count; i++) {
+      size_t src = (railIndices.size() == 0 ? i : railIndices[i]) * kEntryWords;
+      for (size_t w = 0; w < kEntryWords; w++) {
+        uint64_t word = mOdpm.snapshot[src + w].load(std::memory_order_relaxed);
+        memcpy(dst + (i * kEntryWords + w) * sizeof(word), &word, sizeof(word));
+      }
+    }
+    // Keep the word loads above from being satisfied after the recheck
+    std::atomic_thread_fence(std::memory_order_acquire);
+  } while ((seq & 1) || seq != mOdpm.snapshotSeq.load(std::memory_order_relaxed));
+  *time = std::chrono::steady_clock::time_point(std::chrono::nanoseconds(timeNs));
+  return true;
 }
 
 RailDataProvider::RailDataProvider() {
@@ -195,7 +355,142 @@ RailDataProvider::RailDataProvider() {
     } else {
       mOdpm.hwEnabled = true;
       mOdpm.reading.resize(numRails);
+      mOdpm.snapshotWords = numRails * sizeof(EnergyData) / sizeof(uint64_t);
+      mOdpm.snapshot.reset(new std::atomic<uint64_t>[mOdpm.snapshotWords]());
+      mOdpm.snapshotTimeNs = 0;
+      mOdpm.snapshotSeq = 0;
+      mStreamReading.resize(numRails);
+      // Younger than one hardware sample period, a snapshot is as fresh as a
+      // new reading would be
+      uint32_t maxAgeMs = android::base::GetUintProperty<uint32_t>(kSnapshotMaxAgeProp, 0);
+      mSnapshotMaxAge = maxAgeMs != 0
+          ? std::chrono::nanoseconds(std::chrono::milliseconds(maxAgeMs))
+          : std::chrono::nanoseconds(std::chrono::seconds(1)) / mOdpm.maxSamplingRate;
+      startSamplingWorkers();
+      startConsumers();
+    }
+}
+
+// Adds a session that samples for the life of the provider at rate and
+// hands every reading it takes to sink
+void RailDataProvider::addInternalSession(
+    uint32_t rate, std::function<void(const std::vector<EnergyData> &)> sink) {
+  std::unique_ptr<StreamSession> stream = std::make_unique<StreamSession>();
+  stream->sink = std::move(sink);
+  stream->numSamples = UINT32_MAX;
+  stream->currSamples = 0;
+  stream->missedSamples = 0;
+  stream->overruns = 0;
+  stream->period = std::chrono::nanoseconds(std::chrono::seconds(1)) / rate;
+  stream->nextSample = std::chrono::steady_clock::now();
+
+  std::lock_guard<std::mutex> _lock(mOdpm.mLock);
+  mOdpm.streams.push_back(std::move(stream));
+  if (!mStreamThread.joinable()) {
+    mStreamThread = std::thread([this]() { streamLoop(); });
+  }
+  mStreamCv.notify_all();
+}
+
+// Sets up the aggregator and the trace recorder, each fed by its own
+// session at its own rate. Without them nothing samples in the background.
+void RailDataProvider::startConsumers() {
+  uint32_t aggregationRate = std::min(
+      android::base::GetUintProperty<uint32_t>(kAggregationRateProp, 0), mOdpm.maxSamplingRate);
+  if (aggregationRate != 0) {
+    uint32_t windowS = android::base::GetUintProperty<uint32_t>(kAggregationWindowProp,
+                                                               DEFAULT_AGGREGATION_WINDOW_S);
+    uint32_t ewmaMs = android::base::GetUintProperty<uint32_t>(kAggregationEwmaProp,
+                                                              DEFAULT_AGGREGATION_EWMA_MS);
+    mAggregator = std::make_unique<RailEnergyAggregator>(
+        mOdpm.reading.size(), static_cast<size_t>(aggregationRate) * windowS,
+        std::chrono::milliseconds(std::max<uint32_t>(ewmaMs, 1)));
+  }
+
+  uint32_t traceRate = std::min(
+      android::base::GetUintProperty<uint32_t>(kTraceRateProp, 0), mOdpm.maxSamplingRate);
+  if (traceRate != 0) {
+    std::vector<std::string> railNames(mOdpm.reading.size());
+    for (const auto &railData : mOdpm.railsInfo) {
+      railNames[railData.second.index] = railData.first;
     }
+    mTraceRecorder = std::make_unique<EnergyTraceRecorder>();
+    if (!mTraceRecorder->open(
+            android::base::GetProperty(kTracePathProp, DEFAULT_TRACE_PATH), railNames,
+            android::base::GetUintProperty<uint32_t>(kTraceRecordsProp, DEFAULT_TRACE_RECORDS))) {
+      mTraceRecorder = nullptr;
+      traceRate = 0;
+    }
+  }
+
+  if (mAggregator != nullptr) {
+    addInternalSession(aggregationRate, [this](const std::vector<EnergyData> &reading) {
+      mAggregator->addSample(reading);
+    });
+  }
+  if (mTraceRecorder != nullptr) {
+    addInternalSession(traceRate, [this](const std::vector<EnergyData> &reading) {
+      mTraceRecorder->append(reading);
+    });
+  }
+}
+
+bool RailDataProvider::getPowerSummary(std::chrono::milliseconds window,
+                                       std::vector<RailPowerSummary> *summary) {
+  if (mAggregator == nullptr) {
+    return false;
+  }
+  mAggregator->getSummary(window, summary);
+  return true;
+}
+
+void RailDataProvider::dumpPowerSummary(int fd, std::chrono::milliseconds window) {
+  std::vector<RailPowerSummary> summary;
+  if (!getPowerSummary(window, &summary)) {
+    dprintf(fd, "Rail power aggregation disabled (%s)\n", kAggregationRateProp);
+    return;
+  }
+  std::vector<std::string> names(summary.size());
+  {
+    std::lock_guard<std::mutex> _lock(mOdpm.mLock);
+    for (const auto &railData : mOdpm.railsInfo) {
+      if (railData.second.index < names.size()) {
+        names[railData.second.index] = railData.first;
+      }
+    }
+  }
+  dprintf(fd, "Rail power over the last %" PRId64 " ms (mW; histogram buckets <1, <2, <4, ...):\n",
+          static_cast<int64_t>(window.count()));
+  dprintf(fd, "  %-32s %10s %10s %10s %10s  %s\n", "Rail", "Span(ms)", "Avg", "Peak", "EWMA",
+          "Histogram");
+  for (const auto &s : summary) {
+    std::string histogram;
+    for (const auto &count : s.histogram) {
+      histogram += android::base::StringPrintf(" %" PRIu32, count);
+    }
+    dprintf(fd, "  %-32s %10" PRIu64 " %10.1f %10.1f %10.1f %s\n", names[s.index].c_str(),
+            s.durationMs, s.avgPowerMw, s.peakPowerMw, s.ewmaPowerMw, histogram.c_str());
+  }
+}
+
+RailDataProvider::~RailDataProvider() {
+  {
+    std::lock_guard<std::mutex> _lock(mOdpm.mLock);
+    mStreamExit = true;
+  }
+  mStreamCv.notify_all();
+  if (mStreamThread.joinable()) {
+    mStreamThread.join();
+  }
+
+  {
+    std::lock_guard<std::mutex> _lock(mWorkerLock);
+    mWorkersExit = true;
+  }
+  mWorkerCv.notify_all();
+  for (auto &worker : mWorkers) {
+    worker.join();
+  }
 }
 
 Return<void> RailDataProvider::getRailInfo(IPowerStats::getRailInfo_cb _hidl_cb) {
@@ -222,78 +517,200 @@ Return<void> RailDataProvider::getRailInfo(IPowerStats::getRailInfo_cb _hidl_cb)
 
 Return<void> RailDataProvider::getEnergyData(const hidl_vec<uint32_t>& railIndices, IPowerStats::getEnergyData_cb _hidl_cb) {
   hidl_vec<EnergyData> eVal;
-  std::lock_guard<std::mutex> _lock(mOdpm.mLock);
-  Status ret = parseIioEnergyNodes();
+  std::chrono::steady_clock::time_point time;
 
-  if (ret != Status::SUCCESS) {
-    _hidl_cb(eVal, ret);
+  if (mOdpm.hwEnabled == false) {
+    _hidl_cb(eVal, Status::NOT_SUPPORTED);
     return Void();
   }
+  for (const auto &railIndex : railIndices) {
+    if (railIndex >= mOdpm.reading.size()) {
+      _hidl_cb(eVal, Status::INVALID_INPUT);
+      return Void();
+    }
+  }
 
-  if (railIndices.size() == 0) {
-    eVal.resize(mOdpm.railsInfo.size());
-    memcpy(&eVal[0], &mOdpm.reading[0], mOdpm.reading.size() * sizeof(EnergyData));
-  } else {
-    eVal.resize(railIndices.size());
-    int i = 0;
-    for (const auto &railIndex : railIndices) {
-      if (railIndex >= mOdpm.reading.size()) {
-        ret = Status::INVALID_INPUT;
+  // The snapshot is copied straight into the reply without locking while it
+  // is fresh. Otherwise the first caller to get mSampleLock takes a new
+  // reading, which also serves the callers queued behind it.
+  eVal.resize(railIndices.size() == 0 ? mOdpm.reading.size() : railIndices.size());
+  if (!readSnapshot(railIndices, eVal.data(), &time) ||
+      std::chrono::steady_clock::now() - time > mSnapshotMaxAge) {
+    std::lock_guard<std::mutex> _lock(mSampleLock);
+    if (!readSnapshot(railIndices, eVal.data(), &time) ||
+        std::chrono::steady_clock::now() - time > mSnapshotMaxAge) {
+      if (parseIioEnergyNodes() != Status::SUCCESS ||
+          !readSnapshot(railIndices, eVal.data(), &time)) {
         eVal.resize(0);
-        break;
+        _hidl_cb(eVal, Status::FILESYSTEM_ERROR);
+        return Void();
       }
-      memcpy(&eVal[i], &mOdpm.reading[railIndex], sizeof(EnergyData));
-      i++;
     }
   }
-  _hidl_cb(eVal, ret);
+  _hidl_cb(eVal, Status::SUCCESS);
   return Void();
 }
 
+static void logStreamEnd(const StreamSession &stream) {
+  ALOGI("Energy stream done: %" PRIu32 "/%" PRIu32 " samples, %" PRIu32 " missed, %" PRIu32
+        " overruns", stream.currSamples - stream.missedSamples, stream.numSamples,
+        stream.missedSamples, stream.overruns);
+}
+
+// Takes a reading when the earliest session deadline comes up and hands it
+// to every session whose deadline had passed by then, so each session,
+// internal ones included, is sampled at its own period however fast the
+// others are. Deadlines are absolute so parse and FMQ time do not
+// accumulate as drift. A pass that finishes past the next deadline counts
+// as an overrun for the sessions it sampled; slots whose deadline also
+// passed before the reading was taken are dropped and counted as missed.
+void RailDataProvider::streamLoop() {
+  std::vector<StreamSession *> due;
+  std::unique_lock<std::mutex> lock(mOdpm.mLock);
+  while (!mStreamExit) {
+    if (mOdpm.streams.empty()) {
+      mStreamCv.wait(lock);
+      continue;
+    }
+    auto nextTick = std::chrono::steady_clock::time_point::max();
+    for (const auto &stream : mOdpm.streams) {
+      nextTick = std::min(nextTick, stream->nextSample);
+    }
+    // Wake early if a session joins, its deadline may come first
+    size_t numStreams = mOdpm.streams.size();
+    if (mStreamCv.wait_until(lock, nextTick, [this, numStreams] {
+          return mStreamExit || mOdpm.streams.size() != numStreams;
+        })) {
+      continue;
+    }
+
+    lock.unlock();
+    auto sampleTime = std::chrono::steady_clock::now();
+    Status ret;
+    {
+      std::lock_guard<std::mutex> _lock(mSampleLock);
+      ret = parseIioEnergyNodes();
+      if (ret == Status::SUCCESS) {
+        std::copy(mOdpm.reading.begin(), mOdpm.reading.end(), mStreamReading.begin());
+      }
+    }
+    lock.lock();
+
+    due.clear();
+    for (const auto &stream : mOdpm.streams) {
+      if (stream->nextSample > sampleTime) {
+        continue;
+      }
+      if (ret == Status::SUCCESS) {
+        due.push_back(stream.get());
+      }
+      stream->nextSample += stream->period;
+      while (stream->nextSample <= sampleTime) {
+        stream->nextSample += stream->period;
+        if (stream->fmq != nullptr && stream->currSamples + 1 < stream->numSamples) {
+          stream->currSamples++;
+          stream->missedSamples++;
+        }
+      }
+    }
+
+    if (ret != Status::SUCCESS) {
+      // Client sessions end on error; internal sessions retry at their next
+      // deadline
+      auto end = std::stable_partition(mOdpm.streams.begin(), mOdpm.streams.end(),
+                                       [](const auto &stream) { return stream->fmq == nullptr; });
+      ALOGE("Error in parsing power stats, stopping %zu stream(s)",
+            static_cast<size_t>(mOdpm.streams.end() - end));
+      for (auto it = end; it != mOdpm.streams.end(); ++it) {
+        logStreamEnd(**it);
+      }
+      mOdpm.streams.erase(end, mOdpm.streams.end());
+      continue;
+    }
+    nextTick = std::chrono::steady_clock::time_point::max();
+    for (const auto &stream : mOdpm.streams) {
+      nextTick = std::min(nextTick, stream->nextSample);
+    }
+
+    // Sessions are only removed by this thread, so they can be written to
+    // without holding mOdpm.mLock
+    lock.unlock();
+    for (auto stream : due) {
+      if (stream->fmq == nullptr) {
+        stream->sink(mStreamReading);
+        continue;
+      }
+      if (stream->currSamples < stream->numSamples) {
+        if (!stream->fmq->writeBlocking(mStreamReading.data(), mStreamReading.size(),
+                                        WRITE_TIMEOUT_NS)) {
+          stream->missedSamples++;
+        }
+        stream->currSamples++;
+      }
+    }
+    lock.lock();
+
+    // Only sessions sampled on this pass were held up by it
+    if (std::chrono::steady_clock::now() > nextTick) {
+      for (auto stream : due) {
+        stream->overruns++;
+      }
+    }
+
+    auto end = std::stable_partition(mOdpm.streams.begin(), mOdpm.streams.end(),
+                                     [](const auto &stream) {
+                                       return stream->fmq == nullptr ||
+                                              stream->currSamples < stream->numSamples;
+                                     });
+    for (auto it = end; it != mOdpm.streams.end(); ++it) {
+      logStreamEnd(**it);
+    }
+    mOdpm.streams.erase(end, mOdpm.streams.end());
+  }
+}
+
 Return<void> RailDataProvider::streamEnergyData(uint32_t timeMs, uint32_t samplingRate,
                                 IPowerStats::streamEnergyData_cb _hidl_cb) {
+  if (mOdpm.hwEnabled == false) {
+    _hidl_cb(MessageQueueSync::Descriptor(), 0, 0, Status::NOT_SUPPORTED);
+    return Void();
+  }
+  uint32_t sps = std::min(samplingRate, mOdpm.maxSamplingRate);
+  if (sps == 0) {
+    _hidl_cb(MessageQueueSync::Descriptor(), 0, 0, Status::INVALID_INPUT);
+    return Void();
+  }
+  uint32_t numSamples = static_cast<uint64_t>(timeMs) * sps / 1000;
+
   std::lock_guard<std::mutex> _lock(mOdpm.mLock);
-  if (mOdpm.fmqSynchronized != nullptr) {
+  if (mOdpm.streams.size() >= MAX_STREAM_SESSIONS) {
     _hidl_cb(MessageQueueSync::Descriptor(),
              0, 0, Status::INSUFFICIENT_RESOURCES);
     return Void();
   }
-  uint32_t sps = std::min(samplingRate, MAX_SAMPLING_RATE);
-  uint32_t numSamples = timeMs * sps / 1000;
-  mOdpm.fmqSynchronized.reset(new (std::nothrow) MessageQueueSync(MAX_QUEUE_SIZE, true));
-  if (mOdpm.fmqSynchronized == nullptr || mOdpm.fmqSynchronized->isValid() == false) {
-    mOdpm.fmqSynchronized = nullptr;
+  std::unique_ptr<StreamSession> stream(new (std::nothrow) StreamSession());
+  if (stream != nullptr) {
+    stream->fmq.reset(new (std::nothrow) MessageQueueSync(MAX_QUEUE_SIZE, true));
+  }
+  if (stream == nullptr || stream->fmq == nullptr || stream->fmq->isValid() == false) {
     _hidl_cb(MessageQueueSync::Descriptor(),
              0, 0, Status::INSUFFICIENT_RESOURCES);
     return Void();
   }
-  std::thread pollThread = std::thread([this, sps, numSamples]() {
-    uint64_t sleepTimeUs = 1000000/sps;
-    uint32_t currSamples = 0;
-    while (currSamples < numSamples) {
-      mOdpm.mLock.lock();
-      if (parseIioEnergyNodes() == Status::SUCCESS) {
-        mOdpm.fmqSynchronized->writeBlocking(&mOdpm.reading[0],
-                                             mOdpm.reading.size(), WRITE_TIMEOUT_NS);
-        mOdpm.mLock.unlock();
-        currSamples++;
-        if (usleep(sleepTimeUs) < 0) {
-          ALOGW("Sleep interrupted");
-          break;
-        }
-      } else {
-        mOdpm.mLock.unlock();
-        break;
-      }
-    }
-    mOdpm.mLock.lock();
-    mOdpm.fmqSynchronized = nullptr;
-    mOdpm.mLock.unlock();
-    return;
-  });
-  pollThread.detach();
-  _hidl_cb(*(mOdpm.fmqSynchronized)->getDesc(), numSamples,
-           mOdpm.reading.size(), Status::SUCCESS);
+  stream->numSamples = numSamples;
+  stream->currSamples = 0;
+  stream->missedSamples = 0;
+  stream->overruns = 0;
+  stream->period = std::chrono::nanoseconds(std::chrono::seconds(1)) / sps;
+  stream->nextSample = std::chrono::steady_clock::now();
+
+  _hidl_cb(*stream->fmq->getDesc(), numSamples, mOdpm.reading.size(), Status::SUCCESS);
+
+  mOdpm.streams.push_back(std::move(stream));
+  if (!mStreamThread.joinable()) {
+    mStreamThread = std::thread([this]() { streamLoop(); });
+  }
+  mStreamCv.notify_all();
   return Void();
 }
 
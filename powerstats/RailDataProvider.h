@@ -1,9 +1,19 @@
 #ifndef ANDROID_HARDWARE_POWERSTATS_RAILDATAPROVIDER_H
 #define ANDROID_HARDWARE_POWERSTATS_RAILDATAPROVIDER_H
 
+#include <android-base/unique_fd.h>
 #include <fmq/MessageQueue.h>
 #include <pixelpowerstats/PowerStats.h>
 
+#include "EnergyTraceRecorder.h"
+#include "RailEnergyAggregator.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <thread>
+
 namespace android {
 namespace hardware {
 namespace google {
@@ -18,30 +28,132 @@ struct RailData {
     uint32_t samplingRate;
 };
 
+// Rail name and its index into OnDeviceMmt::reading, in enabled_rails order
+typedef std::pair<std::string, uint32_t> RailIndex;
+
+struct IioEnergyNode {
+    std::string path;
+    // Kept open and re-read with pread
+    android::base::unique_fd fd;
+    std::vector<RailIndex> rails;
+    std::vector<char> buf;
+    // Latest values parsed from this device, one entry per rails entry.
+    // Copied into OnDeviceMmt::reading once every device has been read.
+    std::vector<EnergyData> staged;
+    int status;
+    uint32_t samplingRate;
+};
+
+struct StreamSession {
+    // Client sessions write to fmq. Internal sessions, which feed the
+    // aggregator or the trace recorder at their own rate and never end, have
+    // no fmq and hand their samples to sink instead.
+    std::unique_ptr<MessageQueueSync> fmq;
+    std::function<void(const std::vector<EnergyData> &)> sink;
+    uint32_t numSamples;
+    // Sample slots consumed so far, including missed ones
+    uint32_t currSamples;
+    // Slots skipped because the sampler fell behind or the FMQ write timed out
+    uint32_t missedSamples;
+    // Ticks that sampled this session and ran past the next tick's deadline
+    uint32_t overruns;
+    std::chrono::nanoseconds period;
+    // Absolute deadline of this session's next sample
+    std::chrono::steady_clock::time_point nextSample;
+};
+
 struct OnDeviceMmt {
     std::mutex mLock;
     bool hwEnabled;
     std::vector<std::string> devicePaths;
+    // One entry per devicePaths entry
+    std::vector<IioEnergyNode> energyNodes;
     std::map<std::string, RailData> railsInfo;
+    // Merge of the latest per-device readings, written under mSampleLock
     std::vector<EnergyData> reading;
-    std::unique_ptr<MessageQueueSync> fmqSynchronized;
+    // Published copy of reading, stored as 64-bit words so that readers
+    // racing with the sampler only ever see atomic loads. snapshotSeq is odd
+    // while the sampler is writing and zero until the first reading is
+    // published; readers copy without locking and retry if it was odd or
+    // moved underneath them. snapshotTimeNs is the steady clock time the
+    // reading was taken at, published along with it.
+    std::unique_ptr<std::atomic<uint64_t>[]> snapshot;
+    size_t snapshotWords;
+    std::atomic<int64_t> snapshotTimeNs;
+    std::atomic<uint32_t> snapshotSeq;
+    // Highest rate every device can sample at
+    uint32_t maxSamplingRate;
+    // Active streamEnergyData sessions and the internal sessions. Added
+    // under mLock and only removed by the stream thread, also under mLock.
+    std::vector<std::unique_ptr<StreamSession>> streams;
 };
 
 class RailDataProvider : public IRailDataProvider {
 public:
     RailDataProvider();
+    ~RailDataProvider();
     // Methods from ::android::hardware::power::stats::V1_0::IPowerStats follow.
     Return<void> getRailInfo(IPowerStats::getRailInfo_cb _hidl_cb) override;
     Return<void> getEnergyData(const hidl_vec<uint32_t>& railIndices,
                         IPowerStats::getEnergyData_cb _hidl_cb) override;
     Return<void> streamEnergyData(uint32_t timeMs, uint32_t samplingRate,
                         IPowerStats::streamEnergyData_cb _hidl_cb) override;
+    // Per-rail power derived from the samples taken within window. Returns
+    // false if on-device aggregation is disabled.
+    bool getPowerSummary(std::chrono::milliseconds window,
+                         std::vector<RailPowerSummary> *summary);
+    void dumpPowerSummary(int fd, std::chrono::milliseconds window);
  private:
      OnDeviceMmt mOdpm;
      void findIioPowerMonitorNodes();
      size_t parsePowerRails();
-     int parseIioEnergyNode(std::string devName);
+     int parseIioEnergyNode(IioEnergyNode &node);
      Status parseIioEnergyNodes();
+     void publishReading(std::chrono::steady_clock::time_point time);
+     bool readSnapshot(const hidl_vec<uint32_t> &railIndices, EnergyData *out,
+                       std::chrono::steady_clock::time_point *time);
+     void startSamplingWorkers();
+     void samplingWorker(IioEnergyNode &node);
+     void streamLoop();
+     void startConsumers();
+     void addInternalSession(uint32_t rate,
+                             std::function<void(const std::vector<EnergyData> &)> sink);
+
+     // Devices after the first are read by their own worker thread while
+     // the sampling thread reads the first one
+     std::vector<std::thread> mWorkers;
+     std::mutex mWorkerLock;
+     std::condition_variable mWorkerCv;
+     std::condition_variable mWorkerDoneCv;
+     uint64_t mSampleGen = 0;
+     size_t mWorkersPending = 0;
+     bool mWorkersExit = false;
+
+     // Held by whoever takes a reading, the stream thread or a getEnergyData
+     // caller finding the snapshot stale, around parseIioEnergyNodes and
+     // publishing its result
+     std::mutex mSampleLock;
+     // Age past which getEnergyData takes a new reading rather than serving
+     // the snapshot, one hardware sample period unless
+     // ro.vendor.powerstats.snapshot_max_age_ms says otherwise
+     std::chrono::nanoseconds mSnapshotMaxAge;
+
+     // Runs while any session is active, client or internal. mStreamCv and
+     // mStreamExit are protected by mOdpm.mLock.
+     std::thread mStreamThread;
+     std::condition_variable mStreamCv;
+     bool mStreamExit = false;
+     // The stream thread's copy of the reading it hands out, so that
+     // getEnergyData callers can sample while sessions are being served
+     std::vector<EnergyData> mStreamReading;
+
+     // Fed by its own internal session at
+     // ro.vendor.powerstats.aggregation_rate_hz when that is set
+     std::unique_ptr<RailEnergyAggregator> mAggregator;
+     // Appends a reading to a memory-mapped ring file at
+     // ro.vendor.powerstats.trace_rate_hz when that is set, likewise from
+     // its own internal session
+     std::unique_ptr<EnergyTraceRecorder> mTraceRecorder;
 };
 
 }  // namespace powerstats
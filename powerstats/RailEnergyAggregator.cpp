@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "libpixelpowerstats"
+
+#include "RailEnergyAggregator.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+RailEnergyAggregator::RailEnergyAggregator(size_t numRails, size_t capacity,
+                                           std::chrono::milliseconds ewmaTau)
+    : mNumRails(numRails),
+      mCapacity(std::max<size_t>(capacity, 2)),
+      mEwmaTauMs(ewmaTau.count()),
+      mRing(mCapacity * numRails),
+      mHead(0),
+      mCount(0),
+      mEwmaMw(numRails, -1.0) {}
+
+// Returns the reading of the given rail from the row written age samples ago
+const EnergyData &RailEnergyAggregator::at(size_t age, size_t rail) const {
+    size_t row = (mHead + mCapacity - 1 - age) % mCapacity;
+    return mRing[row * mNumRails + rail];
+}
+
+size_t RailEnergyAggregator::histogramBucket(double powerMw) {
+    if (!(powerMw >= 1.0)) {
+        return 0;
+    }
+    return std::min(kPowerHistogramBuckets - 1, static_cast<size_t>(std::log2(powerMw)) + 1);
+}
+
+// Energy is in uWs and timestamps in ms, so the quotient is in mW. Intervals
+// with no elapsed time or a counter that went backwards yield no value.
+static bool intervalPower(const EnergyData &older, const EnergyData &newer, double *powerMw) {
+    if (newer.timestamp <= older.timestamp || newer.energy < older.energy) {
+        return false;
+    }
+    *powerMw = static_cast<double>(newer.energy - older.energy) /
+               static_cast<double>(newer.timestamp - older.timestamp);
+    return true;
+}
+
+void RailEnergyAggregator::addSample(const std::vector<EnergyData> &sample) {
+    std::lock_guard<std::mutex> lock(mLock);
+    for (size_t rail = 0; rail < mNumRails && rail < sample.size(); rail++) {
+        double powerMw;
+        if (mCount > 0 && intervalPower(at(0, rail), sample[rail], &powerMw)) {
+            if (mEwmaMw[rail] < 0) {
+                mEwmaMw[rail] = powerMw;
+            } else {
+                double dtMs = sample[rail].timestamp - at(0, rail).timestamp;
+                double alpha = 1.0 - std::exp(-dtMs / mEwmaTauMs);
+                mEwmaMw[rail] += alpha * (powerMw - mEwmaMw[rail]);
+            }
+        }
+    }
+    std::copy_n(sample.begin(), std::min(mNumRails, sample.size()),
+                mRing.begin() + mHead * mNumRails);
+    mHead = (mHead + 1) % mCapacity;
+    mCount = std::min(mCount + 1, mCapacity);
+}
+
+void RailEnergyAggregator::getSummary(std::chrono::milliseconds window,
+                                      std::vector<RailPowerSummary> *summary) {
+    std::lock_guard<std::mutex> lock(mLock);
+    summary->resize(mNumRails);
+    for (size_t rail = 0; rail < mNumRails; rail++) {
+        RailPowerSummary &s = (*summary)[rail];
+        s = {.index = static_cast<uint32_t>(rail),
+             .durationMs = 0,
+             .numIntervals = 0,
+             .avgPowerMw = 0,
+             .peakPowerMw = 0,
+             .ewmaPowerMw = std::max(mEwmaMw[rail], 0.0),
+             .histogram = {}};
+        if (mCount < 2) {
+            continue;
+        }
+
+        const EnergyData &newest = at(0, rail);
+        size_t oldest = 0;
+        for (size_t age = 1; age < mCount; age++) {
+            const EnergyData &older = at(age, rail);
+            if (older.timestamp > newest.timestamp ||
+                newest.timestamp - older.timestamp > static_cast<uint64_t>(window.count())) {
+                break;
+            }
+            double powerMw;
+            if (intervalPower(older, at(age - 1, rail), &powerMw)) {
+                s.peakPowerMw = std::max(s.peakPowerMw, powerMw);
+                s.histogram[histogramBucket(powerMw)]++;
+                s.numIntervals++;
+            }
+            oldest = age;
+        }
+        if (oldest > 0 && intervalPower(at(oldest, rail), newest, &s.avgPowerMw)) {
+            s.durationMs = newest.timestamp - at(oldest, rail).timestamp;
+        }
+    }
+}
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
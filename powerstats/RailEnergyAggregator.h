@@ -0,0 +1,82 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef HARDWARE_GOOGLE_PIXEL_POWERSTATS_RAILENERGYAGGREGATOR_H
+#define HARDWARE_GOOGLE_PIXEL_POWERSTATS_RAILENERGYAGGREGATOR_H
+
+#include <pixelpowerstats/PowerStats.h>
+
+#include <array>
+#include <chrono>
+#include <mutex>
+#include <vector>
+
+namespace android {
+namespace hardware {
+namespace google {
+namespace pixel {
+namespace powerstats {
+
+// Bucket 0 holds intervals below 1 mW, bucket k holds [2^(k-1), 2^k) mW and
+// the last bucket everything above.
+constexpr size_t kPowerHistogramBuckets = 16;
+
+struct RailPowerSummary {
+    uint32_t index;
+    // Span covered by the samples used, and the number of intervals in it
+    uint64_t durationMs;
+    uint32_t numIntervals;
+    double avgPowerMw;
+    double peakPowerMw;
+    // Exponentially weighted moving average over every sample seen
+    double ewmaPowerMw;
+    std::array<uint32_t, kPowerHistogramBuckets> histogram;
+};
+
+/**
+ * Keeps a ring of the most recent rail energy readings and derives power
+ * statistics from them, so clients can pull a summary instead of streaming
+ * raw cumulative counters.
+ **/
+class RailEnergyAggregator {
+  public:
+    RailEnergyAggregator(size_t numRails, size_t capacity, std::chrono::milliseconds ewmaTau);
+    // Appends one reading per rail, indexed by EnergyData::index
+    void addSample(const std::vector<EnergyData> &sample);
+    // Summarizes the samples no older than window before the newest one
+    void getSummary(std::chrono::milliseconds window, std::vector<RailPowerSummary> *summary);
+    static size_t histogramBucket(double powerMw);
+
+  private:
+    const EnergyData &at(size_t age, size_t rail) const;
+
+    std::mutex mLock;
+    const size_t mNumRails;
+    const size_t mCapacity;
+    const double mEwmaTauMs;
+    // mCapacity rows of mNumRails readings; mHead is the next row written
+    std::vector<EnergyData> mRing;
+    size_t mHead;
+    size_t mCount;
+    std::vector<double> mEwmaMw;
+};
+
+}  // namespace powerstats
+}  // namespace pixel
+}  // namespace google
+}  // namespace hardware
+}  // namespace android
+
+#endif  // HARDWARE_GOOGLE_PIXEL_POWERSTATS_RAILENERGYAGGREGATOR_H
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Decodes an energy trace pulled from the device (see EnergyTraceFormat.h)
+// into CSV, oldest record first. The boot the trace was recorded in is
+// printed to stderr.
+//
+// Usage: energy_trace_dump <trace file>
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include "EnergyTraceFormat.h"
+
+int main(int argc, char **argv) {
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s <trace file>\n", argv[0]);
+        return 1;
+    }
+    std::ifstream file(argv[1], std::ios::binary);
+    std::vector<char> data((std::istreambuf_iterator<char>(file)),
+                           std::istreambuf_iterator<char>());
+
+    EnergyTraceHeader header;
+    if (data.size() < sizeof(header)) {
+        fprintf(stderr, "%s: not an energy trace\n", argv[1]);
+        return 1;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if (memcmp(header.magic, ENERGY_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != ENERGY_TRACE_VERSION) {
+        fprintf(stderr, "%s: not an energy trace\n", argv[1]);
+        return 1;
+    }
+    if (header.capacity == 0 || header.recordSize != energyTraceRecordSize(header.numRails) ||
+        header.dataOffset < sizeof(header) + uint64_t(header.numRails) * kEnergyTraceNameLen ||
+        header.dataOffset + uint64_t(header.capacity) * header.recordSize > data.size()) {
+        fprintf(stderr, "%s: truncated or corrupt energy trace\n", argv[1]);
+        return 1;
+    }
+
+    std::vector<std::string> names;
+    const char *nameTable = data.data() + sizeof(header);
+    for (uint32_t i = 0; i < header.numRails; i++) {
+        const char *name = nameTable + i * kEnergyTraceNameLen;
+        names.emplace_back(name, strnlen(name, kEnergyTraceNameLen));
+    }
+
+    fprintf(stderr, "boot_id: %.*s\n", static_cast<int>(sizeof(header.bootId)), header.bootId);
+    printf("record,sample_time_ms,rail,rail_timestamp_ms,energy_uws\n");
+    uint64_t first = header.count > header.capacity ? header.count - header.capacity : 0;
+    for (uint64_t n = first; n < header.count; n++) {
+        const char *record =
+                data.data() + header.dataOffset + (n % header.capacity) * header.recordSize;
+        uint64_t sampleTimeMs;
+        memcpy(&sampleTimeMs, record, sizeof(sampleTimeMs));
+        for (uint32_t i = 0; i < header.numRails; i++) {
+            EnergyTraceRail rail;
+            memcpy(&rail, record + sizeof(sampleTimeMs) + i * sizeof(rail), sizeof(rail));
+            printf("%" PRIu64 ",%" PRIu64 ",%s,%" PRIu64 ",%" PRIu64 "\n", n, sampleTimeMs,
+                   names[i].c_str(), rail.timestamp, rail.energy);
+        }
+    }
+    return 0;
+}
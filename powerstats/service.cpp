@@ -16,19 +16,19 @@
 
 #define LOG_TAG "android.hardware.power.stats@1.0-service.pixel"
 
+#include <android-base/properties.h>
 #include <android/log.h>
 #include <binder/IPCThreadState.h>
 #include <binder/IServiceManager.h>
 #include <binder/ProcessState.h>
 #include <hidl/HidlTransportSupport.h>
 #include <pixelpowerstats/AidlStateResidencyDataProvider.h>
-#include <pixelpowerstats/GenericStateResidencyDataProvider.h>
 #include <pixelpowerstats/PowerStats.h>
-#include <pixelpowerstats/WlanStateResidencyDataProvider.h>
 
-#include "IaxxxStateResidencyDataProvider.h"
-#include "GpuStateResidencyDataProvider.h"
-#include "OsloStateResidencyDataProvider.h"
+#include "LatencyStats.h"
+#include "ParallelStateResidencyDataProvider.h"
+#include "PixelPowerStats.h"
+#include "PowerEntityRegistry.h"
 #include "RailDataProvider.h"
 
 using android::OK;
@@ -41,176 +41,51 @@ using android::hardware::joinRpcThreadpool;
 
 // Generated HIDL files
 using android::hardware::power::stats::V1_0::IPowerStats;
-using android::hardware::power::stats::V1_0::PowerEntityType;
 using android::hardware::power::stats::V1_0::implementation::PowerStats;
 
 // Pixel specific
 using android::hardware::google::pixel::powerstats::AidlStateResidencyDataProvider;
-using android::hardware::google::pixel::powerstats::IaxxxStateResidencyDataProvider;
-using android::hardware::google::pixel::powerstats::generateGenericStateResidencyConfigs;
-using android::hardware::google::pixel::powerstats::GenericStateResidencyDataProvider;
-using android::hardware::google::pixel::powerstats::GpuStateResidencyDataProvider;
-using android::hardware::google::pixel::powerstats::OsloStateResidencyDataProvider;
-using android::hardware::google::pixel::powerstats::PowerEntityConfig;
+using android::hardware::google::pixel::powerstats::LatencyStats;
+using android::hardware::google::pixel::powerstats::ParallelStateResidencyDataProvider;
+using android::hardware::google::pixel::powerstats::PixelPowerStats;
+using android::hardware::google::pixel::powerstats::PowerEntityRegistry;
 using android::hardware::google::pixel::powerstats::RailDataProvider;
-using android::hardware::google::pixel::powerstats::StateResidencyConfig;
-using android::hardware::google::pixel::powerstats::WlanStateResidencyDataProvider;
+
+static constexpr char kPowerEntitiesConfigPath[] = "/vendor/etc/powerstats/power_entities.conf";
 
 int main(int /* argc */, char** /* argv */) {
     ALOGI("power.stats service 1.0 is starting.");
 
-
-    PowerStats* service = new PowerStats();
+    std::unique_ptr<RailDataProvider> railDataProvider = std::make_unique<RailDataProvider>();
+    std::shared_ptr<LatencyStats> latencyStats = std::make_shared<LatencyStats>();
+    sp<ParallelStateResidencyDataProvider> executor =
+            new ParallelStateResidencyDataProvider(latencyStats);
+    PowerStats* service = new PixelPowerStats(railDataProvider.get(), executor, latencyStats);
 
     // Add rail data provider
-    service->setRailDataProvider(std::make_unique<RailDataProvider>());
-
-    // Add power entities related to rpmh
-    const uint64_t RPM_CLK = 19200;  // RPM runs at 19.2Mhz. Divide by 19200 for msec
-    std::function<uint64_t(uint64_t)> rpmConvertToMs = [](uint64_t a) { return a / RPM_CLK; };
-    std::vector<StateResidencyConfig> rpmStateResidencyConfigs = {
-        {.name = "Sleep",
-         .entryCountSupported = true,
-         .entryCountPrefix = "Sleep Count:",
-         .totalTimeSupported = true,
-         .totalTimePrefix = "Sleep Accumulated Duration:",
-         .totalTimeTransform = rpmConvertToMs,
-         .lastEntrySupported = true,
-         .lastEntryPrefix = "Sleep Last Entered At:",
-         .lastEntryTransform = rpmConvertToMs}};
-
-    sp<GenericStateResidencyDataProvider> rpmSdp =
-            new GenericStateResidencyDataProvider("/sys/power/rpmh_stats/master_stats");
-
-    uint32_t apssId = service->addPowerEntity("APSS", PowerEntityType::SUBSYSTEM);
-    rpmSdp->addEntity(apssId, PowerEntityConfig("APSS", rpmStateResidencyConfigs));
-
-    uint32_t mpssId = service->addPowerEntity("MPSS", PowerEntityType::SUBSYSTEM);
-    rpmSdp->addEntity(mpssId, PowerEntityConfig("MPSS", rpmStateResidencyConfigs));
-
-    uint32_t adspId = service->addPowerEntity("ADSP", PowerEntityType::SUBSYSTEM);
-    rpmSdp->addEntity(adspId, PowerEntityConfig("ADSP", rpmStateResidencyConfigs));
-
-    uint32_t cdspId = service->addPowerEntity("CDSP", PowerEntityType::SUBSYSTEM);
-    rpmSdp->addEntity(cdspId, PowerEntityConfig("CDSP", rpmStateResidencyConfigs));
-
-    uint32_t slpiId = service->addPowerEntity("SLPI", PowerEntityType::SUBSYSTEM);
-    rpmSdp->addEntity(slpiId, PowerEntityConfig("SLPI", rpmStateResidencyConfigs));
-
-    uint32_t slpiIslandId = service->addPowerEntity("SLPI_ISLAND", PowerEntityType::SUBSYSTEM);
-    rpmSdp->addEntity(slpiIslandId, PowerEntityConfig("SLPI_ISLAND", {
-        {.name = "uImage",
-         .entryCountSupported = true,
-         .entryCountPrefix = "Sleep Count:",
-         .totalTimeSupported = true,
-         .totalTimePrefix = "Sleep Accumulated Duration:",
-         .totalTimeTransform = rpmConvertToMs,
-         .lastEntrySupported = true,
-         .lastEntryPrefix = "Sleep Last Entered At:",
-         .lastEntryTransform = rpmConvertToMs}}));
-
-    service->addStateResidencyDataProvider(rpmSdp);
-
-    // Add SoC power entity
-    StateResidencyConfig socStateConfig = {
-        .entryCountSupported = true,
-        .entryCountPrefix = "count:",
-        .totalTimeSupported = true,
-        .totalTimePrefix = "actual last sleep(msec):",
-        .lastEntrySupported = false
-    };
-    std::vector<std::pair<std::string, std::string>> socStateHeaders = {
-        std::make_pair("AOSD", "RPM Mode:aosd"),
-        std::make_pair("CXSD", "RPM Mode:cxsd"),
-        std::make_pair("DDR", "RPM Mode:ddr"),
-    };
-
-    sp<GenericStateResidencyDataProvider> socSdp =
-            new GenericStateResidencyDataProvider("/sys/power/system_sleep/stats");
-
-    uint32_t socId = service->addPowerEntity("SoC", PowerEntityType::POWER_DOMAIN);
-    socSdp->addEntity(socId,
-        PowerEntityConfig(generateGenericStateResidencyConfigs(socStateConfig, socStateHeaders)));
-
-    service->addStateResidencyDataProvider(socSdp);
-
-    // Add WLAN power entity
-    uint32_t wlanId = service->addPowerEntity("WLAN", PowerEntityType::SUBSYSTEM);
-    sp<WlanStateResidencyDataProvider> wlanSdp =
-            new WlanStateResidencyDataProvider(wlanId, "/sys/kernel/wlan/power_stats");
-    service->addStateResidencyDataProvider(wlanSdp);
-
-    // Add Airbrush power entity
-    StateResidencyConfig airStateConfig = {
-        .entryCountSupported = true,
-        .entryCountPrefix = "Cumulative count:",
-        .totalTimeSupported = true,
-        .totalTimePrefix = "Cumulative duration msec:",
-        .lastEntrySupported = true,
-        .lastEntryPrefix = "Last entry timestamp msec:",
-    };
-    std::vector<std::pair<std::string, std::string>> airStateHeaders = {
-        std::make_pair("Active", "ACTIVE"),
-        std::make_pair("Sleep", "SLEEP"),
-        std::make_pair("Deep-Sleep", "DEEP SLEEP"),
-        std::make_pair("Suspend", "SUSPEND"),
-        std::make_pair("Off", "OFF"),
-        std::make_pair("Unknown", "UNKNOWN"),
-    };
-
-    sp<GenericStateResidencyDataProvider> airSdp =
-            new GenericStateResidencyDataProvider(
-                    "/sys/devices/platform/soc/soc:abc-sm/state_stats");
-
-    uint32_t airId = service->addPowerEntity("Visual-Core", PowerEntityType::SUBSYSTEM);
-    airSdp->addEntity(airId, PowerEntityConfig("Pixel Visual Core Subsystem Power Stats",
-            generateGenericStateResidencyConfigs(airStateConfig, airStateHeaders)));
-
-    service->addStateResidencyDataProvider(airSdp);
-
-    // Add NFC power entity
-    StateResidencyConfig nfcStateConfig = {
-        .entryCountSupported = true,
-        .entryCountPrefix = "Cumulative count:",
-        .totalTimeSupported = true,
-        .totalTimePrefix = "Cumulative duration msec:",
-        .lastEntrySupported = true,
-        .lastEntryPrefix = "Last entry timestamp msec:"
-    };
-    std::vector<std::pair<std::string, std::string>> nfcStateHeaders = {
-        std::make_pair("Idle", "Idle mode:"),
-        std::make_pair("Active", "Active mode:"),
-        std::make_pair("Active-RW", "Active Reader/Writer mode:"),
-    };
-
-    sp<GenericStateResidencyDataProvider> nfcSdp =
-            new GenericStateResidencyDataProvider("/sys/class/misc/st21nfc/device/power_stats");
-
-    uint32_t nfcId = service->addPowerEntity("NFC", PowerEntityType::SUBSYSTEM);
-    nfcSdp->addEntity(nfcId,
-        PowerEntityConfig(generateGenericStateResidencyConfigs(nfcStateConfig, nfcStateHeaders)));
-
-    service->addStateResidencyDataProvider(nfcSdp);
-
-    // Add GPU power entity
-    uint32_t gpuId = service->addPowerEntity("GPU", PowerEntityType::SUBSYSTEM);
-    sp<GpuStateResidencyDataProvider> gpuSdp = new GpuStateResidencyDataProvider(gpuId);
-    service->addStateResidencyDataProvider(gpuSdp);
-
-    // Add Oslo power entity
-    uint32_t osloId = service->addPowerEntity("Oslo", PowerEntityType::SUBSYSTEM);
-    sp<OsloStateResidencyDataProvider> osloSdp = new OsloStateResidencyDataProvider(osloId);
-    service->addStateResidencyDataProvider(osloSdp);
-
-    // Add IAXXX power entity
-    uint32_t iaxxxId = service->addPowerEntity("IAXXX", PowerEntityType::SUBSYSTEM);
-    sp<IaxxxStateResidencyDataProvider> iaxxxSdp = new IaxxxStateResidencyDataProvider(iaxxxId);
-    service->addStateResidencyDataProvider(iaxxxSdp);
-
-    // Add Power Entities that require the Aidl data provider
+    service->setRailDataProvider(std::move(railDataProvider));
+
+    // Results of the GPU, Oslo and IAXXX providers are reused for this long, so that frequent
+    // polling does not keep reading the GPU counters or waking the DSP
+    std::chrono::milliseconds residencyCacheMs(
+            android::base::GetUintProperty<uint32_t>("ro.vendor.powerstats.residency_cache_ms",
+                                                     200));
+
+    // State residency providers are queried in parallel. One that takes longer than this is
+    // reported with its last results, so that it does not hold up the others
+    std::chrono::milliseconds providerDeadlineMs(
+            android::base::GetUintProperty<uint32_t>("ro.vendor.powerstats.residency_deadline_ms",
+                                                     100));
+
+    // Add the power entities described in the config file. Entities that require the Aidl data
+    // provider are added to aidlSdp.
     sp<AidlStateResidencyDataProvider> aidlSdp = new AidlStateResidencyDataProvider();
-    uint32_t citadelId = service->addPowerEntity("Citadel", PowerEntityType::SUBSYSTEM);
-    aidlSdp->addEntity(citadelId, "Citadel", {"Last-Reset", "Active", "Deep-Sleep"});
+    PowerEntityRegistry registry(residencyCacheMs, providerDeadlineMs);
+    if (registry.load(kPowerEntitiesConfigPath)) {
+        registry.registerEntities(service, executor, aidlSdp);
+    } else {
+        ALOGE("Unable to load power entities from %s", kPowerEntitiesConfigPath);
+    }
 
     auto serviceStatus = android::defaultServiceManager()->addService(
             android::String16("power.stats-vendor"), aidlSdp);
@@ -221,7 +96,8 @@ int main(int /* argc */, char** /* argv */) {
     sp<android::ProcessState> ps{android::ProcessState::self()};  // Create non-HW binder threadpool
     ps->startThreadPool();
 
-    service->addStateResidencyDataProvider(aidlSdp);
+    executor->addProvider(aidlSdp, providerDeadlineMs, "Aidl");
+    service->addStateResidencyDataProvider(executor);
 
     // Configure the threadpool
     configureRpcThreadpool(1, true /*callerWillJoin*/);
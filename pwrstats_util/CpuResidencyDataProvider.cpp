@@ -0,0 +1,212 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "pwrstats_util"
+
+#include "CpuResidencyDataProvider.h"
+#include <dataproviders/DataProviderHelper.h>
+
+#include <algorithm>
+#include <string>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <android-base/stringprintf.h>
+#include <android-base/strings.h>
+
+using android::base::StringPrintf;
+using android::base::unique_fd;
+
+namespace {
+
+constexpr char kCpuPath[] = "/sys/devices/system/cpu";
+// time_in_state is reported in units of 10ms
+constexpr uint64_t kTimeInStateMs = 10;
+
+struct CpuResidency {
+    const std::string* entity;
+    std::string state;
+    uint64_t timeMs;
+    uint64_t entryCount;
+};
+
+unique_fd openNode(const std::string& path) {
+    return unique_fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+}
+
+// Reads a whole node into buf and NUL terminates it
+bool readNode(int fd, char* buf, size_t size) {
+    ssize_t len = TEMP_FAILURE_RETRY(pread(fd, buf, size - 1, 0));
+    if (len < 0) {
+        return false;
+    }
+    // A full buffer means the contents were cut short
+    if (static_cast<size_t>(len) >= size - 1) {
+        errno = EOVERFLOW;
+        return false;
+    }
+    buf[len] = '\0';
+    return true;
+}
+
+bool readUint64(int fd, uint64_t* value) {
+    char buf[32];
+    if (!readNode(fd, buf, sizeof(buf))) {
+        return false;
+    }
+    char* end;
+    *value = strtoull(buf, &end, 10);
+    return end != buf;
+}
+
+}  // namespace
+
+CpuResidencyDataProvider::CpuResidencyDataProvider() {
+    for (int i = 0;; i++) {
+        std::string cpuPath = StringPrintf("%s/cpu%d", kCpuPath, i);
+        if (access(cpuPath.c_str(), F_OK) != 0) {
+            break;
+        }
+
+        Cpu cpu;
+        cpu.name = StringPrintf("cpu%d", i);
+        for (int j = 0;; j++) {
+            std::string statePath = StringPrintf("%s/cpuidle/state%d", cpuPath.c_str(), j);
+            std::string name;
+            if (!android::base::ReadFileToString(statePath + "/name", &name)) {
+                break;
+            }
+            IdleState state;
+            state.name = "idle_" + android::base::Trim(name);
+            state.timeFd = openNode(statePath + "/time");
+            state.usageFd = openNode(statePath + "/usage");
+            if (state.timeFd < 0 || state.usageFd < 0) {
+                PLOG(ERROR) << __func__ << ": failed to open " << statePath;
+                continue;
+            }
+            cpu.idleStates.push_back(std::move(state));
+        }
+        mCpus.push_back(std::move(cpu));
+    }
+
+    // Policies are numbered after their first CPU, so the numbers have gaps
+    for (int i = 0; i < static_cast<int>(mCpus.size()); i++) {
+        std::string policyPath = StringPrintf("%s/cpufreq/policy%d", kCpuPath, i);
+        if (access(policyPath.c_str(), F_OK) != 0) {
+            continue;
+        }
+        Policy policy;
+        policy.name = StringPrintf("policy%d", i);
+        // Not present while all of the policy's CPUs are offline on some
+        // kernels, so opened again on later samples until it shows up
+        policy.timeInStatePath = policyPath + "/stats/time_in_state";
+        policy.timeInStateFd = openNode(policy.timeInStatePath);
+        mPolicies.push_back(std::move(policy));
+    }
+}
+
+int CpuResidencyDataProvider::getImpl(PowerStatistic* stat) const {
+    std::vector<CpuResidency> residencies;
+    char buf[4096];
+    for (const auto& cpu : mCpus) {
+        for (const auto& state : cpu.idleStates) {
+            uint64_t timeUs;
+            uint64_t usage;
+            if (!readUint64(state.timeFd, &timeUs) || !readUint64(state.usageFd, &usage)) {
+                PLOG(ERROR) << __func__ << ": failed to read " << cpu.name << " " << state.name;
+                continue;
+            }
+            residencies.push_back({&cpu.name, state.name, timeUs / 1000, usage});
+        }
+    }
+
+    for (auto& policy : mPolicies) {
+        if (policy.timeInStateFd < 0) {
+            policy.timeInStateFd = openNode(policy.timeInStatePath);
+            if (policy.timeInStateFd < 0) {
+                continue;
+            }
+        }
+        if (!readNode(policy.timeInStateFd, buf, sizeof(buf))) {
+            PLOG(ERROR) << __func__ << ": failed to read " << policy.timeInStatePath;
+            continue;
+        }
+        // One "<frequency in kHz> <time>" pair per line
+        char* pos = buf;
+        while (*pos != '\0') {
+            char* end;
+            uint64_t freqKhz = strtoull(pos, &end, 10);
+            if (end == pos) {
+                break;
+            }
+            pos = end;
+            uint64_t time = strtoull(pos, &end, 10);
+            if (end == pos) {
+                break;
+            }
+            pos = end;
+            residencies.push_back({&policy.name, std::to_string(freqKhz) + "kHz",
+                                   time * kTimeInStateMs, 0});
+        }
+    }
+
+    // Sort entries first by entity_name, then by state_name.
+    // Sorting is needed to make interval processing efficient.
+    std::sort(residencies.begin(), residencies.end(), [](const auto& a, const auto& b) {
+        if (*a.entity != *b.entity) {
+            return *a.entity < *b.entity;
+        }
+        return a.state < b.state;
+    });
+
+    auto stateResidencies = stat->mutable_c_state_residency()->mutable_residency();
+    stateResidencies->Reserve(residencies.size());
+    for (const auto& entry : residencies) {
+        auto residency = stateResidencies->Add();
+        residency->set_entity_name(*entry.entity);
+        residency->set_state_name(entry.state);
+        residency->set_time_ms(entry.timeMs);
+        residency->set_entry_count(entry.entryCount);
+    }
+    return 0;
+}
+
+int CpuResidencyDataProvider::getImpl(const PowerStatistic& start,
+                                      PowerStatistic* interval) const {
+    auto startResidency = start.c_state_residency().residency();
+    auto intervalResidency = interval->mutable_c_state_residency()->mutable_residency();
+
+    if (0 != StateResidencyInterval(startResidency, intervalResidency)) {
+        interval->clear_c_state_residency();
+        return 1;
+    }
+
+    return 0;
+}
+
+void CpuResidencyDataProvider::dumpImpl(const PowerStatistic& stat, std::ostream* output) const {
+    *output << "CPU Residencies (sysfs cpuidle and cpufreq, lpm_stats not available):"
+            << std::endl;
+    StateResidencyDump(stat.c_state_residency().residency(), output);
+}
+
+PowerStatCase CpuResidencyDataProvider::typeOf() const {
+    return PowerStatCase::kCStateResidency;
+}
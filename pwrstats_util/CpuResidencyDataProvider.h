@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef CPURESIDENCYDATAPROVIDER_H
+#define CPURESIDENCYDATAPROVIDER_H
+
+#include <string>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+
+#include "PowerStatsCollector.h"
+
+/**
+ * CPU residency data provider:
+ * Provides cpuidle state residency for each CPU and cpufreq residency for
+ * each cpufreq policy from sysfs, for builds where debugfs lpm_stats is not
+ * available. Reported as C-state residencies with the CPU (cpuN) or policy
+ * (policyN) as the entity, so it replaces CstateResidencyDataProvider rather
+ * than running alongside it. CPUs sharing a policy share its time_in_state,
+ * so each policy is listed once.
+ **/
+
+class CpuResidencyDataProvider : public IPowerStatProvider {
+  public:
+    CpuResidencyDataProvider();
+    PowerStatCase typeOf() const override;
+  private:
+    struct IdleState {
+        std::string name;
+        android::base::unique_fd timeFd;
+        android::base::unique_fd usageFd;
+    };
+    struct Cpu {
+        std::string name;
+        std::vector<IdleState> idleStates;
+    };
+    struct Policy {
+        std::string name;
+        std::string timeInStatePath;
+        android::base::unique_fd timeInStateFd;
+    };
+
+    int getImpl(PowerStatistic* stat) const override;
+    int getImpl(const PowerStatistic& start, PowerStatistic* interval) const override;
+    void dumpImpl(const PowerStatistic& stat, std::ostream* output) const override;
+
+    // Nodes are opened once and re-read with pread on every sample
+    std::vector<Cpu> mCpus;
+    mutable std::vector<Policy> mPolicies;
+};
+
+#endif  // CPURESIDENCYDATAPROVIDER_H
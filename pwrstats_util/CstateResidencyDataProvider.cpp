@@ -18,58 +18,135 @@
 #include "CstateResidencyDataProvider.h"
 #include <dataproviders/DataProviderHelper.h>
 
-#include <regex>
-#include <string>
-#include <fstream>
-#include <iostream>
+#include <algorithm>
 #include <string>
+#include <string_view>
+#include <vector>
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
-#include <android-base/parsedouble.h>
+#include <android-base/file.h>
 #include <android-base/logging.h>
 
+namespace {
+
+constexpr char kLpmStatsPath[] = "/sys/kernel/debug/lpm_stats/stats";
+constexpr std::string_view kTotalTimeStr = "total success time:";
+
+// Views into the buffer holding the contents of lpm_stats
+struct LpmStatsEntry {
+    std::string_view entity;
+    std::string_view state;
+    uint64_t timeMs;
+};
+
+// Matches a "[<entity>] <state>:" header anywhere in the line
+bool parseHeader(std::string_view line, LpmStatsEntry* entry) {
+    size_t open = line.find('[');
+    if (open == std::string_view::npos) {
+        return false;
+    }
+    size_t close = line.find("] ", open + 1);
+    if (close == std::string_view::npos) {
+        return false;
+    }
+    size_t colon = line.find(':', close + 2);
+    if (colon == std::string_view::npos) {
+        return false;
+    }
+    entry->entity = line.substr(open + 1, close - open - 1);
+    entry->state = line.substr(close + 2, colon - close - 2);
+    entry->timeMs = 0;
+    return true;
+}
+
+// Parses the value following "total success time:", which is in seconds.
+// Follows android::base::ParseFloat, which the parser used to call, so the
+// same lines are accepted and yield the same number of milliseconds.
+bool parseTimeMs(std::string_view value, uint64_t* timeMs) {
+    // The value is a view into the buffer, so strtof needs its own NUL terminated copy
+    char str[64];
+    if (value.size() >= sizeof(str)) {
+        return false;
+    }
+    memcpy(str, value.data(), value.size());
+    str[value.size()] = '\0';
+
+    char* end;
+    errno = 0;
+    float seconds = strtof(str, &end);
+    if (errno != 0 || end == str || *end != '\0' || seconds < 0) {
+        return false;
+    }
+    *timeMs = static_cast<uint64_t>(seconds * 1000);
+    return true;
+}
+
+}  // namespace
+
+bool CstateResidencyDataProvider::isAvailable() {
+    return access(kLpmStatsPath, R_OK) == 0;
+}
+
 int CstateResidencyDataProvider::getImpl(PowerStatistic* stat) const {
-    std::ifstream file("/sys/kernel/debug/lpm_stats/stats");
-
-    std::smatch matches;
-    const std::regex searchExpr("\\[(.*?)\\] (.*?):");
-    std::string line;
-    const std::string searchStr = "total success time:";
-
-    auto residencies = stat->mutable_c_state_residency();
-    while (std::getline(file, line)) {
-        if (std::regex_search(line, matches, searchExpr)) {
-            auto residency = residencies->add_residency();
-            residency->set_entity_name(matches[1]);
-            residency->set_state_name(matches[2]);
-
-            while (std::getline(file, line)) {
-                size_t pos = line.find(searchStr);
-                if (pos != std::string::npos) {
-                    float val;
-                    if (android::base::ParseFloat(line.substr(pos + searchStr.size()), &val)) {
-                        residency->set_time_ms(static_cast<uint64_t>(val * 1000));
-                    } else {
-                        LOG(ERROR) << __func__ << ": failed to parse c-state data";
-                    }
-                    break;
-                }
+    std::string buf;
+    if (!android::base::ReadFileToString(kLpmStatsPath, &buf)) {
+        return 0;
+    }
+    parseLpmStats(buf, stat);
+    return 0;
+}
+
+void CstateResidencyDataProvider::parseLpmStats(std::string_view buf, PowerStatistic* stat) {
+    // Each header is followed by the lines describing that state, one of
+    // which holds its total success time
+    std::vector<LpmStatsEntry> entries;
+    bool inState = false;
+    std::string_view remaining(buf);
+    while (!remaining.empty()) {
+        size_t eol = remaining.find('\n');
+        std::string_view line = remaining.substr(0, eol);
+        remaining.remove_prefix(eol == std::string_view::npos ? remaining.size() : eol + 1);
+
+        if (!inState) {
+            LpmStatsEntry entry;
+            if (parseHeader(line, &entry)) {
+                entries.push_back(entry);
+                inState = true;
             }
+            continue;
         }
-    }
 
-    // Sort entries first by entity_name, then by state_name.
-    // Sorting is needed to make interval processing efficient.
-    std::sort(residencies->mutable_residency()->begin(),
-        residencies->mutable_residency()->end(),
-        [](const auto& a, const auto& b) {
-            // First sort by entity_name, then by state_name
-            if (a.entity_name() != b.entity_name()) {
-                return a.entity_name() < b.entity_name();
+        size_t pos = line.find(kTotalTimeStr);
+        if (pos != std::string_view::npos) {
+            if (!parseTimeMs(line.substr(pos + kTotalTimeStr.size()), &entries.back().timeMs)) {
+                LOG(ERROR) << __func__ << ": failed to parse c-state data";
             }
+            inState = false;
+        }
+    }
 
-            return a.state_name() < b.state_name();
-        });
-    return 0;
+    // Emit entries sorted first by entity_name, then by state_name.
+    // Sorting is needed to make interval processing efficient, and is done on
+    // the views so the protobuf messages are never moved around.
+    std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) {
+        if (a.entity != b.entity) {
+            return a.entity < b.entity;
+        }
+        return a.state < b.state;
+    });
+
+    auto residencies = stat->mutable_c_state_residency()->mutable_residency();
+    residencies->Reserve(entries.size());
+    for (const auto& entry : entries) {
+        auto residency = residencies->Add();
+        residency->set_entity_name(entry.entity.data(), entry.entity.size());
+        residency->set_state_name(entry.state.data(), entry.state.size());
+        residency->set_time_ms(entry.timeMs);
+    }
 }
 
 int CstateResidencyDataProvider::getImpl(const PowerStatistic& start, PowerStatistic* interval) const {
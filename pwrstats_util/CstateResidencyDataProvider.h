@@ -16,6 +16,8 @@
 #ifndef CSTATERESIDENCYDATAPROVIDER_H
 #define CSTATERESIDENCYDATAPROVIDER_H
 
+#include <string_view>
+
 #include "PowerStatsCollector.h"
 
 /**
@@ -27,6 +29,10 @@ class CstateResidencyDataProvider : public IPowerStatProvider {
   public:
     CstateResidencyDataProvider() = default;
     PowerStatCase typeOf() const override;
+    // lpm_stats lives in debugfs, which user builds usually do not mount
+    static bool isAvailable();
+    // Appends the residencies listed in the contents of lpm_stats to stat
+    static void parseLpmStats(std::string_view buf, PowerStatistic* stat);
   private:
     int getImpl(PowerStatistic* stat) const override;
     int getImpl(const PowerStatistic& start, PowerStatistic* interval) const override;
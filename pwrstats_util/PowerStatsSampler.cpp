@@ -0,0 +1,211 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#define LOG_TAG "pwrstats_util"
+
+#include "PowerStatsSampler.h"
+
+#include <inttypes.h>
+
+#include <algorithm>
+#include <thread>
+
+#include <android-base/logging.h>
+
+namespace {
+
+constexpr char kBinaryMagic[8] = {'P', 'W', 'R', 'S', 'M', 'P', 'L', '1'};
+
+// Appends the residency of each state, and its series name if requested
+template <typename T>
+void flattenResidencies(const char* prefix, const T& residencies,
+                        std::vector<std::string>* names, std::vector<uint64_t>* values) {
+    for (const auto& residency : residencies) {
+        if (names) {
+            names->push_back(std::string(prefix) + residency.entity_name() + "/" +
+                             residency.state_name());
+        }
+        values->push_back(residency.time_ms());
+    }
+}
+
+void flatten(const PowerStatistic& stat, std::vector<std::string>* names,
+             std::vector<uint64_t>* values) {
+    switch (stat.power_stat_case()) {
+        case PowerStatCase::kPowerEntityStateResidency:
+            flattenResidencies("entity/", stat.power_entity_state_residency().residency(), names,
+                               values);
+            break;
+        case PowerStatCase::kCStateResidency:
+            flattenResidencies("cstate/", stat.c_state_residency().residency(), names, values);
+            break;
+        case PowerStatCase::kRailEnergy:
+            for (const auto& entry : stat.rail_energy().entry()) {
+                if (names) {
+                    names->push_back("rail/" + entry.rail_name());
+                }
+                values->push_back(entry.energy_uws());
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+}  // namespace
+
+void PowerStatsSampler::addDataProvider(std::unique_ptr<IPowerStatProvider> statProvider) {
+    mStatProviders.push_back(std::move(statProvider));
+}
+
+int PowerStatsSampler::get(std::vector<PowerStatistic>* stats) const {
+    stats->clear();
+    stats->reserve(mStatProviders.size());
+    for (const auto& provider : mStatProviders) {
+        stats->emplace_back();
+        if (0 != provider->get(&stats->back())) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+int PowerStatsSampler::get(const std::vector<PowerStatistic>& start,
+                           std::vector<PowerStatistic>* interval,
+                           std::vector<uint64_t>* values) const {
+    interval->resize(mStatProviders.size());
+    values->clear();
+    for (size_t i = 0; i < mStatProviders.size(); i++) {
+        if (0 != mStatProviders[i]->get(start[i], &(*interval)[i])) {
+            return 1;
+        }
+        flatten((*interval)[i], nullptr, values);
+    }
+    return 0;
+}
+
+void PowerStatsSampler::writeHeader(FILE* file, Format format, std::chrono::milliseconds period,
+                                    const std::vector<std::string>& names) const {
+    if (format == Format::CSV) {
+        fputs("elapsed_ms", file);
+        for (const auto& name : names) {
+            fprintf(file, ",%s", name.c_str());
+        }
+        fputc('\n', file);
+        return;
+    }
+
+    uint32_t periodMs = period.count();
+    uint32_t numSeries = names.size();
+    fwrite(kBinaryMagic, sizeof(kBinaryMagic), 1, file);
+    fwrite(&periodMs, sizeof(periodMs), 1, file);
+    fwrite(&numSeries, sizeof(numSeries), 1, file);
+    for (const auto& name : names) {
+        uint16_t len = std::min<size_t>(name.size(), UINT16_MAX);
+        fwrite(&len, sizeof(len), 1, file);
+        fwrite(name.data(), 1, len, file);
+    }
+}
+
+void PowerStatsSampler::writeSample(FILE* file, Format format, uint64_t elapsedMs,
+                                    const std::vector<uint64_t>& values) const {
+    if (format == Format::CSV) {
+        fprintf(file, "%" PRIu64, elapsedMs);
+        for (uint64_t value : values) {
+            fprintf(file, ",%" PRIu64, value);
+        }
+        fputc('\n', file);
+        return;
+    }
+
+    fwrite(&elapsedMs, sizeof(elapsedMs), 1, file);
+    fwrite(values.data(), sizeof(uint64_t), values.size(), file);
+}
+
+int PowerStatsSampler::run(std::chrono::milliseconds period, std::chrono::milliseconds duration,
+                           const std::string& path, Format format) const {
+    if (period.count() <= 0 || duration < period) {
+        LOG(ERROR) << __func__ << ": duration must cover at least one sampling period";
+        return 1;
+    }
+
+    std::unique_ptr<FILE, decltype(&fclose)> file(fopen(path.c_str(), "we"), fclose);
+    if (!file) {
+        PLOG(ERROR) << __func__ << ": failed to open " << path;
+        return 1;
+    }
+
+    std::vector<PowerStatistic> start;
+    if (0 != get(&start)) {
+        LOG(ERROR) << __func__ << ": failed to get initial sample";
+        return 1;
+    }
+    std::vector<std::string> names;
+    std::vector<uint64_t> values;
+    for (const auto& stat : start) {
+        flatten(stat, &names, &values);
+    }
+    writeHeader(file.get(), format, period, names);
+
+    // Each sample is taken as an interval since start by the providers, so
+    // they do the differencing, and the deltas between samples are then
+    // computed on the flattened values
+    std::vector<uint64_t> prevValues(names.size(), 0);
+    std::vector<uint64_t> currValues;
+    std::vector<PowerStatistic> interval;
+
+    // Samples are scheduled against absolute deadlines so the period does not
+    // drift by the time it takes to collect them
+    const auto startTime = std::chrono::steady_clock::now();
+    const auto end = startTime + duration;
+    size_t numSamples = 0;
+    size_t numDropped = 0;
+    for (auto next = startTime + period; next <= end; next += period) {
+        std::this_thread::sleep_until(next);
+        uint64_t elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     std::chrono::steady_clock::now() - startTime)
+                                     .count();
+        bool valid = 0 == get(start, &interval, &currValues) && currValues.size() == names.size();
+        for (size_t i = 0; i < values.size() && valid; i++) {
+            valid = currValues[i] >= prevValues[i];
+        }
+        if (!valid) {
+            // The counters may have been reset, so start over from a new initial
+            // sample. If that cannot be read either, the next sample covers the
+            // time since the last one written.
+            numDropped++;
+            if (0 == get(&interval)) {
+                start.swap(interval);
+                prevValues.assign(names.size(), 0);
+            }
+            continue;
+        }
+
+        for (size_t i = 0; i < values.size(); i++) {
+            values[i] = currValues[i] - prevValues[i];
+        }
+        prevValues.swap(currValues);
+        writeSample(file.get(), format, elapsedMs, values);
+        numSamples++;
+    }
+
+    if (fflush(file.get()) != 0 || ferror(file.get())) {
+        PLOG(ERROR) << __func__ << ": failed to write " << path;
+        return 1;
+    }
+    LOG(INFO) << "Wrote " << numSamples << " samples of " << names.size() << " series to "
+              << path << ", dropped " << numDropped;
+    return 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef POWERSTATSSAMPLER_H
+#define POWERSTATSSAMPLER_H
+
+#include <stdio.h>
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "PowerStatsCollector.h"
+
+/**
+ * Power stats sampler:
+ * Collects all of its data providers at a fixed period for a fixed duration
+ * and streams the deltas between consecutive samples to a file, as CSV or in
+ * the binary format below.
+ *
+ * Each value is a series named "entity/<entity>/<state>" or
+ * "cstate/<entity>/<state>" for state residencies (ms), or "rail/<rail>" for
+ * rail energy (uWs). The series are fixed by the first sample; later samples
+ * that no longer match them are dropped.
+ *
+ * Binary format (native byte order):
+ *   char[8]  "PWRSMPL1"
+ *   uint32   sampling period in ms
+ *   uint32   number of series N
+ *   N times  uint16 name length, followed by the name
+ *   records  uint64 ms since the first sample, followed by N uint64 deltas
+ **/
+
+class PowerStatsSampler {
+  public:
+    enum class Format { CSV, BINARY };
+
+    PowerStatsSampler() = default;
+    void addDataProvider(std::unique_ptr<IPowerStatProvider> statProvider);
+    int run(std::chrono::milliseconds period, std::chrono::milliseconds duration,
+            const std::string& path, Format format) const;
+
+  private:
+    int get(std::vector<PowerStatistic>* stats) const;
+    int get(const std::vector<PowerStatistic>& start, std::vector<PowerStatistic>* interval,
+            std::vector<uint64_t>* values) const;
+    void writeHeader(FILE* file, Format format, std::chrono::milliseconds period,
+                     const std::vector<std::string>& names) const;
+    void writeSample(FILE* file, Format format, uint64_t elapsedMs,
+                     const std::vector<uint64_t>& values) const;
+
+    std::vector<std::unique_ptr<IPowerStatProvider>> mStatProviders;
+};
+
+#endif  // POWERSTATSSAMPLER_H
@@ -18,16 +18,58 @@
 #include <PowerStatsCollector.h>
 #include <dataproviders/PowerEntityResidencyDataProvider.h>
 #include <dataproviders/RailEnergyDataProvider.h>
+#include "CpuResidencyDataProvider.h"
 #include "CstateResidencyDataProvider.h"
+#include "PowerStatsSampler.h"
+
+#include <iostream>
+#include <string>
+
+#include <android-base/parseint.h>
+
+template <typename T>
+static void addDataProviders(T* sink) {
+    sink->addDataProvider(std::make_unique<PowerEntityResidencyDataProvider>());
+    sink->addDataProvider(std::make_unique<RailEnergyDataProvider>());
+    if (CstateResidencyDataProvider::isAvailable()) {
+        sink->addDataProvider(std::make_unique<CstateResidencyDataProvider>());
+    } else {
+        // Output differs from lpm_stats: per-CPU idle states and per-policy frequencies
+        std::cerr << "lpm_stats not available, reporting CPU residencies from sysfs cpuidle and "
+                     "cpufreq"
+                  << std::endl;
+        sink->addDataProvider(std::make_unique<CpuResidencyDataProvider>());
+    }
+}
+
+// pwrstats_util --sample <period ms> <duration s> <output file> [--csv]
+static int runSampler(int argc, char** argv) {
+    uint32_t periodMs;
+    uint32_t durationS;
+    if ((argc != 5 && argc != 6) || !android::base::ParseUint(argv[2], &periodMs) ||
+        !android::base::ParseUint(argv[3], &durationS) ||
+        (argc == 6 && std::string(argv[5]) != "--csv")) {
+        std::cerr << "Usage: " << argv[0]
+                  << " --sample <period ms> <duration s> <output file> [--csv]" << std::endl;
+        return 1;
+    }
+    auto format = argc == 6 ? PowerStatsSampler::Format::CSV : PowerStatsSampler::Format::BINARY;
+
+    PowerStatsSampler sampler;
+    addDataProviders(&sampler);
+    return sampler.run(std::chrono::milliseconds(periodMs), std::chrono::seconds(durationS),
+                       argv[4], format);
+}
 
 // TODO(sujee): Convert pwrstats_util implementation to use libraries in
 // //vendor/google/tools/powertools/powerstats_util
 int main(int argc, char** argv) {
+    if (argc > 1 && std::string(argv[1]) == "--sample") {
+        return runSampler(argc, argv);
+    }
 
     PowerStatsCollector collector;
-    collector.addDataProvider(std::make_unique<PowerEntityResidencyDataProvider>());
-    collector.addDataProvider(std::make_unique<RailEnergyDataProvider>());
-    collector.addDataProvider(std::make_unique<CstateResidencyDataProvider>());
+    addDataProviders(&collector);
 
     run(argc, argv, collector);
     return 0;
@@ -0,0 +1,147 @@
+/*
+ * Copyright (C) 2019 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include "CstateResidencyDataProvider.h"
+
+#include <algorithm>
+#include <regex>
+#include <sstream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/parsedouble.h>
+#include <gtest/gtest.h>
+
+namespace {
+
+using Residency = std::tuple<std::string, std::string, uint64_t>;
+
+// The regex based parser CstateResidencyDataProvider used before it parsed
+// lpm_stats from a buffer, reading from a stream instead of the file
+std::vector<Residency> parseWithRegex(const std::string& buf) {
+    std::istringstream file(buf);
+
+    std::smatch matches;
+    const std::regex searchExpr("\\[(.*?)\\] (.*?):");
+    std::string line;
+    const std::string searchStr = "total success time:";
+
+    std::vector<Residency> residencies;
+    while (std::getline(file, line)) {
+        if (std::regex_search(line, matches, searchExpr)) {
+            residencies.emplace_back(matches[1], matches[2], 0);
+
+            while (std::getline(file, line)) {
+                size_t pos = line.find(searchStr);
+                if (pos != std::string::npos) {
+                    float val;
+                    if (android::base::ParseFloat(line.substr(pos + searchStr.size()), &val)) {
+                        std::get<2>(residencies.back()) = static_cast<uint64_t>(val * 1000);
+                    }
+                    break;
+                }
+            }
+        }
+    }
+
+    std::sort(residencies.begin(), residencies.end(), [](const auto& a, const auto& b) {
+        return std::tie(std::get<0>(a), std::get<1>(a)) < std::tie(std::get<0>(b), std::get<1>(b));
+    });
+    return residencies;
+}
+
+std::vector<Residency> parseFromBuffer(const std::string& buf) {
+    PowerStatistic stat;
+    CstateResidencyDataProvider::parseLpmStats(buf, &stat);
+
+    std::vector<Residency> residencies;
+    for (const auto& residency : stat.c_state_residency().residency()) {
+        residencies.emplace_back(residency.entity_name(), residency.state_name(),
+                                 residency.time_ms());
+    }
+    return residencies;
+}
+
+std::string readFixture() {
+    std::string buf;
+    EXPECT_TRUE(android::base::ReadFileToString(
+            android::base::GetExecutableDirectory() + "/testdata/lpm_stats", &buf));
+    return buf;
+}
+
+}  // namespace
+
+TEST(CstateResidencyDataProviderTest, MatchesRegexParser) {
+    std::string buf = readFixture();
+    ASSERT_FALSE(buf.empty());
+
+    auto residencies = parseFromBuffer(buf);
+    EXPECT_EQ(22u, residencies.size());
+    EXPECT_EQ(parseWithRegex(buf), residencies);
+}
+
+TEST(CstateResidencyDataProviderTest, MatchesRegexParserOnTrailingWhitespace) {
+    // ParseFloat rejects anything after the number, so these times are not parsed
+    const std::string buf =
+            "[cpu0] wfi: \n"
+            "  total success time: 12.5 \n"
+            "[cpu1] wfi:\t\n"
+            "  total success time: 3.25\t\n"
+            "[cpu2] pc:\r\n"
+            "  total success time: 0.125\r\n"
+            "[cpu3] pc:\n"
+            "  total success time:    7.5\n";
+
+    auto residencies = parseFromBuffer(buf);
+    EXPECT_EQ(parseWithRegex(buf), residencies);
+    EXPECT_EQ(std::vector<Residency>({{"cpu0", "wfi", 0},
+                                      {"cpu1", "wfi", 0},
+                                      {"cpu2", "pc", 0},
+                                      {"cpu3", "pc", 7500}}),
+              residencies);
+}
+
+TEST(CstateResidencyDataProviderTest, MatchesRegexParserOnMissingTime) {
+    // A header without a time takes the time of the next state, which is
+    // skipped, and a header at the end without a time reports 0
+    const std::string buf =
+            "[cpu0] wfi:\n"
+            "  success count:       1\n"
+            "[cpu0] pc:\n"
+            "  total success time: 2.0\n"
+            "[L3] l3-wfi:\n"
+            "  total success time: 1.5\n"
+            "[cpu1] wfi:\n"
+            "  success count:       1\n";
+
+    auto residencies = parseFromBuffer(buf);
+    EXPECT_EQ(parseWithRegex(buf), residencies);
+    EXPECT_EQ(std::vector<Residency>({{"L3", "l3-wfi", 1500},
+                                      {"cpu0", "wfi", 2000},
+                                      {"cpu1", "wfi", 0}}),
+              residencies);
+}
+
+TEST(CstateResidencyDataProviderTest, MatchesRegexParserWithoutTrailingNewline) {
+    const std::string buf =
+            "[cpu0] wfi:\n"
+            "  total success time: 37914.423938499";
+
+    auto residencies = parseFromBuffer(buf);
+    EXPECT_EQ(parseWithRegex(buf), residencies);
+    ASSERT_EQ(1u, residencies.size());
+}
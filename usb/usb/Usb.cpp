@@ -25,8 +25,9 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <unistd.h>
+#include <algorithm>
 #include <chrono>
-#include <regex>
+#include <cstring>
 #include <thread>
 #include <unordered_map>
 
@@ -38,6 +39,7 @@
 #include "Usb.h"
 
 using android::base::GetProperty;
+using android::base::StartsWith;
 using android::base::Trim;
 
 namespace aidl {
@@ -209,8 +211,8 @@ ScopedAStatus Usb::limitPowerTransfer(const string& in_portName, bool in_limit,
 Status queryMoistureDetectionStatus(std::vector<PortStatus> *currentPortStatus) {
     string enabled, status, path, DetectedPath;
 
-    (*currentPortStatus)[0].supportedContaminantProtectionModes
-            .push_back(ContaminantProtectionMode::FORCE_DISABLE);
+    (*currentPortStatus)[0].supportedContaminantProtectionModes =
+            {ContaminantProtectionMode::FORCE_DISABLE};
     (*currentPortStatus)[0].contaminantProtectionStatus = ContaminantProtectionStatus::NONE;
     (*currentPortStatus)[0].contaminantDetectionStatus = ContaminantDetectionStatus::DISABLED;
     (*currentPortStatus)[0].supportsEnableContaminantPresenceDetection = true;
@@ -369,7 +371,8 @@ Usb::Usb()
       mRoleSwitchLock(PTHREAD_MUTEX_INITIALIZER),
       mPartnerLock(PTHREAD_MUTEX_INITIALIZER),
       mPartnerUp(false),
-      mUsbDataEnabled(true) {
+      mUsbDataEnabled(true),
+      mPortStatusValid(false) {
     pthread_condattr_t attr;
     if (pthread_condattr_init(&attr)) {
         ALOGE("pthread_condattr_init failed: %s", strerror(errno));
@@ -456,68 +459,76 @@ Status getAccessoryConnected(const string &portName, string *accessory) {
     return Status::SUCCESS;
 }
 
-Status getCurrentRoleHelper(const string &portName, bool connected, PortRole *currentRole) {
-    string filename;
-    string roleName;
-    string accessory;
+// Reads a role node of a port and extracts the selected role from it
+Status readRoleHelper(const string &portName, const char *node, string *roleName) {
+    string filename = "/sys/class/typec/" + portName + "/" + node;
 
-    if (currentRole->getTag() == PortRole::powerRole) {
-        filename = "/sys/class/typec/" + portName + "/power_role";
-        currentRole->set<PortRole::powerRole>(PortPowerRole::NONE);
-    } else if (currentRole->getTag() == PortRole::dataRole) {
-        filename = "/sys/class/typec/" + portName + "/data_role";
-        currentRole->set<PortRole::dataRole>(PortDataRole::NONE);
-    } else if (currentRole->getTag() == PortRole::mode) {
-        filename = "/sys/class/typec/" + portName + "/data_role";
-        currentRole->set<PortRole::mode>(PortMode::NONE);
-    } else {
+    if (!ReadFileToString(filename, roleName)) {
+        ALOGE("getCurrentRole: Failed to open filesystem node: %s", filename.c_str());
         return Status::ERROR;
     }
+    *roleName = Trim(*roleName);
+    extractRole(roleName);
+    return Status::SUCCESS;
+}
+
+bool canSwitchRoleHelper(const string &portName);
+
+// Fills in the current roles of a port and whether they can be changed.
+// Every node is read at most once: the mode is derived from the same
+// data_role read as the data role.
+Status getPortRolesHelper(const string &portName, bool connected, PortStatus *portStatus) {
+    string powerRole;
+    string dataRole;
+    string accessory;
+
+    portStatus->currentPowerRole = PortPowerRole::NONE;
+    portStatus->currentDataRole = PortDataRole::NONE;
+    portStatus->currentMode = PortMode::NONE;
+    portStatus->canChangeDataRole = false;
+    portStatus->canChangePowerRole = false;
 
     if (!connected)
         return Status::SUCCESS;
 
-    if (currentRole->getTag() == PortRole::mode) {
-        if (getAccessoryConnected(portName, &accessory) != Status::SUCCESS) {
-            return Status::ERROR;
-        }
-        if (accessory == "analog_audio") {
-            currentRole->set<PortRole::mode>(PortMode::AUDIO_ACCESSORY);
-            return Status::SUCCESS;
-        } else if (accessory == "debug") {
-            currentRole->set<PortRole::mode>(PortMode::DEBUG_ACCESSORY);
-            return Status::SUCCESS;
-        }
+    if (readRoleHelper(portName, "power_role", &powerRole) != Status::SUCCESS) {
+        ALOGE("Error while retrieving portNames");
+        return Status::ERROR;
+    }
+    if (powerRole == "source") {
+        portStatus->currentPowerRole = PortPowerRole::SOURCE;
+    } else if (powerRole == "sink") {
+        portStatus->currentPowerRole = PortPowerRole::SINK;
+    } else if (powerRole != "none") {
+        return Status::UNRECOGNIZED_ROLE;
     }
 
-    if (!ReadFileToString(filename, &roleName)) {
-        ALOGE("getCurrentRole: Failed to open filesystem node: %s", filename.c_str());
+    if (readRoleHelper(portName, "data_role", &dataRole) != Status::SUCCESS) {
+        ALOGE("Error while retrieving current port role");
         return Status::ERROR;
     }
-
-    roleName = Trim(roleName);
-    extractRole(&roleName);
-
-    if (roleName == "source") {
-        currentRole->set<PortRole::powerRole>(PortPowerRole::SOURCE);
-    } else if (roleName == "sink") {
-        currentRole->set<PortRole::powerRole>(PortPowerRole::SINK);
-    } else if (roleName == "host") {
-        if (currentRole->getTag() == PortRole::dataRole)
-            currentRole->set<PortRole::dataRole>(PortDataRole::HOST);
-        else
-            currentRole->set<PortRole::mode>(PortMode::DFP);
-    } else if (roleName == "device") {
-        if (currentRole->getTag() == PortRole::dataRole)
-            currentRole->set<PortRole::dataRole>(PortDataRole::DEVICE);
-        else
-            currentRole->set<PortRole::mode>(PortMode::UFP);
-    } else if (roleName != "none") {
-        /* case for none has already been addressed.
-         * so we check if the role isn't none.
-         */
+    if (dataRole == "host") {
+        portStatus->currentDataRole = PortDataRole::HOST;
+        portStatus->currentMode = PortMode::DFP;
+    } else if (dataRole == "device") {
+        portStatus->currentDataRole = PortDataRole::DEVICE;
+        portStatus->currentMode = PortMode::UFP;
+    } else if (dataRole != "none") {
         return Status::UNRECOGNIZED_ROLE;
     }
+
+    if (getAccessoryConnected(portName, &accessory) != Status::SUCCESS) {
+        ALOGE("Error while retrieving current data role");
+        return Status::ERROR;
+    }
+    if (accessory == "analog_audio") {
+        portStatus->currentMode = PortMode::AUDIO_ACCESSORY;
+    } else if (accessory == "debug") {
+        portStatus->currentMode = PortMode::DEBUG_ACCESSORY;
+    }
+
+    portStatus->canChangeDataRole = canSwitchRoleHelper(portName);
+    portStatus->canChangePowerRole = portStatus->canChangeDataRole;
     return Status::SUCCESS;
 }
 
@@ -569,44 +580,21 @@ Status getPortStatusHelper(android::hardware::usb::Usb *usb,
     Status result = getTypeCPortNamesHelper(&names);
     int i = -1;
 
+    usb->mPortConnected.clear();
     if (result == Status::SUCCESS) {
         currentPortStatus->resize(names.size());
         for (std::pair<string, bool> port : names) {
             i++;
             ALOGI("%s", port.first.c_str());
+            usb->mPortConnected[port.first] = port.second;
             (*currentPortStatus)[i].portName = port.first;
 
-            PortRole currentRole;
-            currentRole.set<PortRole::powerRole>(PortPowerRole::NONE);
-            if (getCurrentRoleHelper(port.first, port.second, &currentRole) == Status::SUCCESS){
-                (*currentPortStatus)[i].currentPowerRole = currentRole.get<PortRole::powerRole>();
-            } else {
-                ALOGE("Error while retrieving portNames");
-                goto done;
-            }
-
-            currentRole.set<PortRole::dataRole>(PortDataRole::NONE);
-            if (getCurrentRoleHelper(port.first, port.second, &currentRole) == Status::SUCCESS) {
-                (*currentPortStatus)[i].currentDataRole = currentRole.get<PortRole::dataRole>();
-            } else {
-                ALOGE("Error while retrieving current port role");
-                goto done;
-            }
-
-            currentRole.set<PortRole::mode>(PortMode::NONE);
-            if (getCurrentRoleHelper(port.first, port.second, &currentRole) == Status::SUCCESS) {
-                (*currentPortStatus)[i].currentMode = currentRole.get<PortRole::mode>();
-            } else {
-                ALOGE("Error while retrieving current data role");
+            if (getPortRolesHelper(port.first, port.second, &(*currentPortStatus)[i]) !=
+                Status::SUCCESS) {
                 goto done;
             }
 
             (*currentPortStatus)[i].canChangeMode = true;
-            (*currentPortStatus)[i].canChangeDataRole =
-                port.second ? canSwitchRoleHelper(port.first) : false;
-            (*currentPortStatus)[i].canChangePowerRole =
-                port.second ? canSwitchRoleHelper(port.first) : false;
-
             (*currentPortStatus)[i].supportedModes.push_back(PortMode::DRP);
 
             if (!usb->mUsbDataEnabled) {
@@ -645,21 +633,39 @@ Status queryPowerTransferStatus(std::vector<PortStatus> *currentPortStatus) {
     return Status::SUCCESS;
 }
 
-void queryVersionHelper(android::hardware::usb::Usb *usb,
-                        std::vector<PortStatus> *currentPortStatus) {
-    Status status;
-    pthread_mutex_lock(&usb->mLock);
-    status = getPortStatusHelper(usb, currentPortStatus);
-    queryMoistureDetectionStatus(currentPortStatus);
-    queryPowerTransferStatus(currentPortStatus);
+// Must be called with mLock held
+void notifyPortStatusLocked(android::hardware::usb::Usb *usb, Status status) {
     if (usb->mCallback != NULL) {
-        ScopedAStatus ret = usb->mCallback->notifyPortStatusChange(*currentPortStatus,
-            status);
+        ScopedAStatus ret = usb->mCallback->notifyPortStatusChange(usb->mPortStatus, status);
         if (!ret.isOk())
             ALOGE("queryPortStatus error %s", ret.getDescription().c_str());
     } else {
         ALOGI("Notifying userspace skipped. Callback is NULL");
     }
+}
+
+// Rereads the status of every port into the cache. Must be called with
+// mLock held.
+Status refreshPortStatusLocked(android::hardware::usb::Usb *usb) {
+    Status status;
+
+    usb->mPortStatus.clear();
+    status = getPortStatusHelper(usb, &usb->mPortStatus);
+    if (!usb->mPortStatus.empty()) {
+        queryMoistureDetectionStatus(&usb->mPortStatus);
+        queryPowerTransferStatus(&usb->mPortStatus);
+    }
+    usb->mPortStatusValid = status == Status::SUCCESS;
+    return status;
+}
+
+void queryVersionHelper(android::hardware::usb::Usb *usb,
+                        std::vector<PortStatus> *currentPortStatus) {
+    Status status;
+    pthread_mutex_lock(&usb->mLock);
+    status = refreshPortStatusLocked(usb);
+    *currentPortStatus = usb->mPortStatus;
+    notifyPortStatusLocked(usb, status);
     pthread_mutex_unlock(&usb->mLock);
 }
 
@@ -711,10 +717,105 @@ struct data {
     ::aidl::android::hardware::usb::Usb *usb;
 };
 
+// The parts of a uevent that tell which port status it changes
+struct UeventInfo {
+    string action;
+    string devPath;
+    string devType;
+    bool hasMoisture = false;
+    string moistureDetected;
+};
+
+static void parseUevent(const char *msg, UeventInfo *uevent) {
+    const char *cp = msg;
+
+    while (*cp) {
+        if (StartsWith(cp, "ACTION=")) {
+            uevent->action = cp + strlen("ACTION=");
+        } else if (StartsWith(cp, "DEVPATH=")) {
+            uevent->devPath = cp + strlen("DEVPATH=");
+        } else if (StartsWith(cp, "DEVTYPE=")) {
+            uevent->devType = cp + strlen("DEVTYPE=");
+        } else if (StartsWith(cp, "POWER_SUPPLY_MOISTURE_DETECTED=")) {
+            uevent->hasMoisture = true;
+            uevent->moistureDetected = cp + strlen("POWER_SUPPLY_MOISTURE_DETECTED=");
+        }
+        /* advance to after the next \0 */
+        while (*cp++) {
+        }
+    }
+}
+
+// Returns the port a typec device belongs to, e.g. port0 for
+// .../typec/port0/port0-partner/port0-partner.0
+static string portNameFromDevPath(const string &devPath) {
+    string name = devPath.substr(devPath.rfind('/') + 1);
+    return name.substr(0, name.find_first_of("-."));
+}
+
+// Refreshes only the part of the cached port status that a uevent reports
+// a change to, and notifies the callback if anything was refreshed. Falls
+// back to reading every port if the cache does not know the port yet.
+// Returns false if the uevent changes nothing the cache tracks.
+static bool updatePortStatusHelper(android::hardware::usb::Usb *usb,
+                                   const UeventInfo &uevent,
+                                   std::vector<string> *portNames) {
+    Status status = Status::SUCCESS;
+    bool typec = StartsWith(uevent.devType, "typec_");
+
+    if (!typec && !uevent.hasMoisture)
+        return false;
+
+    pthread_mutex_lock(&usb->mLock);
+    if (typec) {
+        string portName = portNameFromDevPath(uevent.devPath);
+        auto connected = usb->mPortConnected.find(portName);
+        auto port = std::find_if(usb->mPortStatus.begin(), usb->mPortStatus.end(),
+                                 [&](const PortStatus &p) { return p.portName == portName; });
+
+        // Ports coming or going change the set of ports itself
+        if (!usb->mPortStatusValid || connected == usb->mPortConnected.end() ||
+            port == usb->mPortStatus.end() ||
+            (uevent.devType == "typec_port" && uevent.action != "change")) {
+            status = refreshPortStatusLocked(usb);
+        } else {
+            if (uevent.devType == "typec_partner" && uevent.action == "add")
+                connected->second = true;
+            else if (uevent.devType == "typec_partner" && uevent.action == "remove")
+                connected->second = false;
+            status = getPortRolesHelper(portName, connected->second, &*port);
+            ALOGI("%s connected:%d canChagedata:%d canChangePower:%d", portName.c_str(),
+                  connected->second, port->canChangeDataRole, port->canChangePowerRole);
+        }
+    } else {
+        if (usb->mPortStatusValid && uevent.moistureDetected == usb->mMoistureDetected) {
+            pthread_mutex_unlock(&usb->mLock);
+            return false;
+        }
+        if (!usb->mPortStatusValid)
+            status = refreshPortStatusLocked(usb);
+        else if (!usb->mPortStatus.empty())
+            status = queryMoistureDetectionStatus(&usb->mPortStatus);
+    }
+    // A partial refresh that failed may have left the port half updated,
+    // so have the next uevent read every port again
+    if (status != Status::SUCCESS)
+        usb->mPortStatusValid = false;
+    if (uevent.hasMoisture)
+        usb->mMoistureDetected = uevent.moistureDetected;
+
+    for (const PortStatus &port : usb->mPortStatus)
+        portNames->push_back(port.portName);
+    notifyPortStatusLocked(usb, status);
+    pthread_mutex_unlock(&usb->mLock);
+    return true;
+}
+
 static void uevent_event(uint32_t /*epevents*/, struct data *payload) {
     char msg[UEVENT_MSG_LEN + 2];
-    char *cp;
     int n;
+    UeventInfo uevent;
+    std::vector<string> portNames;
 
     n = uevent_kernel_multicast_recv(payload->uevent_fd, msg, UEVENT_MSG_LEN);
     if (n <= 0)
@@ -724,41 +825,30 @@ static void uevent_event(uint32_t /*epevents*/, struct data *payload) {
 
     msg[n] = '\0';
     msg[n + 1] = '\0';
-    cp = msg;
+    parseUevent(msg, &uevent);
 
-    while (*cp) {
-        if (std::regex_match(cp, std::regex("(add)(.*)(-partner)"))) {
-            ALOGI("partner added");
-            pthread_mutex_lock(&payload->usb->mPartnerLock);
-            payload->usb->mPartnerUp = true;
-            pthread_cond_signal(&payload->usb->mPartnerCV);
-            pthread_mutex_unlock(&payload->usb->mPartnerLock);
-        } else if (!strncmp(cp, "DEVTYPE=typec_", strlen("DEVTYPE=typec_")) ||
-                   !strncmp(cp, "POWER_SUPPLY_MOISTURE_DETECTED",
-                            strlen("POWER_SUPPLY_MOISTURE_DETECTED"))) {
-            std::vector<PortStatus> currentPortStatus;
-            queryVersionHelper(payload->usb, &currentPortStatus);
-
-            // Role switch is not in progress and port is in disconnected state
-            if (!pthread_mutex_trylock(&payload->usb->mRoleSwitchLock)) {
-                for (unsigned long i = 0; i < currentPortStatus.size(); i++) {
-                    DIR *dp =
-                        opendir(string("/sys/class/typec/" +
-                                            string(currentPortStatus[i].portName.c_str()) +
-                                            "-partner").c_str());
-                    if (dp == NULL) {
-                        switchToDrp(currentPortStatus[i].portName);
-                    } else {
-                        closedir(dp);
-                    }
-                }
-                pthread_mutex_unlock(&payload->usb->mRoleSwitchLock);
+    if (uevent.action == "add" && uevent.devType == "typec_partner") {
+        ALOGI("partner added");
+        pthread_mutex_lock(&payload->usb->mPartnerLock);
+        payload->usb->mPartnerUp = true;
+        pthread_cond_signal(&payload->usb->mPartnerCV);
+        pthread_mutex_unlock(&payload->usb->mPartnerLock);
+    }
+
+    if (!updatePortStatusHelper(payload->usb, uevent, &portNames))
+        return;
+
+    // Role switch is not in progress and port is in disconnected state
+    if (!pthread_mutex_trylock(&payload->usb->mRoleSwitchLock)) {
+        for (const string &portName : portNames) {
+            DIR *dp = opendir(string("/sys/class/typec/" + portName + "-partner").c_str());
+            if (dp == NULL) {
+                switchToDrp(portName);
+            } else {
+                closedir(dp);
             }
-            break;
-        }
-        /* advance to after the next \0 */
-        while (*cp++) {
         }
+        pthread_mutex_unlock(&payload->usb->mRoleSwitchLock);
     }
 }
 
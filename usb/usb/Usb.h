@@ -21,6 +21,9 @@
 #include <aidl/android/hardware/usb/BnUsbCallback.h>
 #include <utils/Log.h>
 
+#include <unordered_map>
+#include <vector>
+
 #define UEVENT_MSG_LEN 2048
 // The type-c stack waits for 4.5 - 5.5 secs before declaring a port non-pd.
 // The -partner directory would not be created until this is done.
@@ -82,6 +85,15 @@ struct Usb : public BnUsb {
     bool mPartnerUp;
     // Usb Data status
     bool mUsbDataEnabled;
+    // Status of every port as last read from sysfs. uevents only refresh
+    // the parts of it they report a change to. Protected by mLock.
+    std::vector<PortStatus> mPortStatus;
+    // Whether a partner is attached to each port in mPortStatus
+    std::unordered_map<string, bool> mPortConnected;
+    // Set once mPortStatus has been read in full
+    bool mPortStatusValid;
+    // Last POWER_SUPPLY_MOISTURE_DETECTED value seen in a uevent
+    string mMoistureDetected;
 
   private:
     pthread_t mPoll;